@@ -0,0 +1,119 @@
+// Throughput of cutting data into blocks and fingerprinting them, as it's done
+// by file_write, for fixed size blocks versus content defined chunking. Also
+// shows how many blocks survive a single byte inserted into the middle.
+//
+// Usage: chunking-bench [megabytes = 256]
+
+#include "cdc.h"
+#include "murmur3.h"
+
+#include <chrono>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const uint32_t HASH_SEED = 42;
+
+struct fingerprint {
+    uint64_t data[2];
+
+    bool operator<(const fingerprint& other) const {
+        return data[0] != other.data[0] ? data[0] < other.data[0] : data[1] < other.data[1];
+    }
+};
+
+typedef size_t (*chunk_function)(const void* context, const char* data, size_t size);
+
+static size_t fixed_chunk(const void* context, const char*, size_t size) {
+    size_t block_size = *(const size_t*) context;
+    return size < block_size ? size : block_size;
+}
+
+static size_t content_defined_chunk(const void* context, const char* data, size_t size) {
+    return cdc_next_chunk((const cdc_chunker*) context, data, size);
+}
+
+static void split(std::vector<fingerprint>* fingerprints, chunk_function next_chunk,
+                  const void* context, const char* data, size_t size) {
+    while (size != 0) {
+        size_t chunk = next_chunk(context, data, size);
+
+        fingerprint current;
+        murmur3_x64_128(data, (int) chunk, HASH_SEED, &current);
+        fingerprints->push_back(current);
+
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+static void run(const char* name, chunk_function next_chunk, const void* context,
+                const std::vector<char>& original, const std::vector<char>& edited) {
+
+    std::vector<fingerprint> fingerprints;
+    fingerprints.reserve(original.size() / 1024);
+
+    auto start = std::chrono::steady_clock::now();
+    split(&fingerprints, next_chunk, context, original.data(), original.size());
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double megabytes = (double) original.size() / (1024.0 * 1024.0);
+
+    size_t original_blocks = fingerprints.size();
+    std::set<fingerprint> known(fingerprints.begin(), fingerprints.end());
+
+    fingerprints.clear();
+    split(&fingerprints, next_chunk, context, edited.data(), edited.size());
+
+    size_t reused = 0;
+    for (const fingerprint& current: fingerprints)
+        reused += known.count(current);
+
+    printf("%-24s %10.1f MB/s %10zu blocks %8zu avg bytes %8.2f%% reused after insert\n",
+           name, megabytes / seconds, original_blocks, original.size() / original_blocks,
+           100.0 * (double) reused / (double) fingerprints.size());
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t) atol(argv[1]) : 256;
+
+    std::vector<char> original(megabytes * 1024 * 1024);
+
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i < original.size(); i += sizeof(uint64_t)) {
+        uint64_t value = random();
+        memcpy(&original[i], &value, std::min(sizeof(value), original.size() - i));
+    }
+
+    // Same data with one byte inserted in the middle
+    std::vector<char> edited(original);
+    edited.insert(edited.begin() + (long) (edited.size() / 2), 'x');
+
+    for (size_t block_size: { 4096ul, 16384ul, 65536ul }) {
+        char name[64];
+        snprintf(name, sizeof(name), "fixed %zu", block_size);
+
+        run(name, fixed_chunk, &block_size, original, edited);
+    }
+
+    const size_t CDC_PARAMETERS[][3] = {
+        { 1024,  4096, 32768 },
+        { 2048,  8192, 65536 },
+        { 4096, 16384, 65536 }
+    };
+
+    for (auto& parameters: CDC_PARAMETERS) {
+        cdc_chunker chunker;
+        TRY cdc_chunker_create(&chunker, parameters[0], parameters[1], parameters[2])
+            THROW("Invalid chunker parameters!");
+
+        char name[64];
+        snprintf(name, sizeof(name), "cdc %zu/%zu/%zu", parameters[0], parameters[1], parameters[2]);
+
+        run(name, content_defined_chunk, &chunker, original, edited);
+    }
+}
@@ -0,0 +1,86 @@
+// Single core throughput of fingerprint backends, for blocks of different
+// sizes, hashed one by one as file_write does, and in batches of 8. Same
+// buffer that fits in cache is hashed over and over, so memory bandwidth
+// doesn't hide the difference between backends.
+//
+// Usage: fingerprint-bench [megabytes = 4096]
+
+#include "fingerprint.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const size_t BATCH_SIZE = 8;
+const size_t BUFFER_SIZE = 1024 * 1024;
+
+// Results end up here, so hashing them can't be optimized out
+static volatile uint32_t sink;
+
+static double measure(const fingerprinter* target, const std::vector<char>& data,
+                      size_t block_size, bool batched, size_t repetitions) {
+
+    const size_t blocks = data.size() / block_size;
+    std::vector<fingerprint> results(blocks);
+
+    std::vector<const void*> buffers(blocks);
+    std::vector<size_t> sizes(blocks, block_size);
+
+    for (size_t i = 0; i < blocks; ++ i)
+        buffers[i] = data.data() + i * block_size;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t repetition = 0; repetition < repetitions; ++ repetition) {
+        if (batched)
+            for (size_t i = 0; i < blocks; i += BATCH_SIZE)
+                fingerprint_compute_batch(target, &buffers[i], &sizes[i],
+                                          std::min(BATCH_SIZE, blocks - i), &results[i]);
+        else
+            for (size_t i = 0; i < blocks; ++ i)
+                fingerprint_compute(target, buffers[i], block_size, &results[i]);
+
+        // Every repetition's results count as used, not only the last one's
+        asm volatile("" :: "r"(results.data()) : "memory");
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    uint32_t checksum = 0;
+    for (const fingerprint& result: results)
+        checksum ^= result.data[0];
+
+    sink = checksum;
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return (double) (repetitions * blocks * block_size) / (1024.0 * 1024.0) / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t) atol(argv[1]) : 4096;
+    size_t repetitions = std::max(megabytes * 1024 * 1024 / BUFFER_SIZE, (size_t) 1);
+
+    std::vector<char> data(BUFFER_SIZE);
+
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i < data.size(); i += sizeof(uint64_t)) {
+        uint64_t value = random();
+        memcpy(&data[i], &value, std::min(sizeof(value), data.size() - i));
+    }
+
+    printf("%-10s %10s %14s %14s\n", "backend", "block", "single MB/s", "batch MB/s");
+
+    for (fingerprint_backend backend: { FINGERPRINT_MURMUR3, FINGERPRINT_CRC32C, FINGERPRINT_XXH }) {
+        fingerprinter target;
+        TRY fingerprinter_create(&target, backend)
+            THROW("Can't create fingerprinter!");
+
+        for (size_t block_size: { 4096ul, 8192ul, 65536ul })
+            printf("%-10s %10zu %14.1f %14.1f\n", fingerprint_backend_name(backend), block_size,
+                   measure(&target, data, block_size, false, repetitions),
+                   measure(&target, data, block_size, true,  repetitions));
+    }
+}
@@ -0,0 +1,85 @@
+#include "cdc.h"
+
+#include <array>
+
+// Table of random numbers for every byte value, it's generated at
+// compile time with splitmix64, so chunks are same between builds
+static constexpr std::array<uint64_t, 256> generate_gear_table() {
+    std::array<uint64_t, 256> table {};
+
+    uint64_t state = 0x6465646673ull; // "dedfs"
+    for (uint64_t& value: table) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        value = z ^ (z >> 31);
+    }
+
+    return table;
+}
+
+static constexpr std::array<uint64_t, 256> GEAR = generate_gear_table();
+
+// Gear hash is shifted left on every byte, so it's upper bits that
+// depend on the longest window of input, masks are taken from there
+static uint64_t make_mask(int bits) {
+    return bits <= 0 ? 0 : ~0ull << (64 - bits);
+}
+
+stack_trace* cdc_chunker_create(cdc_chunker* chunker,
+                                size_t min_size, size_t avg_size, size_t max_size) {
+
+    if (avg_size == 0 || (avg_size & (avg_size - 1)) != 0)
+        return FAILURE(RUNTIME_ERROR, "Average chunk size %zu isn't a power of two!", avg_size);
+
+    if (min_size == 0 || min_size > avg_size || avg_size > max_size)
+        return FAILURE(RUNTIME_ERROR, "Chunk sizes should satisfy 0 < min (%zu) <= "
+                       "avg (%zu) <= max (%zu)!", min_size, avg_size, max_size);
+
+    const int bits = __builtin_ctzll(avg_size);
+
+    // Normalization level 2, as recommended by FastCDC
+    const int NORMALIZATION = 2;
+
+    *chunker = {
+        .min_size = min_size, .avg_size = avg_size, .max_size = max_size,
+
+        .mask_small = make_mask(bits + NORMALIZATION),
+        .mask_large = make_mask(bits - NORMALIZATION)
+    };
+
+    return SUCCESS();
+}
+
+size_t cdc_next_chunk(const cdc_chunker* chunker, const char* data, size_t size) {
+    if (size <= chunker->min_size)
+        return size;
+
+    const unsigned char* bytes = (const unsigned char*) data;
+
+    size_t normal_size = chunker->avg_size;
+    if (normal_size > size)
+        normal_size = size;
+
+    size_t max_size = chunker->max_size;
+    if (max_size > size)
+        max_size = size;
+
+    // Bytes before min_size can't produce a boundary, so skip them
+    uint64_t hash = 0;
+    size_t i = chunker->min_size;
+
+    for (; i < normal_size; ++ i) {
+        hash = (hash << 1) + GEAR[bytes[i]];
+        if (!(hash & chunker->mask_small))
+            return i + 1;
+    }
+
+    for (; i < max_size; ++ i) {
+        hash = (hash << 1) + GEAR[bytes[i]];
+        if (!(hash & chunker->mask_large))
+            return i + 1;
+    }
+
+    return max_size;
+}
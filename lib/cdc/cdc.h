@@ -0,0 +1,25 @@
+#pragma once
+
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content defined chunking (FastCDC flavour of Gear hash), chunk
+// boundaries depend only on bytes near them, so inserting data in
+// the middle of a file changes only chunks around insertion point.
+struct cdc_chunker {
+    size_t min_size, avg_size, max_size;
+
+    // Harder to satisfy mask is used before average size is reached
+    // and easier one after it, this keeps chunk sizes close to average
+    uint64_t mask_small, mask_large;
+};
+
+// Average size should be a power of two, min_size <= avg_size <= max_size
+stack_trace* cdc_chunker_create(cdc_chunker* chunker,
+                                size_t min_size, size_t avg_size, size_t max_size);
+
+// Length of the chunk starting at /data/, it never exceeds /size/, so
+// the last chunk of the buffer can end on buffer's end, not on content
+size_t cdc_next_chunk(const cdc_chunker* chunker, const char* data, size_t size);
@@ -0,0 +1,521 @@
+#include "fingerprint.h"
+
+#include <algorithm>
+#include <array>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINGERPRINT_X86
+#endif
+
+const uint32_t FINGERPRINT_SEED = 42;
+
+static inline uint64_t read64(const uint8_t* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static void store(fingerprint* result, uint64_t low, uint64_t high) {
+    memcpy(&result->data[0], &low,  sizeof(low));
+    memcpy(&result->data[2], &high, sizeof(high));
+}
+
+// Backends that don't hash several buffers at once just go one by one
+template <fingerprint_function compute>
+static void compute_one_by_one(const void* const* data, const size_t* sizes,
+                               size_t count, fingerprint* results) {
+    for (size_t i = 0; i < count; ++ i)
+        compute(data[i], sizes[i], &results[i]);
+}
+
+
+// ==================================> murmur3 <==================================
+
+// Same as murmur3_x64_128 from "lib/murmur3", but split in steps, so that
+// several buffers can go through the body in lockstep. Every buffer has two
+// dependent multiply chains, interleaving them keeps multiplier busy.
+
+const uint64_t MURMUR3_C1 = 0x87c37b91114253d5ull;
+const uint64_t MURMUR3_C2 = 0x4cf5ad432745937full;
+
+const size_t MURMUR3_BLOCK = 16;
+
+struct murmur3_state {
+    uint64_t h1, h2;
+};
+
+static inline uint64_t murmur3_fmix64(uint64_t k) {
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline void murmur3_round(murmur3_state* state, const uint8_t* block) {
+    uint64_t k1 = read64(block), k2 = read64(block + 8);
+
+    k1 *= MURMUR3_C1; k1 = rotl64(k1, 31); k1 *= MURMUR3_C2; state->h1 ^= k1;
+    state->h1 = rotl64(state->h1, 27); state->h1 += state->h2; state->h1 = state->h1 * 5 + 0x52dce729;
+
+    k2 *= MURMUR3_C2; k2 = rotl64(k2, 33); k2 *= MURMUR3_C1; state->h2 ^= k2;
+    state->h2 = rotl64(state->h2, 31); state->h2 += state->h1; state->h2 = state->h2 * 5 + 0x38495ab5;
+}
+
+// Hashes blocks starting from /first_block/, then tail, and finalizes
+static void murmur3_finish(murmur3_state state, const uint8_t* data, size_t size,
+                           size_t first_block, fingerprint* result) {
+    const size_t blocks = size / MURMUR3_BLOCK;
+    for (size_t i = first_block; i < blocks; ++ i)
+        murmur3_round(&state, data + i * MURMUR3_BLOCK);
+
+    const uint8_t* tail = data + blocks * MURMUR3_BLOCK;
+    const size_t tail_size = size % MURMUR3_BLOCK;
+
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = tail_size; i > 8; -- i)
+        k2 ^= (uint64_t) tail[i - 1] << ((i - 9) * 8);
+
+    for (size_t i = std::min(tail_size, (size_t) 8); i > 0; -- i)
+        k1 ^= (uint64_t) tail[i - 1] << ((i - 1) * 8);
+
+    if (tail_size > 8) {
+        k2 *= MURMUR3_C2; k2 = rotl64(k2, 33); k2 *= MURMUR3_C1; state.h2 ^= k2;
+    }
+
+    if (tail_size > 0) {
+        k1 *= MURMUR3_C1; k1 = rotl64(k1, 31); k1 *= MURMUR3_C2; state.h1 ^= k1;
+    }
+
+    state.h1 ^= size; state.h2 ^= size;
+
+    state.h1 += state.h2; state.h2 += state.h1;
+
+    state.h1 = murmur3_fmix64(state.h1);
+    state.h2 = murmur3_fmix64(state.h2);
+
+    state.h1 += state.h2; state.h2 += state.h1;
+
+    store(result, state.h1, state.h2);
+}
+
+static void murmur3_compute(const void* data, size_t size, fingerprint* result) {
+    murmur3_finish({ FINGERPRINT_SEED, FINGERPRINT_SEED }, (const uint8_t*) data, size, 0, result);
+}
+
+const size_t MURMUR3_LANES = 4;
+
+static void murmur3_compute_batch(const void* const* data, const size_t* sizes,
+                                  size_t count, fingerprint* results) {
+    for (size_t first = 0; first < count; first += MURMUR3_LANES) {
+        const size_t lanes = std::min(MURMUR3_LANES, count - first);
+
+        murmur3_state states[MURMUR3_LANES];
+        const uint8_t* buffers[MURMUR3_LANES];
+
+        size_t common_blocks = SIZE_MAX;
+        for (size_t lane = 0; lane < lanes; ++ lane) {
+            states[lane] = { FINGERPRINT_SEED, FINGERPRINT_SEED };
+            buffers[lane] = (const uint8_t*) data[first + lane];
+
+            common_blocks = std::min(common_blocks, sizes[first + lane] / MURMUR3_BLOCK);
+        }
+
+        // Blocks are usually same size, so most of the work is done here
+        if (lanes == MURMUR3_LANES)
+            for (size_t i = 0; i < common_blocks; ++ i)
+                for (size_t lane = 0; lane < MURMUR3_LANES; ++ lane)
+                    murmur3_round(&states[lane], buffers[lane] + i * MURMUR3_BLOCK);
+        else
+            common_blocks = 0;
+
+        for (size_t lane = 0; lane < lanes; ++ lane)
+            murmur3_finish(states[lane], buffers[lane], sizes[first + lane],
+                           common_blocks, &results[first + lane]);
+    }
+}
+
+
+// ==================================> CRC32C <===================================
+
+// Each of four lanes takes every fourth 8 byte word, so there are four
+// independent CRC chains, which hides latency of CRC32 instruction
+
+const size_t CRC32C_LANES = 4;
+const size_t CRC32C_STRIPE = CRC32C_LANES * sizeof(uint64_t);
+
+static constexpr std::array<uint32_t, 256> generate_crc32c_table() {
+    std::array<uint32_t, 256> table {};
+
+    for (uint32_t byte = 0; byte < 256; ++ byte) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; ++ bit)
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+
+        table[byte] = crc;
+    }
+
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> CRC32C_TABLE = generate_crc32c_table();
+
+static inline uint32_t crc32c_u8_table(uint32_t crc, uint8_t value) {
+    return (crc >> 8) ^ CRC32C_TABLE[(crc ^ value) & 0xFF];
+}
+
+static inline uint32_t crc32c_u64_table(uint32_t crc, uint64_t value) {
+    for (int i = 0; i < 8; ++ i, value >>= 8)
+        crc = crc32c_u8_table(crc, (uint8_t) value);
+
+    return crc;
+}
+
+#ifdef FINGERPRINT_X86
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_u8_sse42(uint32_t crc, uint8_t value) {
+    return _mm_crc32_u8(crc, value);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_u64_sse42(uint32_t crc, uint64_t value) {
+    return (uint32_t) _mm_crc32_u64(crc, value);
+}
+#endif
+
+template <uint32_t (*crc_u8)(uint32_t, uint8_t), uint32_t (*crc_u64)(uint32_t, uint64_t)>
+static inline __attribute__((always_inline))
+void crc32c_compute(const void* data, size_t size, fingerprint* result) {
+    const uint8_t* current = (const uint8_t*) data;
+
+    uint32_t lanes[CRC32C_LANES];
+    for (size_t lane = 0; lane < CRC32C_LANES; ++ lane)
+        lanes[lane] = ~0u ^ (uint32_t) (lane * 0x9E3779B9u);
+
+    size_t left = size;
+    for (; left >= CRC32C_STRIPE; left -= CRC32C_STRIPE, current += CRC32C_STRIPE)
+        for (size_t lane = 0; lane < CRC32C_LANES; ++ lane)
+            lanes[lane] = crc_u64(lanes[lane], read64(current + lane * sizeof(uint64_t)));
+
+    // Whole words of the last stripe go to their lanes, rest of bytes to the last lane
+    size_t lane = 0;
+    for (; left >= sizeof(uint64_t); left -= sizeof(uint64_t), current += sizeof(uint64_t))
+        lanes[lane] = crc_u64(lanes[lane], read64(current)), ++ lane;
+
+    for (; left != 0; -- left, ++ current)
+        lanes[CRC32C_LANES - 1] = crc_u8(lanes[CRC32C_LANES - 1], *current);
+
+    // Otherwise zero padded blocks of different size could collide
+    for (size_t lane = 0; lane < CRC32C_LANES; ++ lane)
+        result->data[lane] = ~crc_u64(lanes[lane], size);
+}
+
+static void crc32c_compute_table(const void* data, size_t size, fingerprint* result) {
+    crc32c_compute<crc32c_u8_table, crc32c_u64_table>(data, size, result);
+}
+
+#ifdef FINGERPRINT_X86
+__attribute__((target("sse4.2")))
+static void crc32c_compute_sse42(const void* data, size_t size, fingerprint* result) {
+    crc32c_compute<crc32c_u8_sse42, crc32c_u64_sse42>(data, size, result);
+}
+#endif
+
+
+// ====================================> xxh <====================================
+
+// Hash in the style of xxh3 (but not compatible with it): eight 64-bit lanes
+// accumulate products of 32-bit halves of input mixed with a secret, over
+// 64 byte stripes. Every 16 stripes accumulators are scrambled. Vector
+// versions only differ in how accumulation and scrambling are done.
+
+const size_t XXH_LANES = 8;
+const size_t XXH_STRIPE = XXH_LANES * sizeof(uint64_t);
+const size_t XXH_STRIPES_PER_BLOCK = 16;
+const size_t XXH_BLOCK = XXH_STRIPE * XXH_STRIPES_PER_BLOCK;
+
+const size_t XXH_SECRET_SIZE = 192;
+const size_t XXH_SECRET_STEP = 8; // Secret shifts by this for every stripe in block
+
+const uint64_t XXH_PRIME32_1 = 0x9E3779B1u;
+const uint64_t XXH_PRIME32_2 = 0x85EBCA77u;
+const uint64_t XXH_PRIME32_3 = 0xC2B2AE3Du;
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+// Generated at compile time with splitmix64, like GEAR table in "lib/cdc"
+static constexpr std::array<uint64_t, XXH_SECRET_SIZE / sizeof(uint64_t)> generate_xxh_secret() {
+    std::array<uint64_t, XXH_SECRET_SIZE / sizeof(uint64_t)> secret {};
+
+    uint64_t state = 0x66696e6765727072ull; // "fingerpr"
+    for (uint64_t& value: secret) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        value = z ^ (z >> 31);
+    }
+
+    return secret;
+}
+
+alignas(64) static constexpr std::array<uint64_t, XXH_SECRET_SIZE / sizeof(uint64_t)> XXH_SECRET =
+    generate_xxh_secret();
+
+static inline const uint8_t* xxh_secret(size_t offset) {
+    return (const uint8_t*) XXH_SECRET.data() + offset;
+}
+
+// Accumulates /stripes/ consecutive stripes, secret is shifted for each of them
+typedef void (*xxh_accumulate_function)(uint64_t* accumulators, const uint8_t* data,
+                                        size_t stripes, const uint8_t* secret);
+
+typedef void (*xxh_scramble_function)(uint64_t* accumulators, const uint8_t* secret);
+
+static void xxh_accumulate_scalar(uint64_t* accumulators, const uint8_t* data,
+                                  size_t stripes, const uint8_t* secret) {
+    for (size_t stripe = 0; stripe < stripes; ++ stripe) {
+        const uint8_t* input = data + stripe * XXH_STRIPE;
+        const uint8_t* key = secret + stripe * XXH_SECRET_STEP;
+
+        for (size_t lane = 0; lane < XXH_LANES; ++ lane) {
+            uint64_t value = read64(input + lane * sizeof(uint64_t));
+            uint64_t mixed = value ^ read64(key + lane * sizeof(uint64_t));
+
+            accumulators[lane ^ 1] += value;
+            accumulators[lane] += (mixed & 0xFFFFFFFFu) * (mixed >> 32);
+        }
+    }
+}
+
+static void xxh_scramble_scalar(uint64_t* accumulators, const uint8_t* secret) {
+    for (size_t lane = 0; lane < XXH_LANES; ++ lane) {
+        uint64_t value = accumulators[lane];
+
+        value ^= value >> 47;
+        value ^= read64(secret + lane * sizeof(uint64_t));
+
+        accumulators[lane] = value * XXH_PRIME32_1;
+    }
+}
+
+#ifdef FINGERPRINT_X86
+static void xxh_accumulate_sse2(uint64_t* accumulators, const uint8_t* data,
+                                size_t stripes, const uint8_t* secret) {
+    __m128i lanes[XXH_LANES / 2];
+    for (size_t i = 0; i < XXH_LANES / 2; ++ i)
+        lanes[i] = _mm_loadu_si128((const __m128i*) accumulators + i);
+
+    for (size_t stripe = 0; stripe < stripes; ++ stripe) {
+        const __m128i* input = (const __m128i*) (data + stripe * XXH_STRIPE);
+        const __m128i* key = (const __m128i*) (secret + stripe * XXH_SECRET_STEP);
+
+        for (size_t i = 0; i < XXH_LANES / 2; ++ i) {
+            __m128i value = _mm_loadu_si128(input + i);
+            __m128i mixed = _mm_xor_si128(value, _mm_loadu_si128(key + i));
+
+            // Low half of every 64-bit lane times its high half
+            __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+        }
+    }
+
+    for (size_t i = 0; i < XXH_LANES / 2; ++ i)
+        _mm_storeu_si128((__m128i*) accumulators + i, lanes[i]);
+}
+
+static void xxh_scramble_sse2(uint64_t* accumulators, const uint8_t* secret) {
+    const __m128i prime = _mm_set1_epi32((int) XXH_PRIME32_1);
+
+    for (size_t i = 0; i < XXH_LANES / 2; ++ i) {
+        __m128i value = _mm_loadu_si128((const __m128i*) accumulators + i);
+
+        value = _mm_xor_si128(value, _mm_srli_epi64(value, 47));
+        value = _mm_xor_si128(value, _mm_loadu_si128((const __m128i*) secret + i));
+
+        // 64-bit by 32-bit multiplication made of two 32-bit ones
+        __m128i low  = _mm_mul_epu32(value, prime);
+        __m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+
+        value = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+        _mm_storeu_si128((__m128i*) accumulators + i, value);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xxh_accumulate_avx2(uint64_t* accumulators, const uint8_t* data,
+                                size_t stripes, const uint8_t* secret) {
+    __m256i lanes[XXH_LANES / 4];
+    for (size_t i = 0; i < XXH_LANES / 4; ++ i)
+        lanes[i] = _mm256_loadu_si256((const __m256i*) accumulators + i);
+
+    for (size_t stripe = 0; stripe < stripes; ++ stripe) {
+        const __m256i* input = (const __m256i*) (data + stripe * XXH_STRIPE);
+        const __m256i* key = (const __m256i*) (secret + stripe * XXH_SECRET_STEP);
+
+        for (size_t i = 0; i < XXH_LANES / 4; ++ i) {
+            __m256i value = _mm256_loadu_si256(input + i);
+            __m256i mixed = _mm256_xor_si256(value, _mm256_loadu_si256(key + i));
+
+            __m256i product = _mm256_mul_epu32(mixed, _mm256_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+
+            lanes[i] = _mm256_add_epi64(lanes[i], _mm256_add_epi64(product, swapped));
+        }
+    }
+
+    for (size_t i = 0; i < XXH_LANES / 4; ++ i)
+        _mm256_storeu_si256((__m256i*) accumulators + i, lanes[i]);
+}
+
+__attribute__((target("avx2")))
+static void xxh_scramble_avx2(uint64_t* accumulators, const uint8_t* secret) {
+    const __m256i prime = _mm256_set1_epi32((int) XXH_PRIME32_1);
+
+    for (size_t i = 0; i < XXH_LANES / 4; ++ i) {
+        __m256i value = _mm256_loadu_si256((const __m256i*) accumulators + i);
+
+        value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+        value = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i*) secret + i));
+
+        __m256i low  = _mm256_mul_epu32(value, prime);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+
+        value = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+        _mm256_storeu_si256((__m256i*) accumulators + i, value);
+    }
+}
+#endif
+
+static inline uint64_t xxh_fold64(uint64_t first, uint64_t second) {
+    __uint128_t product = (__uint128_t) first * second;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t xxh_avalanche(uint64_t hash) {
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ull;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t xxh_merge(const uint64_t* accumulators, const uint8_t* secret, uint64_t start) {
+    uint64_t result = start;
+    for (size_t i = 0; i < XXH_LANES; i += 2)
+        result += xxh_fold64(accumulators[i]     ^ read64(secret + i * sizeof(uint64_t)),
+                             accumulators[i + 1] ^ read64(secret + (i + 1) * sizeof(uint64_t)));
+
+    return xxh_avalanche(result);
+}
+
+static inline __attribute__((always_inline))
+void xxh_compute(xxh_accumulate_function accumulate, xxh_scramble_function scramble,
+                 const void* data, size_t size, fingerprint* result) {
+
+    const uint8_t* input = (const uint8_t*) data;
+
+    alignas(32) uint64_t accumulators[XXH_LANES] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+
+    const uint8_t* scramble_secret = xxh_secret(XXH_SECRET_SIZE - XXH_STRIPE);
+
+    size_t left = size;
+    for (; left >= XXH_BLOCK; left -= XXH_BLOCK, input += XXH_BLOCK) {
+        accumulate(accumulators, input, XXH_STRIPES_PER_BLOCK, xxh_secret(0));
+        scramble(accumulators, scramble_secret);
+    }
+
+    // Whole stripes of the last block, and then last stripe of the whole input,
+    // which may overlap with them, or be zero padded if input is that short
+    const size_t stripes = left / XXH_STRIPE;
+    accumulate(accumulators, input, stripes, xxh_secret(0));
+
+    const uint8_t* last_secret = xxh_secret(XXH_SECRET_SIZE - XXH_STRIPE - 7);
+    if (size >= XXH_STRIPE)
+        accumulate(accumulators, (const uint8_t*) data + size - XXH_STRIPE, 1, last_secret);
+    else {
+        uint8_t padded[XXH_STRIPE] = {};
+        memcpy(padded, data, size);
+
+        accumulate(accumulators, padded, 1, last_secret);
+    }
+
+    uint64_t low  = xxh_merge(accumulators, xxh_secret(11), size * XXH_PRIME64_1);
+    uint64_t high = xxh_merge(accumulators, xxh_secret(XXH_SECRET_SIZE - XXH_STRIPE - 11),
+                              ~(size * XXH_PRIME64_2));
+
+    store(result, low, high);
+}
+
+static void xxh_compute_scalar(const void* data, size_t size, fingerprint* result) {
+    xxh_compute(xxh_accumulate_scalar, xxh_scramble_scalar, data, size, result);
+}
+
+#ifdef FINGERPRINT_X86
+static void xxh_compute_sse2(const void* data, size_t size, fingerprint* result) {
+    xxh_compute(xxh_accumulate_sse2, xxh_scramble_sse2, data, size, result);
+}
+
+static void xxh_compute_avx2(const void* data, size_t size, fingerprint* result) {
+    xxh_compute(xxh_accumulate_avx2, xxh_scramble_avx2, data, size, result);
+}
+#endif
+
+
+// =================================> Selection <=================================
+
+stack_trace* fingerprinter_create(fingerprinter* target, fingerprint_backend backend) {
+#ifdef FINGERPRINT_X86
+    __builtin_cpu_init();
+#endif
+
+    switch (backend) {
+    case FINGERPRINT_MURMUR3:
+        *target = { backend, murmur3_compute, murmur3_compute_batch };
+        return SUCCESS();
+
+    case FINGERPRINT_CRC32C:
+        *target = { backend, crc32c_compute_table, compute_one_by_one<crc32c_compute_table> };
+
+#ifdef FINGERPRINT_X86
+        if (__builtin_cpu_supports("sse4.2"))
+            *target = { backend, crc32c_compute_sse42, compute_one_by_one<crc32c_compute_sse42> };
+#endif
+
+        return SUCCESS();
+
+    case FINGERPRINT_XXH:
+        *target = { backend, xxh_compute_scalar, compute_one_by_one<xxh_compute_scalar> };
+
+#ifdef FINGERPRINT_X86
+        if (__builtin_cpu_supports("avx2"))
+            *target = { backend, xxh_compute_avx2, compute_one_by_one<xxh_compute_avx2> };
+        else
+            *target = { backend, xxh_compute_sse2, compute_one_by_one<xxh_compute_sse2> };
+#endif
+
+        return SUCCESS();
+    }
+
+    return FAILURE(RUNTIME_ERROR, "Unknown fingerprint backend %d!", (int) backend);
+}
+
+const char* fingerprint_backend_name(fingerprint_backend backend) {
+    switch (backend) {
+    case FINGERPRINT_MURMUR3: return "murmur3";
+    case FINGERPRINT_CRC32C:  return "crc32c";
+    case FINGERPRINT_XXH:     return "xxh";
+    }
+
+    return "unknown";
+}
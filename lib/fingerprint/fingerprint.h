@@ -0,0 +1,55 @@
+#pragma once
+
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+const size_t FINGERPRINT_SIZE_IN_32BIT_CHUNKS = 128 / 32;
+
+// Hash of block's contents, blocks with same fingerprint are considered same
+struct fingerprint {
+    uint32_t data[FINGERPRINT_SIZE_IN_32BIT_CHUNKS];
+};
+
+enum fingerprint_backend {
+    // murmur3_x64_128, batches of blocks are hashed interleaved
+    FINGERPRINT_MURMUR3,
+
+    // Four interleaved CRC32C lanes, with SSE4.2 instruction when it's available.
+    // Fastest, but CRC is linear, so it's easy to craft blocks that collide,
+    // dedfs only mounts with it in verify mode
+    FINGERPRINT_CRC32C,
+
+    // Wide multiply-accumulate hash in the style of xxh3, with AVX2 or SSE2
+    FINGERPRINT_XXH
+};
+
+typedef void (*fingerprint_function)(const void* data, size_t size, fingerprint* result);
+
+typedef void (*fingerprint_batch_function)(const void* const* data, const size_t* sizes,
+                                           size_t count, fingerprint* results);
+
+// Functions that implement chosen backend on this CPU
+struct fingerprinter {
+    fingerprint_backend backend;
+
+    fingerprint_function compute;
+    fingerprint_batch_function compute_batch;
+};
+
+stack_trace* fingerprinter_create(fingerprinter* target, fingerprint_backend backend);
+
+const char* fingerprint_backend_name(fingerprint_backend backend);
+
+inline void fingerprint_compute(const fingerprinter* target, const void* data, size_t size,
+                                fingerprint* result) {
+    target->compute(data, size, result);
+}
+
+// Same as fingerprint_compute for each of /count/ buffers, but faster
+// with backends that can hash several buffers at once
+inline void fingerprint_compute_batch(const fingerprinter* target, const void* const* data,
+                                      const size_t* sizes, size_t count, fingerprint* results) {
+    target->compute_batch(data, sizes, count, results);
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "trace.h"
+#include "hash-table.h"
+
+// Open addressing hash table in the style of SwissTable: pairs are stored
+// inline in one array, and every slot has a control byte, which holds 7 bits
+// of key's hash for full slots. Slots are probed in aligned groups of 16, all
+// control bytes of a group are matched against hash at once, so keys are only
+// compared for slots that are very likely to hold them.
+//
+// Hash and equality are template parameters, so they can be inlined, otherwise
+// this is a drop-in replacement for hash_table.
+//
+// Table is resized incrementally: new table is allocated, and every insert or
+// delete moves a few pairs from the previous one, until it's empty. Lookups
+// check both tables in the meantime, but never move anything, so they are
+// safe to do concurrently (under a shared lock, for example).
+
+typedef int8_t flat_hash_table_control;
+
+const flat_hash_table_control FLAT_HASH_TABLE_EMPTY   = -128; // 0b10000000
+const flat_hash_table_control FLAT_HASH_TABLE_DELETED =   -2; // 0b11111110
+// Full slots have control byte in [0, 127], so highest bit is set only for free ones
+
+const size_t FLAT_HASH_TABLE_GROUP_SIZE = 16;
+
+template <typename K, typename V, uint32_t (*hash)(K),
+          bool (*equal)(K* first, K* second) = hash_table_simple_key_equality<K>>
+struct flat_hash_table {
+    flat_hash_table_control* control;
+    hash_table_pair<K, V>* slots;
+
+    size_t capacity;   // Power of two, and at least a single group
+    size_t used;       // Full slots
+    size_t tombstones; // Deleted slots, they can't end probing
+
+    // Table that is being migrated to this one, NULL if there's no resize
+    flat_hash_table* previous;
+    size_t migrated; // Slots of previous table that were already moved
+};
+
+// Slots of previous table that are moved on every insert or delete during resize,
+// new table is at most 7/8 full when resize starts and twice as big, so it always
+// finishes long before new table has to grow again
+const size_t FLAT_HASH_TABLE_MIGRATION_STEP = 2 * FLAT_HASH_TABLE_GROUP_SIZE;
+
+// Bit mask of slots in group, bit number /i/ is for slot /i/ in group
+typedef uint32_t flat_hash_table_mask;
+
+struct flat_hash_table_group {
+#ifdef __SSE2__
+    __m128i control;
+
+    flat_hash_table_group(const flat_hash_table_control* position):
+        control(_mm_load_si128((const __m128i*) position)) {}
+
+    flat_hash_table_mask match(flat_hash_table_control value) const {
+        return (flat_hash_table_mask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(value)));
+    }
+
+    // Slots that are either empty or deleted
+    flat_hash_table_mask match_free() const {
+        return (flat_hash_table_mask) _mm_movemask_epi8(control);
+    }
+#else
+    const flat_hash_table_control* control;
+
+    flat_hash_table_group(const flat_hash_table_control* position): control(position) {}
+
+    flat_hash_table_mask match(flat_hash_table_control value) const {
+        flat_hash_table_mask mask = 0;
+        for (size_t i = 0; i < FLAT_HASH_TABLE_GROUP_SIZE; ++ i)
+            mask |= (flat_hash_table_mask) (control[i] == value) << i;
+
+        return mask;
+    }
+
+    flat_hash_table_mask match_free() const {
+        flat_hash_table_mask mask = 0;
+        for (size_t i = 0; i < FLAT_HASH_TABLE_GROUP_SIZE; ++ i)
+            mask |= (flat_hash_table_mask) (control[i] < 0) << i;
+
+        return mask;
+    }
+#endif
+
+    flat_hash_table_mask match_empty() const { return match(FLAT_HASH_TABLE_EMPTY); }
+};
+
+// Iterates over set bits of a mask, lowest one first
+#define FLAT_HASH_TABLE_FOR_EACH_BIT(mask, bit)                                              \
+    for (flat_hash_table_mask __left = (mask), bit = 0;                                       \
+         __left != 0 && ((bit = (flat_hash_table_mask) __builtin_ctz(__left)), true);         \
+         __left &= __left - 1)
+
+// Higher bits of hash pick group, lower 7 bits go to control byte
+inline size_t __flat_hash_table_h1(uint32_t key_hash) { return key_hash >> 7; }
+inline flat_hash_table_control __flat_hash_table_h2(uint32_t key_hash) {
+    return (flat_hash_table_control) (key_hash & 0x7F);
+}
+
+#define FLAT_HASH_TABLE_TEMPLATE                                                              \
+    template <typename K, typename V, uint32_t (*hash)(K), bool (*equal)(K*, K*)>
+
+#define FLAT_HASH_TABLE_T flat_hash_table<K, V, hash, equal>
+
+// Key and value types are only deduced from table, so arguments
+// that are convertible to them (like char* to const char*) work
+#define FLAT_HASH_TABLE_KEY   std::type_identity_t<K>
+#define FLAT_HASH_TABLE_VALUE std::type_identity_t<V>
+
+FLAT_HASH_TABLE_TEMPLATE
+stack_trace* flat_hash_table_create(FLAT_HASH_TABLE_T* table, size_t capacity = 32) {
+    // Capacity should be power of two, that's not smaller than a group
+    size_t actual_capacity = FLAT_HASH_TABLE_GROUP_SIZE;
+    while (actual_capacity < capacity)
+        actual_capacity *= 2;
+
+    *table = {
+        .control = NULL, .slots = NULL,
+        .capacity = actual_capacity, .used = 0, .tombstones = 0,
+        .previous = NULL, .migrated = 0
+    };
+
+    // Groups are loaded with aligned loads
+    table->control = (flat_hash_table_control*)
+        aligned_alloc(FLAT_HASH_TABLE_GROUP_SIZE, actual_capacity * sizeof(*table->control));
+
+    table->slots = (hash_table_pair<K, V>*) calloc(actual_capacity, sizeof(*table->slots));
+
+    if (table->control == NULL || table->slots == NULL) {
+        free(table->control), free(table->slots);
+        return FAILURE(RUNTIME_ERROR, "Can't allocate table of capacity %zu!", actual_capacity);
+    }
+
+    memset(table->control, FLAT_HASH_TABLE_EMPTY, actual_capacity * sizeof(*table->control));
+    return SUCCESS();
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+void flat_hash_table_destroy(FLAT_HASH_TABLE_T* table) {
+    if (table->previous != NULL) {
+        flat_hash_table_destroy(table->previous);
+        free(table->previous), table->previous = NULL;
+    }
+
+    free(table->control), table->control = NULL;
+    free(table->slots),   table->slots   = NULL;
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+inline size_t __flat_hash_table_groups(FLAT_HASH_TABLE_T* table) {
+    return table->capacity / FLAT_HASH_TABLE_GROUP_SIZE;
+}
+
+// Position of slot with /key/, or capacity if there's no such slot. Groups
+// are probed quadratically (0, 1, 3, 6, ... groups away from the first one),
+// that visits every group when number of groups is a power of two
+FLAT_HASH_TABLE_TEMPLATE
+size_t __flat_hash_table_find(FLAT_HASH_TABLE_T* table, K key, uint32_t key_hash) {
+    const size_t group_mask = __flat_hash_table_groups(table) - 1;
+    const flat_hash_table_control h2 = __flat_hash_table_h2(key_hash);
+
+    size_t group_index = __flat_hash_table_h1(key_hash) & group_mask;
+    for (size_t step = 1; step <= group_mask + 1; ++ step) {
+        const size_t first_slot = group_index * FLAT_HASH_TABLE_GROUP_SIZE;
+        flat_hash_table_group group(table->control + first_slot);
+
+        FLAT_HASH_TABLE_FOR_EACH_BIT(group.match(h2), bit) {
+            size_t slot = first_slot + bit;
+            if (equal(&table->slots[slot].key, &key))
+                return slot;
+        }
+
+        // Key would have been inserted in this group, if it had been here
+        if (group.match_empty() != 0)
+            break;
+
+        group_index = (group_index + step) & group_mask;
+    }
+
+    return table->capacity;
+}
+
+// First free slot in probe sequence of /key_hash/, table should have one
+FLAT_HASH_TABLE_TEMPLATE
+size_t __flat_hash_table_find_free(FLAT_HASH_TABLE_T* table, uint32_t key_hash) {
+    const size_t group_mask = __flat_hash_table_groups(table) - 1;
+
+    size_t group_index = __flat_hash_table_h1(key_hash) & group_mask;
+    for (size_t step = 1; ; ++ step) {
+        const size_t first_slot = group_index * FLAT_HASH_TABLE_GROUP_SIZE;
+
+        flat_hash_table_mask free_slots =
+            flat_hash_table_group(table->control + first_slot).match_free();
+
+        if (free_slots != 0)
+            return first_slot + (size_t) __builtin_ctz(free_slots);
+
+        group_index = (group_index + step) & group_mask;
+    }
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+void __flat_hash_table_place(FLAT_HASH_TABLE_T* table, K key, V value, uint32_t key_hash) {
+    size_t slot = __flat_hash_table_find_free(table, key_hash);
+
+    if (table->control[slot] == FLAT_HASH_TABLE_DELETED)
+        -- table->tombstones;
+
+    table->control[slot] = __flat_hash_table_h2(key_hash);
+    table->slots[slot] = { key, value };
+
+    ++ table->used;
+}
+
+// Probing stops at groups with empty slots, so if this group has
+// one, no probe sequence passes through it and slot can be empty
+FLAT_HASH_TABLE_TEMPLATE
+void __flat_hash_table_erase(FLAT_HASH_TABLE_T* table, size_t slot) {
+    size_t first_slot = slot - slot % FLAT_HASH_TABLE_GROUP_SIZE;
+    if (flat_hash_table_group(table->control + first_slot).match_empty() != 0)
+        table->control[slot] = FLAT_HASH_TABLE_EMPTY;
+    else {
+        table->control[slot] = FLAT_HASH_TABLE_DELETED;
+        ++ table->tombstones;
+    }
+
+    -- table->used;
+}
+
+// Moves up to /slots/ slots from previous table, frees it when it's empty
+FLAT_HASH_TABLE_TEMPLATE
+void __flat_hash_table_migrate(FLAT_HASH_TABLE_T* table, size_t slots) {
+    FLAT_HASH_TABLE_T* previous = table->previous;
+    if (previous == NULL)
+        return; // Nothing to migrate
+
+    // Written so that /slots/ of SIZE_MAX (everything) can't overflow
+    size_t end = table->migrated + std::min(previous->capacity - table->migrated, slots);
+    for (size_t slot = table->migrated; slot < end; ++ slot)
+        if (previous->control[slot] >= 0) {
+            hash_table_pair<K, V>* pair = &previous->slots[slot];
+            __flat_hash_table_place(table, pair->key, pair->value, hash(pair->key));
+
+            // Otherwise lookups could find pair that was deleted after move
+            __flat_hash_table_erase(previous, slot);
+        }
+
+    table->migrated = end;
+
+    if (table->migrated == previous->capacity) {
+        flat_hash_table_destroy(previous);
+        free(previous), table->previous = NULL;
+    }
+}
+
+// Table is replaced with an empty one of /new_capacity/, old one becomes
+// previous, and its pairs are moved over by subsequent inserts and deletes
+FLAT_HASH_TABLE_TEMPLATE
+stack_trace* flat_hash_table_rehash(FLAT_HASH_TABLE_T* table, size_t new_capacity) {
+    // Previous resize should be finished, there can only be one previous table
+    __flat_hash_table_migrate(table, SIZE_MAX);
+
+    FLAT_HASH_TABLE_T new_table;
+    TRY flat_hash_table_create(&new_table, new_capacity)
+        FAIL("Can't grow table to capacity %zu!", new_capacity);
+
+    FLAT_HASH_TABLE_T* previous = (FLAT_HASH_TABLE_T*) calloc(1, sizeof(*previous));
+    if (previous == NULL) {
+        flat_hash_table_destroy(&new_table);
+        return FAILURE(RUNTIME_ERROR, "Can't allocate previous table!");
+    }
+
+    *previous = *table;
+    *table = new_table; // Replace table with a new one
+
+    table->previous = previous;
+    return SUCCESS();
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+size_t flat_hash_table_size(FLAT_HASH_TABLE_T* table) {
+    return table->used + (table->previous ? table->previous->used : 0);
+}
+
+// Finds table (this one or previous) and slot with /key/,
+// returns false if neither of the tables has it
+FLAT_HASH_TABLE_TEMPLATE
+bool __flat_hash_table_locate(FLAT_HASH_TABLE_T* table, K key, uint32_t key_hash,
+                              FLAT_HASH_TABLE_T** found_table, size_t* found_slot) {
+
+    for (FLAT_HASH_TABLE_T* current = table; current != NULL; current = current->previous) {
+        size_t slot = __flat_hash_table_find(current, key, key_hash);
+
+        if (slot != current->capacity) {
+            *found_table = current, *found_slot = slot;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+V* flat_hash_table_lookup(FLAT_HASH_TABLE_T* table, FLAT_HASH_TABLE_KEY key) {
+    FLAT_HASH_TABLE_T* found_table;
+    size_t slot;
+
+    if (!__flat_hash_table_locate(table, key, hash(key), &found_table, &slot))
+        return NULL; // Element not found
+
+    return &found_table->slots[slot].value;
+}
+
+// Starts loading the first group that lookup of /key/ will probe, so that
+// several lookups can wait for memory at once instead of one after another
+FLAT_HASH_TABLE_TEMPLATE
+void flat_hash_table_prefetch(FLAT_HASH_TABLE_T* table, FLAT_HASH_TABLE_KEY key) {
+    const size_t group_index = __flat_hash_table_h1(hash(key)) & (__flat_hash_table_groups(table) - 1);
+    const size_t first_slot = group_index * FLAT_HASH_TABLE_GROUP_SIZE;
+
+    __builtin_prefetch(table->control + first_slot);
+    __builtin_prefetch(table->slots   + first_slot);
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+bool flat_hash_table_contains(FLAT_HASH_TABLE_T* table, FLAT_HASH_TABLE_KEY key) {
+    return flat_hash_table_lookup(table, key) != NULL;
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+bool flat_hash_table_insert(FLAT_HASH_TABLE_T* table, FLAT_HASH_TABLE_KEY key,
+                            FLAT_HASH_TABLE_VALUE value) {
+    const uint32_t key_hash = hash(key);
+
+    FLAT_HASH_TABLE_T* found_table;
+    size_t found_slot;
+
+    if (__flat_hash_table_locate(table, key, key_hash, &found_table, &found_slot))
+        return false; // There's same key in the hash table
+
+    __flat_hash_table_migrate(table, FLAT_HASH_TABLE_MIGRATION_STEP);
+
+    // Tombstones make probe sequences longer just like full slots, so
+    // they count towards load factor, but only get cleaned up on rehash.
+    // Pairs that previous table still has will end up here too
+    const size_t MAX_LOAD_NUMERATOR = 7, MAX_LOAD_DENOMINATOR = 8;
+
+    if ((flat_hash_table_size(table) + table->tombstones + 1) * MAX_LOAD_DENOMINATOR >
+         table->capacity * MAX_LOAD_NUMERATOR) {
+
+        // If it's mostly tombstones, table can stay the same size
+        size_t new_capacity = flat_hash_table_size(table) * 2 >= table->capacity ?
+            table->capacity * 2 : table->capacity;
+
+        TRY flat_hash_table_rehash(table, new_capacity)
+            THROW("Failed to rehash table of capacity %zu!", table->capacity);
+    }
+
+    __flat_hash_table_place(table, key, value, key_hash);
+    return true; // Inserted successfully
+}
+
+FLAT_HASH_TABLE_TEMPLATE
+bool flat_hash_table_delete(FLAT_HASH_TABLE_T* table, FLAT_HASH_TABLE_KEY key) {
+    FLAT_HASH_TABLE_T* found_table;
+    size_t found_slot;
+
+    if (!__flat_hash_table_locate(table, key, hash(key), &found_table, &found_slot))
+        return false;
+
+    __flat_hash_table_erase(found_table, found_slot);
+
+    __flat_hash_table_migrate(table, FLAT_HASH_TABLE_MIGRATION_STEP);
+    return true; // Deletion succeeded
+}
+
+// Visits every pair, /current/ is a pointer to hash_table_pair. Pairs
+// of previous table are visited too, so break only leaves one of them
+#define FLAT_HASH_TABLE_TRAVERSE(table, current)                                              \
+    for (auto* __table = (table); __table != NULL; __table = __table->previous)              \
+        for (auto* current = __table->slots; current != __table->slots + __table->capacity;  \
+             ++ current)                                                                      \
+            if (__table->control[current - __table->slots] >= 0)
+
+#undef FLAT_HASH_TABLE_VALUE
+#undef FLAT_HASH_TABLE_KEY
+#undef FLAT_HASH_TABLE_T
+#undef FLAT_HASH_TABLE_TEMPLATE
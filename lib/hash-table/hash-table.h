@@ -112,16 +112,12 @@ element_index_t __hash_table_lookup_index(hash_table<K, V>* table, K key,
     if (key_bucket != NULL)
         *key_bucket = bucket;
 
-    if (bucket->size != 0) {
-        element<hash_table_pair<K, V>> *current =
-            linked_list_get_pointer(&table->values, bucket->value_index);
+    element_index_t current = bucket->value_index;
+    for (size_t index = 0; index < bucket->size; ++ index) {
+        if (table->key_equals_function(&linked_list_get_pointer(&table->values, current)->key, &key))
+            return current;
 
-        for (size_t index = 0; index < bucket->size; ++ index) {
-            if (table->key_equals_function(&current->element.key, &key))
-                return linked_list_get_index(&table->values, current);
-
-            current = linked_list_next(&table->values, current);
-        }
+        current = linked_list_next_index(&table->values, current);
     }
 
     return linked_list_end_index;
@@ -133,7 +129,7 @@ V* hash_table_lookup(hash_table<K, V>* table, K key) {
     if (index == linked_list_end_index)
         return NULL; // Element not found
 
-    return &linked_list_get_pointer(&table->values, index)->element.value;
+    return &linked_list_get_pointer(&table->values, index)->value;
 }
 
 
@@ -142,8 +138,8 @@ V* hash_table_lookup(hash_table<K, V>* table, K key) {
 #define HASH_TABLE_TRAVERSE(table, key_type, value_type, current)                            \
     LINKED_LIST_TRAVERSE(&(table)->values, HASH_TABLE_PAIR_T(key_type, value_type), current)
 
-#define KEY(  current) ((current)->element.key)
-#define VALUE(current) ((current)->element.value) 
+#define KEY(  current) ((current)->key)
+#define VALUE(current) ((current)->value)
 
 template <typename K, typename V>
 void hash_table_rehash(hash_table<K, V>* table,
@@ -177,12 +173,20 @@ bool hash_table_delete(hash_table<K, V>* table, K key) {
     if (index == linked_list_end_index)
         return false;
 
+    // Bucket starts with deleted value, next one in chain becomes first
+    if (index == bucket->value_index)
+        bucket->value_index =
+            linked_list_next_index(&table->values, index);
+
     TRY linked_list_delete(&table->values, index)
         THROW("Value deletion failed!");
 
     -- bucket->size; // Since we found element
     // Bucket should be bigger than 1 in any case
 
+    if (bucket->size == 0)
+        -- table->buckets_used; // Bucket is empty again
+
     return true; // Deletion succeeded
 }
 
@@ -3,6 +3,7 @@
 #include "trace.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <malloc.h>
 #include <string.h>
@@ -10,104 +11,133 @@
 
 typedef int element_index_t;
 
-template <typename E>
-struct element {
+struct linked_list_link {
     element_index_t next_index;
     element_index_t prev_index;
-    bool is_free;
-
-    E element;
 };
 
+// Links, free flags and elements are kept in separate arrays, so
+// walks that only follow links don't drag elements through cache.
+//
+// Elements from /unused/ on were never handed out, nothing in arrays is
+// touched for them until they're taken one by one. Elements below it that
+// were freed are looped in a list of their own, /free/ is one of them
 template <typename E>
 struct linked_list {
-    element<E>* elements;
+    linked_list_link* links;
+    uint64_t* free_bits; // Bit per element below /unused/, set for free ones
+    E* elements;
+
     size_t capacity, used;
 
-    element_index_t free;
+    element_index_t free, unused;
     bool is_linearized;
 };
 
+// Value of linked_list::free when no freed elements are left
+const element_index_t linked_list_no_free_index = -1;
+
+const size_t LINKED_LIST_BITMAP_WORD = 64;
+
+inline size_t linked_list_bitmap_words(size_t elements) {
+    return (elements + LINKED_LIST_BITMAP_WORD - 1) / LINKED_LIST_BITMAP_WORD;
+}
+
+inline bool linked_list_free_bit(const uint64_t* free_bits, element_index_t index) {
+    return (free_bits[index / LINKED_LIST_BITMAP_WORD] >> (index % LINKED_LIST_BITMAP_WORD)) & 1;
+}
+
 
 template <typename E>
-inline element<E>* linked_list_next(linked_list<E>* list, element<E>* current) {
-    return &list->elements[current->next_index];
+inline element_index_t linked_list_next_index(linked_list<E>* list, element_index_t current) {
+    return list->links[current].next_index;
 }
 
 template <typename E>
-inline element<E>* linked_list_prev(linked_list<E>* list, element<E>* current) {
-    return &list->elements[current->prev_index];
+inline element_index_t linked_list_prev_index(linked_list<E>* list, element_index_t current) {
+    return list->links[current].prev_index;
 }
 
-const element_index_t linked_list_end_index = 0;
 
 template <typename E>
-inline element<E>* linked_list_end(linked_list<E>* list) {
-    return &list->elements[linked_list_end_index];
+inline E* linked_list_get_pointer(linked_list<E>* list,
+                                  element_index_t actual_index) {
+    return &list->elements[actual_index];
+}
+
+template <typename E>
+inline element_index_t linked_list_get_index(linked_list<E>* list,
+                                             E* element_ptr) {
+    return element_ptr - list->elements;
 }
 
 
 template <typename E>
-inline element_index_t linked_list_head_index(linked_list<E>* list) {
-    return linked_list_end(list)->next_index;
+inline E* linked_list_next(linked_list<E>* list, E* current) {
+    return &list->elements[linked_list_next_index(list, linked_list_get_index(list, current))];
 }
 
 template <typename E>
-inline element<E>* linked_list_head(linked_list<E>* list) {
-    return &list->elements[linked_list_head_index(list)];
+inline E* linked_list_prev(linked_list<E>* list, E* current) {
+    return &list->elements[linked_list_prev_index(list, linked_list_get_index(list, current))];
 }
 
+const element_index_t linked_list_end_index = 0;
 
 template <typename E>
-inline element_index_t linked_list_tail_index(linked_list<E>* list) {
-    return linked_list_end(list)->prev_index;
+inline E* linked_list_end(linked_list<E>* list) {
+    return &list->elements[linked_list_end_index];
+}
+
+
+template <typename E>
+inline element_index_t linked_list_head_index(linked_list<E>* list) {
+    return list->links[linked_list_end_index].next_index;
 }
 
 template <typename E>
-inline element<E>* linked_list_tail(linked_list<E>* list) {
-    return &list->elements[linked_list_tail_index(list)];
+inline E* linked_list_head(linked_list<E>* list) {
+    return &list->elements[linked_list_head_index(list)];
 }
 
 
 template <typename E>
-inline element<E>* linked_list_get_pointer(linked_list<E>* list,
-                                           element_index_t actual_index) {
-    return &list->elements[actual_index];
+inline element_index_t linked_list_tail_index(linked_list<E>* list) {
+    return list->links[linked_list_end_index].prev_index;
 }
 
 template <typename E>
-inline element_index_t linked_list_get_index(linked_list<E>* list,
-                                             element<E>* element_ptr) {
-    return element_ptr - list->elements;
+inline E* linked_list_tail(linked_list<E>* list) {
+    return &list->elements[linked_list_tail_index(list)];
 }
 
 
 template <typename E>
 stack_trace* linked_list_create(linked_list<E>* list, const size_t capacity = 10) {
-    element<E>* new_space = (element<E>*)
-        calloc(capacity + 2 /* For two terminal nodes */, sizeof(*new_space));
+    const size_t total = capacity + 2; // For terminal node and elements
 
-    if (new_space == NULL)
+    *list = {};
+    list->links     = (linked_list_link*) malloc(total * sizeof(*list->links));
+    list->free_bits = (uint64_t*)         malloc(linked_list_bitmap_words(total) * sizeof(*list->free_bits));
+    list->elements  = (E*)                malloc(total * sizeof(*list->elements));
+
+    if (list->links == NULL || list->free_bits == NULL || list->elements == NULL) {
+        linked_list_destroy(list);
         return FAILURE(RUNTIME_ERROR, strerror(errno));
+    }
 
-    list->elements = new_space;
     list->capacity = capacity;
 
     list->is_linearized = true;
 
-    // Memory is assumed to be zeroed after calloc
-    linked_list_head(list)->is_free = false;
-
-    // Loop first free element on itself
-    list->free = 1;
-    *linked_list_get_pointer(list, list->free) = 
-        { .next_index = list->free,
-          .prev_index = list->free,
-          .is_free = true, .element = (E) {} };
+    // Only terminal node is set up, elements are set up when they're taken
+    list->links[linked_list_end_index] = { .next_index = linked_list_end_index,
+                                           .prev_index = linked_list_end_index };
+    list->elements[linked_list_end_index] = (E) {};
+    list->free_bits[0] = 0;
 
-    // Expand doubly linked list of free elements
-    for (element_index_t i = (element_index_t) capacity + 1; i > list->free; -- i)
-        __linked_list_insert_after_in_place(list, (E) {}, list->free, i);
+    list->free = linked_list_no_free_index;
+    list->unused = linked_list_end_index + 1;
 
     return SUCCESS();
 }
@@ -116,9 +146,9 @@ stack_trace* linked_list_create(linked_list<E>* list, const size_t capacity = 10
 template <typename E>
 static inline
 stack_trace* check_index(linked_list<E>* list, element_index_t index) {
-    if (index > (element_index_t) list->capacity + 1)
-        return FAILURE(RUNTIME_ERROR, "Index %d overflows list capacity %d!",
-                       index, list->capacity);
+    if (index >= list->unused)
+        return FAILURE(RUNTIME_ERROR, "Index %d is past elements in use (%d)!",
+                       index, list->unused);
 
     if (index < 0)
         return FAILURE(RUNTIME_ERROR, "Index %d underflows list capacity %d!",
@@ -128,19 +158,35 @@ stack_trace* check_index(linked_list<E>* list, element_index_t index) {
 }
 
 
+template <typename T>
+static inline
+stack_trace* __linked_list_grow_array(T** array, const size_t new_size) {
+    T* new_space = (T*) realloc(*array, sizeof(T) * new_size);
+    if (new_space == NULL)
+        return FAILURE(RUNTIME_ERROR, strerror(errno));
+
+    *array = new_space;
+    return SUCCESS();
+}
+
+// New space is left as it is, elements there are set up when they're taken
 template <typename E>
 stack_trace* linked_list_resize(linked_list<E>* list, const size_t new_capacity) {
-    element<E>* new_space = (element<E>*)
-        realloc(list->elements, sizeof(*new_space) *
-                (new_capacity + 2) /* For terminal nodes */);
+    const size_t total = new_capacity + 2; // For terminal node and elements
 
-    if (new_space == NULL)
-        return FAILURE(RUNTIME_ERROR, strerror(errno));
+    if (total < (size_t) list->unused)
+        return FAILURE(RUNTIME_ERROR, "Capacity %zu is less than elements in use (%d)!",
+                       new_capacity, list->unused);
+
+    // Arrays that already grew are just larger than needed if others fail
+    TRY __linked_list_grow_array(&list->links, total)
+        FAIL("Can't grow links to %zu elements!", total);
 
-    list->elements = new_space;
+    TRY __linked_list_grow_array(&list->free_bits, linked_list_bitmap_words(total))
+        FAIL("Can't grow free flags to %zu elements!", total);
 
-    for (element_index_t i = list->capacity + 2; i <= (element_index_t) new_capacity + 1; ++ i)
-        add_free_element(list, i);
+    TRY __linked_list_grow_array(&list->elements, total)
+        FAIL("Can't grow elements to %zu elements!", total);
 
     list->capacity = new_capacity;
 
@@ -151,61 +197,94 @@ stack_trace* linked_list_resize(linked_list<E>* list, const size_t new_capacity)
 template <typename E>
 static inline
 bool free_elements_left(linked_list<E>* list) {
-    return list->free != list->elements[list->free].next_index;
+    return list->free != linked_list_no_free_index ||
+           (size_t) list->unused <= list->capacity + 1;
+}
+
+template <typename E>
+static inline
+bool is_free_element(linked_list<E>* list, element_index_t element_index) {
+    return element_index >= list->unused || linked_list_free_bit(list->free_bits, element_index);
+}
+
+template <typename E>
+static inline
+void __linked_list_mark_free(linked_list<E>* list, element_index_t element_index, bool is_free) {
+    uint64_t* word = &list->free_bits[element_index / LINKED_LIST_BITMAP_WORD];
+    const uint64_t bit = (uint64_t) 1 << (element_index % LINKED_LIST_BITMAP_WORD);
+
+    *word = is_free ? *word | bit : *word & ~bit;
+}
+
+// Whether element at /place_index/ can be taken right away: it's either freed,
+// or the first one that was never used, so everything below /unused/ stays set up
+template <typename E>
+static inline
+bool __linked_list_can_take(linked_list<E>* list, element_index_t place_index) {
+    return (size_t) place_index <= list->capacity + 1 &&
+           place_index <= list->unused && is_free_element(list, place_index);
 }
 
 template <typename E>
 stack_trace* get_free_element_on_place(linked_list<E>* list,
                                        element_index_t place_index) {
 
-    if (!is_free_element(list, place_index))
-        return FAILURE(RUNTIME_ERROR, "Element %d isn't free!", place_index);
+    if (!__linked_list_can_take(list, place_index))
+        return FAILURE(RUNTIME_ERROR, "Element %d can't be taken!", place_index);
 
-    const element_index_t next =
-        list->elements[place_index].next_index;
+    if (place_index == list->unused) {
+        // Word of bitmap is set up when its first element is reached
+        if (place_index % LINKED_LIST_BITMAP_WORD == 0)
+            list->free_bits[place_index / LINKED_LIST_BITMAP_WORD] = 0;
 
-    if (next == place_index)
-        return FAILURE(RUNTIME_ERROR, "There's no free elements left!");
+        ++ list->unused;
+        return SUCCESS();
+    }
+
+    const element_index_t next =
+        list->links[place_index].next_index;
 
     TRY linked_list_unlink(list, place_index)
         FAIL("Failed to unlink element on place %d!", place_index);
 
-    list->free = next; // This way we won't have any edge cases
+    if (list->free == place_index) // It was looped on itself if it was the last one
+        list->free = next != place_index ? next : linked_list_no_free_index;
 
     return SUCCESS();
 }
 
 template <typename E>
 stack_trace* get_free_element(linked_list<E>* list, element_index_t* element_index) {
-    *element_index = list->free;
-    TRY get_free_element_on_place(list, list->free)
-        FAIL("Can't detach list->free (%d) element!", list->free);
+    if (!free_elements_left(list))
+        return FAILURE(RUNTIME_ERROR, "There's no free elements left!");
+
+    *element_index = list->free != linked_list_no_free_index ? list->free : list->unused;
+    TRY get_free_element_on_place(list, *element_index)
+        FAIL("Can't detach free element %d!", *element_index);
     return SUCCESS();
 }
 
 template <typename E>
 void add_free_element(linked_list<E>* list, element_index_t element_index) {
-    __linked_list_insert_after_in_place(list, (E) {}, list->free, element_index);
-}
+    __linked_list_mark_free(list, element_index, true);
 
-template <typename E>
-static inline
-bool is_free_element(linked_list<E>* list, element_index_t element_index) {
-    return list->elements[element_index].is_free;
+    if (list->free == linked_list_no_free_index) {
+        list->links[element_index] = { .next_index = element_index, .prev_index = element_index };
+        list->free = element_index;
+        return;
+    }
+
+    __linked_list_link_after(list, list->free, element_index);
 }
 
 
 template <typename E>
 static inline
-void __linked_list_insert_after_in_place(linked_list<E>* list, E value,
-                                         element_index_t prev_index,
-                                         element_index_t place_for_new_element) {
-
-    element<E>* prev_element = linked_list_get_pointer(list, prev_index);
+void __linked_list_link_after(linked_list<E>* list, element_index_t prev_index,
+                              element_index_t place_for_new_element) {
 
     // Element that will go immediately after our new element
-    element_index_t next_index = prev_element->next_index;
-    element<E>* next_element = linked_list_get_pointer(list, next_index);
+    element_index_t next_index = list->links[prev_index].next_index;
 
     //          next                        next          next
     // +------+ ~~~> +------+      +------x ~~~> /------x ~~~> /------+
@@ -213,15 +292,22 @@ void __linked_list_insert_after_in_place(linked_list<E>* list, E value,
     // +------+ <~~~ +------+      +------/ <~~~ x------/ <~~~ x------+
 
     // Update neighbours
-    list->elements[prev_index].next_index = place_for_new_element;
-    list->elements[next_index].prev_index = place_for_new_element;
+    list->links[prev_index].next_index = place_for_new_element;
+    list->links[next_index].prev_index = place_for_new_element;
+
+    list->links[place_for_new_element] = { .next_index = next_index, .prev_index = prev_index };
+}
+
+template <typename E>
+static inline
+void __linked_list_insert_after_in_place(linked_list<E>* list, E value,
+                                         element_index_t prev_index,
+                                         element_index_t place_for_new_element) {
+    __linked_list_link_after(list, prev_index, place_for_new_element);
 
     // Construct new element in the new place
-    list->elements[place_for_new_element] = {
-        .next_index = next_index,
-        .prev_index = prev_index,
-        .is_free = prev_element->is_free, .element = value
-    };
+    __linked_list_mark_free(list, place_for_new_element, false);
+    list->elements[place_for_new_element] = value;
 }
 
 template <typename E>
@@ -234,11 +320,12 @@ stack_trace* linked_list_insert_after(linked_list<E>* list, E value,
     const double GROW = 2.0; // How much list grows when it runs out of space
 
     if (!free_elements_left(list))
-        linked_list_resize(list, list->capacity * GROW);
+        TRY linked_list_resize(list, list->capacity * GROW + 1)
+            FAIL("Can't grow list of %zu elements!", list->capacity);
 
     // Get free space for inserting new element
     element_index_t place_for_new_element = -1;
-    if (prev_index <= list->capacity && is_free_element(list, prev_index + 1)) {
+    if (__linked_list_can_take(list, prev_index + 1)) {
         place_for_new_element = prev_index + 1;
 
         TRY get_free_element_on_place(list, place_for_new_element)
@@ -283,7 +370,7 @@ stack_trace* linked_list_unlink(linked_list<E>* list, element_index_t actual_ind
     // Check if element has is valid index in the list
     TRY check_index(list, actual_index) FAIL("Illegal index passed!");
 
-    element<E>* current = &list->elements[actual_index];
+    linked_list_link* current = &list->links[actual_index];
     element_index_t prev_index = current->prev_index,
                     next_index = current->next_index;
 
@@ -292,8 +379,8 @@ stack_trace* linked_list_unlink(linked_list<E>* list, element_index_t actual_ind
     // | PREV | prev | CURR | prev | NEXT |  =>  | PREV | prev | NEXT |
     // +------/ <~~~ x------/ <~~~ x------+      +------+ <~~~ +------+
 
-    list->elements[prev_index].next_index = current->next_index;
-    list->elements[next_index].prev_index = current->prev_index;
+    list->links[prev_index].next_index = next_index;
+    list->links[next_index].prev_index = prev_index;
 
     return SUCCESS();
 }
@@ -302,7 +389,7 @@ template <typename E>
 stack_trace* linked_list_delete(linked_list<E>* list, element_index_t actual_index) {
     TRY check_index(list, actual_index) FAIL("Illegal index passed!");
 
-    element<E>* current = linked_list_get_pointer(list, actual_index);
+    linked_list_link* current = &list->links[actual_index];
     const element_index_t head_ind = linked_list_head_index(list);
 
     if (current->next_index != head_ind && current->prev_index != head_ind)
@@ -359,14 +446,14 @@ stack_trace* linked_list_swap(linked_list<E>* list,
     //                  +-----+        
     //                 (snd_ind)
 
-    element<E> *first    = linked_list_get_pointer(list, fst_index),
-               *second   = linked_list_get_pointer(list, snd_index);
+    linked_list_link *first    = &list->links[fst_index],
+                     *second   = &list->links[snd_index];
 
-    element<E> *fst_prev = linked_list_prev(list,  first),
-               *fst_next = linked_list_next(list,  first);
+    linked_list_link *fst_prev = &list->links[first->prev_index],
+                     *fst_next = &list->links[first->next_index];
 
-    element<E> *snd_prev = linked_list_prev(list, second),
-               *snd_next = linked_list_next(list, second);
+    linked_list_link *snd_prev = &list->links[second->prev_index],
+                     *snd_next = &list->links[second->next_index];
 
     // ==> Should become:
     //             next +-----+ prev
@@ -382,22 +469,31 @@ stack_trace* linked_list_swap(linked_list<E>* list,
     fst_prev->next_index = fst_next->prev_index = snd_index;
     snd_prev->next_index = snd_next->prev_index = fst_index;
 
-    swap(first, second); // We've prepared elements, now we can swap
+    // We've prepared elements, now we can swap
+    swap(first, second);
+    swap(&list->elements[fst_index], &list->elements[snd_index]);
+
+    const bool fst_free = is_free_element(list, fst_index);
+    __linked_list_mark_free(list, fst_index, is_free_element(list, snd_index));
+    __linked_list_mark_free(list, snd_index, fst_free);
+
+    if (list->free == fst_index || list->free == snd_index)
+        list->free = list->free == fst_index ? snd_index : fst_index;
 
     return SUCCESS();
 }
 
 
-#define LINKED_LIST_TRAVERSE(list, type, current)         \
-    for (element<type>* current = linked_list_head(list); \
-            current != linked_list_end (list);            \
+#define LINKED_LIST_TRAVERSE(list, type, current) \
+    for (type* current = linked_list_head(list);  \
+            current != linked_list_end (list);    \
             current  = linked_list_next(list, current))
 
 
 template <typename E>
 stack_trace* linked_list_linearize(linked_list<E>* list) {
     element_index_t logical_index = 1;
-    for (element<E> *current =  linked_list_head(list);
+    for (E *current =  linked_list_head(list);
             current != linked_list_end (list);
             current =  linked_list_next(list, current), ++ logical_index) {
 
@@ -440,7 +536,7 @@ inline stack_trace* linked_list_get_logical(linked_list<E>* const list,
     TRY linked_list_get_logical_index(list, logical_index, &actual_index)
         FAIL("Can't get actual index of this element!");
 
-    *value = list->elements[actual_index].element;
+    *value = list->elements[actual_index];
 
     return SUCCESS();
 }
@@ -449,7 +545,7 @@ inline stack_trace* linked_list_get_logical(linked_list<E>* const list,
 template <typename E>
 void linked_list_destroy(linked_list<E> *list) {
     if (list != NULL) {
-        free(list->elements);
+        free(list->links), free(list->free_bits), free(list->elements);
         *list = {}; // Zero list out
     }
 
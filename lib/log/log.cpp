@@ -0,0 +1,159 @@
+#include "log.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdarg.h>
+#include <stdint.h>
+#include <thread>
+
+log_level log_runtime_level = LOG_LEVEL_INFO;
+
+static const char* LEVEL_NAMES[] = {
+    "TRACE", "DEBUG", "INFO", "WARNING", "ERROR"
+};
+
+const size_t LOG_MESSAGE_SIZE = 256;  // Longer messages are cut
+const size_t LOG_RING_CAPACITY = 4096; // Should be power of two
+
+struct log_record {
+    // Bounded multi-producer queue by Dmitry Vyukov: record is free for
+    // producer when sequence equals its position and ready for consumer
+    // when sequence is one past it
+    std::atomic<size_t> sequence;
+
+    log_level level;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+static log_record ring[LOG_RING_CAPACITY];
+
+static std::atomic<size_t> enqueue_position;
+static size_t dequeue_position; // Only touched by writer thread
+
+static std::atomic<size_t> dropped_records; // Lost when ring was full
+
+static FILE* sink = NULL;
+static std::thread writer;
+
+static std::atomic<bool> is_running;
+static std::mutex wake_up_mutex;
+static std::condition_variable wake_up;
+
+static void write_record(FILE* stream, log_level level, const char* message) {
+    fprintf(stream, "[%s] %s\n", LEVEL_NAMES[level], message);
+}
+
+static log_record* reserve_record(size_t* reserved_position) {
+    size_t position = enqueue_position.load(std::memory_order_relaxed);
+
+    while (true) {
+        log_record* record = &ring[position & (LOG_RING_CAPACITY - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0) {
+            if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                       std::memory_order_relaxed)) {
+                *reserved_position = position;
+                return record;
+            }
+        } else if (difference < 0)
+            return NULL; // Ring is full
+        else
+            position = enqueue_position.load(std::memory_order_relaxed);
+    }
+}
+
+static bool drain_ring() {
+    bool has_written = false;
+
+    while (true) {
+        log_record* record = &ring[dequeue_position & (LOG_RING_CAPACITY - 1)];
+
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        if (sequence != dequeue_position + 1)
+            break; // Nothing more to write
+
+        write_record(sink, record->level, record->message);
+
+        record->sequence.store(dequeue_position + LOG_RING_CAPACITY, std::memory_order_release);
+        ++ dequeue_position;
+
+        has_written = true;
+    }
+
+    if (size_t dropped = dropped_records.exchange(0))
+        fprintf(sink, "[WARNING] %zu log messages were dropped\n", dropped);
+
+    if (has_written)
+        fflush(sink);
+
+    return has_written;
+}
+
+static void writer_loop() {
+    // Producers never wake writer up (that would cost them a syscall),
+    // so it polls the ring, sleeping for a little while it's empty
+    const auto IDLE_SLEEP = std::chrono::milliseconds(10);
+
+    while (is_running.load(std::memory_order_acquire)) {
+        if (drain_ring())
+            continue;
+
+        std::unique_lock<std::mutex> lock(wake_up_mutex);
+        wake_up.wait_for(lock, IDLE_SLEEP);
+    }
+
+    drain_ring();
+}
+
+void log_start(FILE* new_sink) {
+    if (is_running.load())
+        return;
+
+    for (size_t i = 0; i < LOG_RING_CAPACITY; ++ i)
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+
+    enqueue_position.store(0);
+    dequeue_position = 0;
+
+    sink = new_sink;
+    is_running.store(true, std::memory_order_release);
+
+    writer = std::thread(writer_loop);
+}
+
+void log_stop() {
+    if (!is_running.load())
+        return;
+
+    is_running.store(false, std::memory_order_release);
+    wake_up.notify_one();
+
+    writer.join();
+}
+
+void __log_write(log_level level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    size_t position = 0;
+
+    if (!is_running.load(std::memory_order_acquire)) {
+        char message[LOG_MESSAGE_SIZE];
+        vsnprintf(message, sizeof(message), format, args);
+
+        write_record(stderr, level, message);
+    } else if (log_record* record = reserve_record(&position)) {
+        record->level = level;
+        vsnprintf(record->message, sizeof(record->message), format, args);
+
+        // Record is ready to be written
+        record->sequence.store(position + 1, std::memory_order_release);
+    } else
+        dropped_records.fetch_add(1, std::memory_order_relaxed);
+
+    va_end(args);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdio.h>
+
+enum log_level {
+    LOG_LEVEL_TRACE,   //!< Every call of every operation
+    LOG_LEVEL_DEBUG,   //!< Details useful when something goes wrong
+    LOG_LEVEL_INFO,    //!< Rare events, like mount and unmount
+    LOG_LEVEL_WARNING, //!< Something is off, but we can carry on
+    LOG_LEVEL_ERROR,   //!< Operation failed
+
+    LOG_LEVEL_NONE     //!< Nothing is logged
+};
+
+// Log sites below this level don't even make it into the binary
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Log sites below this level are skipped at runtime
+extern log_level log_runtime_level;
+
+inline void log_set_level(log_level level) { log_runtime_level = level; }
+
+// Messages are formatted by the caller into a ring buffer and written
+// to /sink/ by a background thread, so logging never waits for I/O.
+// Until log_start is called (and after log_stop) messages are written
+// synchronously. Should be called after process daemonized itself.
+void log_start(FILE* sink);
+
+// Writes out everything left in the ring buffer and stops writer thread
+void log_stop();
+
+void __log_write(log_level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define LOG(level, ...)                                             \
+    do {                                                            \
+        if constexpr ((level) >= LOG_COMPILE_LEVEL)                 \
+            if ((level) >= log_runtime_level)                       \
+                __log_write(level, __VA_ARGS__);                    \
+    } while (false)
+
+#define LOG_TRACE(  ...) LOG(LOG_LEVEL_TRACE,   __VA_ARGS__)
+#define LOG_DEBUG(  ...) LOG(LOG_LEVEL_DEBUG,   __VA_ARGS__)
+#define LOG_INFO(   ...) LOG(LOG_LEVEL_INFO,    __VA_ARGS__)
+#define LOG_WARNING(...) LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(  ...) LOG(LOG_LEVEL_ERROR,   __VA_ARGS__)
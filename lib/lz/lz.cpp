@@ -0,0 +1,192 @@
+#include "lz.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+// Shortest match that's encoded, and the shortest that pays off
+static const size_t MIN_MATCH = 4;
+
+// Format requires last bytes to be literals, so decoder
+// can copy them without checking for the end of input
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_SAFE_DISTANCE = 12; // Last match starts before this
+
+// Length fields that don't fit in token's nibble continue in extra bytes
+static const size_t RUN_MASK = 15;
+
+static const int HASH_BITS = 12;
+
+// Matches are copied a word at a time while there's room for the overrun
+static const size_t WILD_COPY = 8;
+
+static uint32_t read32(const char* at) {
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_position(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes that /length/ takes after the nibble in token
+static size_t extra_length_size(size_t length) {
+    return length < RUN_MASK ? 0 : (length - RUN_MASK) / 255 + 1;
+}
+
+static char* write_extra_length(char* out, size_t length) {
+    if (length < RUN_MASK)
+        return out;
+
+    for (length -= RUN_MASK; length >= 255; length -= 255)
+        *out ++ = (char) 255;
+
+    *out ++ = (char) length;
+    return out;
+}
+
+// Writes literals and match that follows them (unless /match_length/ is zero,
+// which is the last sequence), NULL if it wouldn't fit before /end/
+static char* write_sequence(char* out, char* end, const char* literals, size_t literals_size,
+                            size_t offset, size_t match_length) {
+    const size_t encoded_match = match_length ? match_length - MIN_MATCH : 0;
+
+    size_t needed = 1 + extra_length_size(literals_size) + literals_size;
+    if (match_length)
+        needed += 2 + extra_length_size(encoded_match);
+
+    if (needed > (size_t) (end - out))
+        return NULL;
+
+    *out ++ = (char) ((std::min(literals_size, RUN_MASK) << 4) | std::min(encoded_match, RUN_MASK));
+
+    out = write_extra_length(out, literals_size);
+    memcpy(out, literals, literals_size);
+    out += literals_size;
+
+    if (!match_length)
+        return out;
+
+    *out ++ = (char) (offset & 0xFF);
+    *out ++ = (char) (offset >> 8);
+
+    return write_extra_length(out, encoded_match);
+}
+
+size_t lz_compress(const char* source, size_t size, char* destination, size_t capacity) {
+    char* out = destination;
+    char* const out_end = destination + capacity;
+
+    size_t anchor = 0; // Start of literals that aren't written yet
+
+    if (size > MATCH_SAFE_DISTANCE) {
+        // Last position where 4 bytes with each hash were seen, empty slots point
+        // to the start, which is harmless: candidates are compared anyway
+        uint16_t table[1 << HASH_BITS] = {};
+
+        const size_t match_limit = size - MATCH_SAFE_DISTANCE;
+        const size_t extend_limit = size - LAST_LITERALS;
+
+        size_t position = 0;
+        while (position < match_limit) {
+            const uint32_t sequence = read32(source + position);
+            uint16_t* slot = &table[hash_position(sequence)];
+
+            size_t match = *slot;
+            *slot = (uint16_t) position;
+
+            if (match >= position || read32(source + match) != sequence) {
+
+                // Incompressible data is skipped faster and faster
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+
+            // Match can start earlier, in bytes that were going to be literals
+            while (position > anchor && match > 0 && source[position - 1] == source[match - 1])
+                -- position, -- match;
+
+            size_t length = MIN_MATCH;
+            while (position + length < extend_limit && source[position + length] == source[match + length])
+                ++ length;
+
+            out = write_sequence(out, out_end, source + anchor, position - anchor,
+                                 position - match, length);
+            if (!out)
+                return 0;
+
+            position += length;
+            anchor = position;
+        }
+    }
+
+    out = write_sequence(out, out_end, source + anchor, size - anchor, 0, 0);
+    return out ? (size_t) (out - destination) : 0;
+}
+
+// Reads extra bytes of a length field, false if input ends first
+static bool read_extra_length(const unsigned char** in, const unsigned char* end, size_t* length) {
+    if (*length != RUN_MASK)
+        return true;
+
+    unsigned char next;
+    do {
+        if (*in == end)
+            return false;
+
+        next = *(*in) ++;
+        *length += next;
+    } while (next == 255);
+
+    return true;
+}
+
+bool lz_decompress(const char* source, size_t compressed_size, char* destination, size_t size) {
+    const unsigned char* in = (const unsigned char*) source;
+    const unsigned char* const in_end = in + compressed_size;
+
+    size_t out = 0;
+
+    while (in < in_end) {
+        const unsigned char token = *in ++;
+
+        size_t literals_size = token >> 4;
+        if (!read_extra_length(&in, in_end, &literals_size) ||
+            literals_size > (size_t) (in_end - in) || literals_size > size - out)
+            return false;
+
+        memcpy(destination + out, in, literals_size);
+        in += literals_size, out += literals_size;
+
+        if (in == in_end)
+            break; // Last sequence has no match
+
+        if (in_end - in < 2)
+            return false;
+
+        const size_t offset = in[0] | (size_t) in[1] << 8;
+        in += 2;
+
+        size_t length = token & RUN_MASK;
+        if (!read_extra_length(&in, in_end, &length))
+            return false;
+
+        length += MIN_MATCH;
+        if (offset == 0 || offset > out || length > size - out)
+            return false;
+
+        // Match can overlap bytes it produces, then it repeats them
+        const char* match = destination + out - offset;
+        if (offset >= WILD_COPY && size - out >= length + WILD_COPY)
+            for (size_t i = 0; i < length; i += WILD_COPY)
+                memcpy(destination + out + i, match + i, WILD_COPY);
+        else
+            for (size_t i = 0; i < length; ++ i)
+                destination[out + i] = match[i];
+
+        out += length;
+    }
+
+    return out == size;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fast byte oriented LZ77 compression in LZ4 block format: sequences of
+// literals followed by a match (offset up to 64 KiB back and length),
+// no entropy coding, so decompression is little more than memcpy.
+
+// Offsets only reach this far back, compressed inputs shouldn't be bigger
+const size_t LZ_MAX_INPUT = 64 * 1024;
+
+// Biggest size that /size/ bytes can take compressed
+inline size_t lz_bound(size_t size) { return size + size / 255 + 16; }
+
+// Compresses /size/ (at most LZ_MAX_INPUT) bytes of /source/ into /destination/, returns compressed
+// size or 0 if it wouldn't fit in /capacity/ bytes (so callers can pass
+// a capacity below which compression is worth it and skip the rest)
+size_t lz_compress(const char* source, size_t size, char* destination, size_t capacity);
+
+// Decompresses exactly /size/ bytes, false if /source/ is corrupted
+// or doesn't hold exactly that much data
+bool lz_decompress(const char* source, size_t compressed_size, char* destination, size_t size);
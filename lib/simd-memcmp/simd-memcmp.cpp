@@ -0,0 +1,60 @@
+#include "simd-memcmp.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static const size_t CACHE_LINE = 64;
+
+__attribute__((target("avx2")))
+static bool memequal_avx2(const char* first, const char* second, size_t size) {
+    for (; size >= CACHE_LINE; size -= CACHE_LINE, first += CACHE_LINE, second += CACHE_LINE) {
+        __m256i low  = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)  first),
+                                         _mm256_loadu_si256((const __m256i*) second));
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (first  + 32)),
+                                         _mm256_loadu_si256((const __m256i*) (second + 32)));
+
+        if ((unsigned) _mm256_movemask_epi8(_mm256_and_si256(low, high)) != 0xFFFFFFFFu)
+            return false;
+    }
+
+    return memcmp(first, second, size) == 0;
+}
+
+static bool memequal_sse2(const char* first, const char* second, size_t size) {
+    for (; size >= CACHE_LINE; size -= CACHE_LINE, first += CACHE_LINE, second += CACHE_LINE) {
+        __m128i equal = _mm_set1_epi8(-1);
+
+        for (size_t i = 0; i < CACHE_LINE; i += 16)
+            equal = _mm_and_si128(equal,
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (first  + i)),
+                               _mm_loadu_si128((const __m128i*) (second + i))));
+
+        if (_mm_movemask_epi8(equal) != 0xFFFF)
+            return false;
+    }
+
+    return memcmp(first, second, size) == 0;
+}
+
+typedef bool (*memequal_function)(const char* first, const char* second, size_t size);
+
+// Picked once, on first use
+static memequal_function select_memequal() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? memequal_avx2 : memequal_sse2;
+}
+
+bool simd_memequal(const void* first, const void* second, size_t size) {
+    static const memequal_function memequal = select_memequal();
+    return memequal((const char*) first, (const char*) second, size);
+}
+
+#else
+
+bool simd_memequal(const void* first, const void* second, size_t size) {
+    return memcmp(first, second, size) == 0;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+// Checks if two buffers hold same bytes, compares them 64 bytes
+// (a cache line) at a time with the widest vectors CPU supports
+// and stops on the first cache line that differs.
+bool simd_memequal(const void* first, const void* second, size_t size);
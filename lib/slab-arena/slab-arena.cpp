@@ -0,0 +1,181 @@
+#include "slab-arena.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t slab_table_size(const slab_arena* arena) {
+    return arena->slabs_capacity * sizeof(*arena->slabs);
+}
+
+static size_t slab_size_in_bytes(const slab_arena* arena) {
+    return arena->slab_bytes;
+}
+
+// Sets arena up without a file behind it yet
+static stack_trace* slab_arena_init(slab_arena* arena, size_t slot_size, size_t max_slots,
+                                    size_t slab_size) {
+    if (slot_size == 0)
+        return FAILURE(RUNTIME_ERROR, "Slot size can't be zero!");
+
+    *arena = {
+        .slabs = NULL, .slabs_capacity = 0, .slabs_used = 0,
+
+        .slot_size = slot_size,
+        // Slab holds at least one slot, even if slot is bigger than slab
+        .slots_per_slab = slab_size > slot_size ? slab_size / slot_size : 1,
+        .slab_bytes = 0,
+
+        .fd = -1
+    };
+
+    // Slabs are mapped at their offsets in file, which have to be page aligned
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    arena->slab_bytes = (arena->slots_per_slab * slot_size + page_size - 1) / page_size * page_size;
+
+    arena->slabs_capacity = (max_slots + arena->slots_per_slab - 1) / arena->slots_per_slab;
+
+    // Table is mapped rather than allocated, so only the part
+    // that's actually used ends up taking physical memory
+    void* table = mmap(NULL, slab_table_size(arena), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (table == MAP_FAILED)
+        return FAILURE(RUNTIME_ERROR, strerror(errno));
+
+    arena->slabs = (char**) table;
+    return SUCCESS();
+}
+
+stack_trace* slab_arena_create(slab_arena* arena, size_t slot_size, size_t max_slots,
+                               size_t slab_size) {
+    TRY slab_arena_init(arena, slot_size, max_slots, slab_size)
+        FAIL("Can't set up arena!");
+
+    // File is sparse, like anonymous memory it only takes
+    // physical memory for pages that have actually been touched
+    arena->fd = memfd_create("slab-arena", MFD_CLOEXEC);
+    if (arena->fd != -1 &&
+        ftruncate(arena->fd, (off_t) (arena->slabs_capacity * slab_size_in_bytes(arena))) != 0) {
+        close(arena->fd);
+        arena->fd = -1;
+    }
+
+    return SUCCESS();
+}
+
+stack_trace* slab_arena_create_in(slab_arena* arena, const char* directory, size_t slot_size,
+                                  size_t max_slots, size_t slab_size) {
+    TRY slab_arena_init(arena, slot_size, max_slots, slab_size)
+        FAIL("Can't set up arena!");
+
+    // File has no name, so it's gone as soon as arena closes it
+    arena->fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (arena->fd == -1) {
+        int error = errno;
+        slab_arena_destroy(arena);
+        return FAILURE(RUNTIME_ERROR, "Can't create file in \"%s\": %s", directory, strerror(error));
+    }
+
+    if (ftruncate(arena->fd, (off_t) (arena->slabs_capacity * slab_size_in_bytes(arena))) != 0) {
+        int error = errno;
+        slab_arena_destroy(arena);
+        return FAILURE(RUNTIME_ERROR, "Can't size file in \"%s\": %s", directory, strerror(error));
+    }
+
+    return SUCCESS();
+}
+
+stack_trace* slab_arena_reserve(slab_arena* arena, size_t slot) {
+    const size_t slab_index = slot / arena->slots_per_slab;
+
+    if (slab_index >= arena->slabs_capacity)
+        return FAILURE(RUNTIME_ERROR, "Slot %zu is out of arena's bounds!", slot);
+
+    if (arena->slabs[slab_index] != NULL)
+        return SUCCESS(); // Already mapped
+
+    // Both kinds of mapping are zeroed and only take physical
+    // memory for pages that have actually been touched
+    void* slab = arena->fd != -1
+        ? mmap(NULL, slab_size_in_bytes(arena), PROT_READ | PROT_WRITE, MAP_SHARED,
+               arena->fd, (off_t) (slab_index * slab_size_in_bytes(arena)))
+        : mmap(NULL, slab_size_in_bytes(arena), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (slab == MAP_FAILED)
+        return FAILURE(RUNTIME_ERROR, strerror(errno));
+
+    arena->slabs[slab_index] = (char*) slab;
+    if (slab_index >= arena->slabs_used)
+        arena->slabs_used = slab_index + 1;
+
+    return SUCCESS();
+}
+
+bool slab_arena_write(slab_arena* arena, size_t slot, const char* data, size_t size) {
+    if (arena->fd == -1) {
+        memcpy(slab_arena_get(arena, slot), data, size);
+        return true;
+    }
+
+    const off_t offset = slab_arena_offset(arena, slot);
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(arena->fd, data + written, size - written, offset + (off_t) written);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        // Writing through the mapping instead would only turn this into SIGBUS
+        if (result <= 0)
+            return false;
+
+        written += (size_t) result;
+    }
+
+    return true;
+}
+
+void slab_arena_discard(slab_arena* arena, size_t slot) {
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    // Only whole pages inside of the slot can be returned
+    uintptr_t begin = (uintptr_t) slab_arena_get(arena, slot);
+    uintptr_t end   = begin + arena->slot_size;
+
+    begin = (begin + page_size - 1) & ~(page_size - 1);
+    end   =  end                    & ~(page_size - 1);
+
+    if (begin >= end)
+        return;
+
+    // Pages of a shared mapping stay in the memory file,
+    // so they have to be punched out of the file itself
+    if (arena->fd != -1)
+        fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  slab_arena_offset(arena, slot) + (off_t) (begin - (uintptr_t) slab_arena_get(arena, slot)),
+                  (off_t) (end - begin));
+    else
+        madvise((void*) begin, end - begin, MADV_DONTNEED);
+}
+
+void slab_arena_destroy(slab_arena* arena) {
+    if (arena->slabs == NULL)
+        return; // Never created or already destroyed
+
+    for (size_t i = 0; i < arena->slabs_used; ++ i)
+        if (arena->slabs[i] != NULL)
+            munmap(arena->slabs[i], slab_size_in_bytes(arena));
+
+    munmap(arena->slabs, slab_table_size(arena));
+
+    if (arena->fd != -1)
+        close(arena->fd);
+
+    *arena = {}; // Zero arena out
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "trace.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Arena of equally sized slots, slots are grouped in big
+// slabs that are mapped lazily and never move, so pointer
+// to a slot stays valid for the whole life of the arena.
+//
+// Table of slabs is sized for /max_slots/ up front and never
+// moves either, so slots that are already reserved can be read
+// while other thread reserves new ones (but reserve calls
+// themselves should be serialized by the caller).
+//
+// Slabs are mappings of one memory file, so a slot can also be
+// read (or spliced) through /fd/ at slab_arena_offset. If memory
+// file can't be created slabs are anonymous and /fd/ is -1.
+struct slab_arena {
+    char** slabs; // NULL for slabs that weren't used yet
+    size_t slabs_capacity;
+    size_t slabs_used; // One past the last slab that was mapped
+
+    size_t slot_size, slots_per_slab;
+    size_t slab_bytes; // Rounded up to whole pages, so every slab starts on a page of /fd/
+
+    int fd;
+};
+
+const size_t SLAB_ARENA_DEFAULT_SLAB_SIZE = 2 * 1024 * 1024;
+
+stack_trace* slab_arena_create(slab_arena* arena, size_t slot_size, size_t max_slots,
+                               size_t slab_size = SLAB_ARENA_DEFAULT_SLAB_SIZE);
+
+// Same as slab_arena_create, but slabs are mappings of an unnamed file
+// in /directory/ rather than of memory, so the system can write slots
+// out and drop them from memory whenever it runs short of it
+stack_trace* slab_arena_create_in(slab_arena* arena, const char* directory, size_t slot_size,
+                                  size_t max_slots, size_t slab_size = SLAB_ARENA_DEFAULT_SLAB_SIZE);
+
+// Makes sure that memory for /slot/ is mapped, should be called
+// before first slab_arena_get for this slot
+stack_trace* slab_arena_reserve(slab_arena* arena, size_t slot);
+
+inline char* slab_arena_get(slab_arena* arena, size_t slot) {
+    return arena->slabs[slot / arena->slots_per_slab] +
+        (slot % arena->slots_per_slab) * arena->slot_size;
+}
+
+// Position of /slot/ in arena's memory file
+inline off_t slab_arena_offset(const slab_arena* arena, size_t slot) {
+    return (off_t) ((slot / arena->slots_per_slab) * arena->slab_bytes +
+                    (slot % arena->slots_per_slab) * arena->slot_size);
+}
+
+// Copies /size/ bytes to the start of a reserved /slot/. Prefer it over
+// writing through slab_arena_get: it fills memory file's pages without
+// taking a page fault for each of them. False if file is out of space
+bool slab_arena_write(slab_arena* arena, size_t slot, const char* data, size_t size);
+
+// Gives pages of an unused slot back to the system, slot stays
+// reserved and reads as zeroes until it's written to again
+void slab_arena_discard(slab_arena* arena, size_t slot);
+
+void slab_arena_destroy(slab_arena* arena);
@@ -0,0 +1,216 @@
+#include "wal.h"
+#include "murmur3.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t record_checksum(const char* record, size_t size, uint64_t sequence) {
+    uint32_t checksum;
+    murmur3_x86_32(record, (int) size, (uint32_t) (sequence ^ (sequence >> 32)), &checksum);
+    return checksum;
+}
+
+stack_trace* wal_open(wal* log, const char* path, uint64_t sequence) {
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (log->fd == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+
+    log->pending.clear();
+    log->writing.clear();
+
+    log->sequence = log->durable = sequence;
+
+    log->is_flushing = log->failed = log->stop = false;
+    return SUCCESS();
+}
+
+static bool write_all(int fd, const std::vector<char>& data) {
+    for (size_t written = 0; written < data.size(); ) {
+        ssize_t result = write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result < 0)
+            return false;
+
+        written += (size_t) result;
+    }
+
+    return true;
+}
+
+static void flusher_loop(wal* log) {
+    std::unique_lock<std::mutex> guard(log->lock);
+
+    while (true) {
+        log->appended.wait(guard, [log] { return !log->pending.empty() || log->stop; });
+        if (log->pending.empty())
+            break; // Stopped with nothing left
+
+        // Everything that was appended since the last sync goes together
+        log->writing.swap(log->pending);
+        const uint64_t last = log->sequence;
+
+        log->is_flushing = true;
+        guard.unlock();
+
+        bool written = write_all(log->fd, log->writing) && fdatasync(log->fd) == 0;
+
+        guard.lock();
+        log->is_flushing = false;
+        log->writing.clear();
+
+        if (written && !log->failed)
+            log->durable = last;
+        else
+            log->failed = true;
+
+        log->flushed.notify_all();
+    }
+}
+
+void wal_start(wal* log) {
+    log->flusher = std::thread(flusher_loop, log);
+}
+
+void wal_close(wal* log) {
+    if (log->flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(log->lock);
+            log->stop = true;
+        }
+
+        log->appended.notify_one();
+        log->flusher.join();
+    }
+
+    close(log->fd), log->fd = -1;
+}
+
+char* wal_reserve(wal* log, size_t max_size) {
+    std::unique_lock<std::mutex> guard(log->lock);
+
+    // Appenders can't outrun the disk by more than this. Log that failed
+    // isn't written anymore, so there's nothing to wait for
+    log->flushed.wait(guard, [log] {
+        return log->pending.size() < WAL_MAX_PENDING || !log->flusher.joinable() || log->failed;
+    });
+
+    guard.release(); // Stays locked until wal_commit
+
+    log->reserved = log->pending.size();
+    log->pending.resize(log->reserved + sizeof(wal_record_header) + max_size);
+
+    return log->pending.data() + log->reserved + sizeof(wal_record_header);
+}
+
+uint64_t wal_commit(wal* log, size_t size) {
+    char* framed = log->pending.data() + log->reserved;
+    const uint64_t sequence = ++ log->sequence;
+
+    wal_record_header header = {
+        .size = (uint32_t) size,
+        .checksum = record_checksum(framed + sizeof(header), size, sequence),
+        .sequence = sequence
+    };
+
+    memcpy(framed, &header, sizeof(header));
+    log->pending.resize(log->reserved + sizeof(header) + size);
+
+    // Failed log isn't written anymore, records would only pile up
+    if (log->failed)
+        log->pending.clear();
+
+    log->lock.unlock();
+    log->appended.notify_one();
+
+    return sequence;
+}
+
+uint64_t wal_sequence(wal* log) {
+    std::lock_guard<std::mutex> guard(log->lock);
+    return log->sequence;
+}
+
+bool wal_wait(wal* log, uint64_t sequence) {
+    std::unique_lock<std::mutex> guard(log->lock);
+
+    log->flushed.wait(guard, [log, sequence] { return log->durable >= sequence || log->failed; });
+    return log->durable >= sequence;
+}
+
+stack_trace* wal_reset(wal* log) {
+    std::unique_lock<std::mutex> guard(log->lock);
+
+    // Records that flusher writes now would land after truncation
+    log->flushed.wait(guard, [log] { return !log->is_flushing; });
+
+    log->pending.clear();
+
+    if (ftruncate(log->fd, 0) == -1 || fdatasync(log->fd) == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't truncate log: %s", strerror(errno));
+
+    // Whatever failed before is behind the saved state now
+    log->durable = log->sequence;
+    log->failed = false;
+
+    log->flushed.notify_all();
+
+    return SUCCESS();
+}
+
+stack_trace* wal_replay(const char* path, wal_apply_function apply, void* context, uint64_t* last) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return FAILURE(RUNTIME_ERROR, "Can't read \"%s\": %s", path, strerror(errno));
+    }
+
+    const size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return SUCCESS();
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return FAILURE(RUNTIME_ERROR, "Can't map \"%s\": %s", path, strerror(errno));
+
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const char* records = (const char*) mapping;
+    stack_trace* trace = SUCCESS();
+
+    for (size_t offset = 0; size - offset >= sizeof(wal_record_header); ) {
+        wal_record_header header;
+        memcpy(&header, records + offset, sizeof(header));
+
+        const char* record = records + offset + sizeof(header);
+        if (header.size > size - offset - sizeof(header) ||
+            header.checksum != record_checksum(record, header.size, header.sequence))
+            break; // Torn by a crash, nothing after it was acknowledged as durable
+
+        trace = apply(context, header.sequence, record, header.size);
+        if (!trace_is_success(trace)) {
+            trace = PASS_FAILURE(trace, RUNTIME_ERROR, "Can't apply record %llu!",
+                                 (unsigned long long) header.sequence);
+            break;
+        }
+
+        *last = header.sequence;
+        offset += sizeof(header) + header.size;
+    }
+
+    munmap(mapping, size);
+    return trace;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "trace.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Append-only log of records that are made durable in the background.
+// Appenders copy their records to a buffer and go on, a flusher thread
+// writes everything that piled up with one write and one fdatasync, so
+// all records appended during a sync share the next one (group commit).
+//
+// Records are numbered in the order they were appended, wal_wait tells
+// when a record is on disk. Each one is framed with its size, number and
+// checksum, so a record that was only partly written ends the log.
+
+struct wal_record_header {
+    uint32_t size;     // Of the record that follows
+    uint32_t checksum; // Of the record, seeded with its sequence number
+    uint64_t sequence;
+};
+
+struct wal {
+    int fd;
+
+    std::mutex lock;
+    std::condition_variable appended, flushed;
+
+    std::vector<char> pending; // Framed records that flusher didn't take yet
+    std::vector<char> writing; // Ones that it writes now
+
+    size_t reserved; // Where record between wal_reserve and wal_commit starts in /pending/
+
+    uint64_t sequence; // Number of the last appended record
+    uint64_t durable;  // Every record up to this one is on disk
+
+    bool is_flushing;
+    bool failed; // Write or sync failed, nothing is durable from then on
+    bool stop;
+
+    std::thread flusher;
+};
+
+// Appenders wait for flusher once this many bytes are pending
+const size_t WAL_MAX_PENDING = 64 * 1024 * 1024;
+
+// Opens log at /path/ for appending, records that are there stay. The
+// next record is numbered /sequence/ + 1. Flusher isn't started yet
+stack_trace* wal_open(wal* log, const char* path, uint64_t sequence);
+
+// Starts flusher thread, before that records are only kept in memory
+void wal_start(wal* log);
+
+// Writes out every pending record, then stops flusher and closes the log
+void wal_close(wal* log);
+
+// Room for a record of up to /max_size/ bytes. Log stays locked until
+// wal_commit, so records are numbered in the order they were reserved
+char* wal_reserve(wal* log, size_t max_size);
+
+// Appends reserved record, which took /size/ bytes, returns its number
+uint64_t wal_commit(wal* log, size_t size);
+
+// Number of the last appended record
+uint64_t wal_sequence(wal* log);
+
+// Waits until record /sequence/ (and every one before it) is on disk,
+// false if it never will be. Flusher should be running
+bool wal_wait(wal* log, uint64_t sequence);
+
+// Drops every record, once state they lead to is saved elsewhere. Nothing
+// should be appended meanwhile, numbering goes on from where it was
+stack_trace* wal_reset(wal* log);
+
+typedef stack_trace* (*wal_apply_function)(void* context, uint64_t sequence,
+                                           const char* record, size_t size);
+
+// Calls /apply/ for every intact record of the log at /path/ in order, up
+// to the first one that's torn or damaged. /last/ is the number of the last
+// applied record, it's left as it is if there were none
+stack_trace* wal_replay(const char* path, wal_apply_function apply, void* context, uint64_t* last);
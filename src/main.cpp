@@ -1,6 +1,13 @@
-#include "hash-table.h"
+#include "cdc.h"
+#include "fingerprint.h"
+#include "flat-hash-table.h"
+#include "log.h"
+#include "lz.h"
 #include "murmur3.h"
+#include "simd-memcmp.h"
+#include "slab-arena.h"
 #include "trace.h"
+#include "wal.h"
 
 #include <algorithm>
 #include <asm-generic/errno-base.h>
@@ -8,15 +15,27 @@
 #include <fcntl.h>
 #include <linked-list.h>
 #include <malloc.h>
+#include <pthread.h>
 
 #define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
 #include <string.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 #include <unordered_map>
 #include <string>
@@ -26,352 +45,3927 @@
 
 
 const uint32_t HASH_SEED = 42;
-const size_t HASH_SIZE_IN_32BIT_CHUNKS = 128 / 32;
 
-struct hash_t {
-    uint32_t data[HASH_SIZE_IN_32BIT_CHUNKS];
-};
+typedef fingerprint hash_t;
+
 
+// Block size is picked at mount time, payload of every block
+// takes a slot of this size in block_storage::payloads arena
+const size_t DEFAULT_BLOCK_SIZE =  4 * 1024;
+const size_t MIN_BLOCK_SIZE     =  4 * 1024;
+const size_t MAX_BLOCK_SIZE     = 64 * 1024;
 
-const size_t BLOCK_SIZE = 32;
+// Default chunk bounds for content defined chunking (-o chunking=cdc)
+const size_t DEFAULT_CDC_MIN_SIZE =  2 * 1024;
+const size_t DEFAULT_CDC_AVG_SIZE =  8 * 1024;
+const size_t DEFAULT_CDC_MAX_SIZE = 64 * 1024;
+
+// Largest chunk becomes block size, so it's bound the same way, both when
+// mounting and when loading an image that was saved with content defined chunking
+static bool is_valid_cdc_max_size(size_t max_size) {
+    return MIN_BLOCK_SIZE <= max_size && max_size <= MAX_BLOCK_SIZE;
+}
 
 struct block {
-    char data[BLOCK_SIZE];
     size_t size;
+
+    hash_t hash;       // Key under which block is registered in block_map
+    size_t references; // Number of block chain entries pointing to block
+
+    // Different blocks with the same hash (which can only be told apart
+    // in verify mode) are chained, block_map points to the first one
+    element_index_t next_same_hash;
 };
 
 
 typedef element_index_t block_id_t;
 
-struct block_storage {
-    hash_table<hash_t, element_index_t> block_map;
+// Where payload of a block is now
+enum payload_location : uint8_t {
+    BLOCK_IN_MEMORY,         // In its slot of block_shard::payloads
+    BLOCK_COMPRESSED,        // In block_tier::compressed
+    BLOCK_SPILLED,           // In its slot of block_shard::spill
+    BLOCK_SPILLED_COMPRESSED // Compressed, in its slot of block_shard::spill
+};
+
+// Kept in an arena next to payloads rather than in /block/, so it can
+// be checked without shard's lock (and allocator can't move it meanwhile)
+struct block_tier {
+    // Only changed under shard's lock, but atomically. Slot that payload
+    // leaves is given back to the system once nobody can be reading it
+    payload_location location;
+
+    // Payload is in the image or in write-ahead log already, so log records
+    // can refer to block by its hash. Only set with the log locked, atomically
+    bool logged;
+
+    uint32_t compressed_size; // With compressed locations
+    char* compressed; // Only with BLOCK_COMPRESSED
+
+    uint32_t last_read; // Value of block_storage::tier_epoch then. Changed atomically
+};
+
+static uint32_t hash_hash(hash_t hash) { return hash.data[0]; }
+static bool hash_equal(hash_t* first, hash_t* second) {
+    for (size_t i = 0; i < FINGERPRINT_SIZE_IN_32BIT_CHUNKS; ++ i)
+        if (first->data[i] != second->data[i])
+            return false;
+
+    return true;
+}
+
+// Blocks are spread over independently locked shards by their hash, so
+// writers of different data rarely wait for each other. Should be power of two
+const size_t BLOCK_STORAGE_SHARDS = 64;
+
+// Blocks that block_storage::get_blocks fingerprints and looks up together.
+// Small batches keep hashing of the next chunks overlapped with lookups
+const size_t BLOCK_STORAGE_BATCH = 4;
+
+struct block_shard {
+    // Guards everything in shard, except payloads of existing blocks:
+    // they never change, and stay alive while anyone references them
+    std::mutex lock;
+
+    flat_hash_table<hash_t, element_index_t, hash_hash, hash_equal> block_map;
     linked_list<block> allocator;
 
-    block_storage(): block_map {}, allocator {} {
-        hash_table_create(&block_map, hash_hash, 32, 10, hash_equal);
-        linked_list_create(&allocator);
+    // Payload of block is stored in slot with the same index as block,
+    // and so are its block_tier and its place in spill file
+    slab_arena payloads;
+    slab_arena tiers;
+    slab_arena spill; // Only set up with a memory budget
+
+    // Bytes of payloads (compressed or not) that are kept in memory.
+    // Changed under the lock, but can be read atomically without it
+    size_t resident_bytes;
+
+    size_t compressed_blocks, compressed_bytes;
+    size_t spilled_blocks;
+};
+
+// Block that moved out of its slot, which is still there, see block_storage::discard_moved
+struct moved_block {
+    block_id_t id;
+    payload_location location; // Where it moved
+};
+
+// Payload is only compressed if that saves at least this part of it
+const size_t BLOCK_COMPRESSION_MIN_SAVING = 4;
+
+struct block_storage {
+    block_shard shards[BLOCK_STORAGE_SHARDS];
+    size_t block_size;
+
+    fingerprinter hasher; // Picked at mount time, like block size
+
+    // Compare contents of blocks with same hash, instead of trusting
+    // hash, this makes deduplication immune to hash collisions
+    bool verify;
+
+    // Number of compression and spill passes that were started, blocks
+    // that weren't read between two of them are cold. Changed atomically
+    uint32_t tier_epoch;
+
+    // Payloads kept in memory shouldn't take more bytes than this, zero
+    // if there's no limit. Others are spilled, see enable_spill
+    size_t max_mem;
+
+    block_storage(size_t block_size = DEFAULT_BLOCK_SIZE, bool verify = false):
+        shards {}, block_size(block_size), hasher {}, verify(verify), tier_epoch(0), max_mem(0) {
+
+        TRY fingerprinter_create(&hasher, FINGERPRINT_MURMUR3)
+            THROW("Can't create default fingerprinter!");
+
+        for (block_shard& shard: shards) {
+            flat_hash_table_create(&shard.block_map);
+            linked_list_create(&shard.allocator);
+
+            TRY slab_arena_create(&shard.payloads, block_size, MAX_BLOCKS_PER_SHARD + 1)
+                THROW("Can't create arena for blocks of size %zu!", block_size);
+
+            TRY slab_arena_create(&shard.tiers, sizeof(block_tier), MAX_BLOCKS_PER_SHARD + 1)
+                THROW("Can't create arena for block tiers!");
+        }
     }
 
     ~block_storage() {
-        hash_table_destroy(&block_map);
-        linked_list_destroy(&allocator);
+        for (block_shard& shard: shards) {
+            LINKED_LIST_TRAVERSE(&shard.allocator, block, current)
+                free(tier_of(&shard, linked_list_get_index(&shard.allocator, current))->compressed);
+
+            slab_arena_destroy(&shard.spill);
+            slab_arena_destroy(&shard.tiers);
+            flat_hash_table_destroy(&shard.block_map);
+            linked_list_destroy(&shard.allocator);
+            slab_arena_destroy(&shard.payloads);
+        }
     }
 
-    static uint32_t hash_hash(hash_t hash) { return hash.data[0]; }
-    static bool hash_equal(hash_t* first, hash_t* second) {
-        for (int i = 0; i < HASH_SIZE_IN_32BIT_CHUNKS; ++ i)
-            if (first->data[i] != second->data[i])
-                return false;
+    // Block size can only be changed while there are no blocks yet
+    stack_trace* set_block_size(size_t new_block_size) {
+        if (size_t used = block_count())
+            return FAILURE(RUNTIME_ERROR, "Can't resize %zu existing blocks!", used);
 
-        return true;
+        if (max_mem != 0)
+            return FAILURE(RUNTIME_ERROR, "Can't resize blocks after spill file is set up!");
+
+        for (block_shard& shard: shards) {
+            slab_arena_destroy(&shard.payloads);
+            TRY slab_arena_create(&shard.payloads, new_block_size, MAX_BLOCKS_PER_SHARD + 1)
+                FAIL("Can't create arena for blocks of size %zu!", new_block_size);
+        }
+
+        block_size = new_block_size;
+        return SUCCESS();
+    }
+
+    // Same as block size, blocks hashed differently can't be mixed
+    stack_trace* set_fingerprint_backend(fingerprint_backend backend) {
+        if (size_t used = block_count())
+            return FAILURE(RUNTIME_ERROR, "Can't rehash %zu existing blocks!", used);
+
+        TRY fingerprinter_create(&hasher, backend)
+            FAIL("Can't use fingerprint backend \"%s\"!", fingerprint_backend_name(backend));
+
+        return SUCCESS();
     }
 
+    // Limits memory taken by payloads to /new_max_mem/ bytes, blocks that
+    // don't fit go to spill files in /directory/. Should be called once
+    // block size is set and before any blocks are added
+    stack_trace* enable_spill(const char* directory, size_t new_max_mem) {
+        for (block_shard& shard: shards)
+            TRY slab_arena_create_in(&shard.spill, directory, block_size, MAX_BLOCKS_PER_SHARD + 1)
+                FAIL("Can't create spill file!");
+
+        max_mem = new_max_mem;
+        return SUCCESS();
+    }
+
+    size_t block_count() {
+        size_t count = 0;
+        for (block_shard& shard: shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            count += shard.allocator.used;
+        }
+
+        return count;
+    }
+
+    // Block id is made of its index in shard's allocator and shard's number,
+    // indices start from 1, so no block gets linked_list_end_index as id
+    static const size_t MAX_BLOCKS_PER_SHARD = INT32_MAX / BLOCK_STORAGE_SHARDS;
+
+    static size_t shard_of(hash_t hash) { return hash.data[1] & (BLOCK_STORAGE_SHARDS - 1); }
+
+    static size_t shard_of(block_id_t block_id) { return block_id % BLOCK_STORAGE_SHARDS; }
+    static size_t slot_of (block_id_t block_id) { return block_id / BLOCK_STORAGE_SHARDS; }
+
+    static block_id_t make_block_id(size_t shard, element_index_t slot) {
+        return (block_id_t) (slot * BLOCK_STORAGE_SHARDS + shard);
+    }
+
+    // Returned block is referenced once more, every id obtained
+    // this way should be given back with release_block eventually
     block_id_t get_block(const char* data, size_t size) {
+        hash_t block_hash;
+        fingerprint_compute(&hasher, data, size, &block_hash);
+
+        const size_t shard_index = shard_of(block_hash);
+        std::lock_guard<std::mutex> guard(shards[shard_index].lock);
+
+        return get_block(shard_index, block_hash, data, size);
+    }
+
+    // Same as get_block for each of /count/ buffers, but blocks are fingerprinted
+    // together, and each shard is locked once for all of its blocks in a batch
+    void get_blocks(const char* const* data, const size_t* sizes, size_t count, block_id_t* ids) {
+        for (size_t first = 0; first < count; first += BLOCK_STORAGE_BATCH) {
+            const size_t batch = std::min(BLOCK_STORAGE_BATCH, count - first);
+
+            hash_t hashes[BLOCK_STORAGE_BATCH];
+            fingerprint_compute_batch(&hasher, (const void* const*) data + first, sizes + first,
+                                      batch, hashes);
+
+            bool resolved[BLOCK_STORAGE_BATCH] = {};
+            for (size_t i = 0; i < batch; ++ i) {
+                if (resolved[i])
+                    continue;
+
+                const size_t shard_index = shard_of(hashes[i]);
+                block_shard* shard = &shards[shard_index];
+
+                std::lock_guard<std::mutex> guard(shard->lock);
+
+                // Buckets of all blocks in this shard are loaded while first ones are resolved
+                for (size_t j = i; j < batch; ++ j)
+                    if (!resolved[j] && shard_of(hashes[j]) == shard_index)
+                        flat_hash_table_prefetch(&shard->block_map, hashes[j]);
+
+                for (size_t j = i; j < batch; ++ j)
+                    if (!resolved[j] && shard_of(hashes[j]) == shard_index) {
+                        ids[first + j] = get_block(shard_index, hashes[j],
+                                                   data[first + j], sizes[first + j]);
+                        resolved[j] = true;
+                    }
+            }
+        }
+    }
+
+    // Shard should be locked
+    block_id_t get_block(size_t shard_index, hash_t block_hash, const char* data, size_t size) {
+        block_shard* shard = &shards[shard_index];
+
         // Try to find existing block
-        block_id_t found_block = find_block(data, size);
-        if (found_block != linked_list_end_index)
+        block_id_t found_block = find_block(shard, block_hash, data, size);
+        if (found_block != linked_list_end_index) {
+            ++ get_block(found_block)->references;
             return found_block;
+        }
+
+        assert(size <= block_size);
 
         block new_block {};
         new_block.size = size;
-
-        std::copy(data, data + size, new_block.data);
+        new_block.references = 1;
+        new_block.hash = block_hash;
+        new_block.next_same_hash = linked_list_end_index;
 
         // Allocate new block
-        TRY linked_list_push_front(&allocator, new_block)
+        element_index_t slot;
+        TRY linked_list_push_front(&shard->allocator, new_block, &slot)
             THROW("Fail!");
 
-        element_index_t newly_added =
-            linked_list_head_index(&allocator);
+        if ((size_t) slot > MAX_BLOCKS_PER_SHARD) {
+            fprintf(stderr, "dedfs: too many blocks in shard %zu!\n", shard_index);
+            abort(); // Id of the block wouldn't fit
+        }
 
-        // Register it in map
-        hash_t block_hash;
-        murmur3_x64_128(data, size, HASH_SEED, &block_hash);
+        TRY slab_arena_reserve(&shard->payloads, slot)
+            THROW("Can't allocate payload for block %d!", slot);
+
+        TRY slab_arena_reserve(&shard->tiers, slot)
+            THROW("Can't allocate tier of block %d!", slot);
+
+        block_id_t newly_added = make_block_id(shard_index, slot);
+        if (!slab_arena_write(&shard->payloads, slot, data, size)) {
+            fprintf(stderr, "dedfs: out of memory for payload of block %d!\n", newly_added);
+            abort(); // It would crash on first read anyway
+        }
+
+        // Being written counts as being read, block stays hot for a while
+        *tier_of(shard, slot) = { .location = BLOCK_IN_MEMORY, .logged = false,
+                                  .compressed_size = 0, .compressed = NULL,
+                                  .last_read = __atomic_load_n(&tier_epoch, __ATOMIC_RELAXED) };
+
+        __atomic_add_fetch(&shard->resident_bytes, size, __ATOMIC_RELAXED);
+
+        // Register it in map, or in front of blocks that collided with it
+        element_index_t* same_hash =
+            flat_hash_table_lookup(&shard->block_map, block_hash);
 
-        hash_table_insert<hash_t, element_index_t>(&block_map, block_hash, newly_added);
+        if (same_hash) {
+            get_block(newly_added)->next_same_hash = *same_hash;
+            *same_hash = newly_added;
+        } else
+            flat_hash_table_insert(&shard->block_map, block_hash, newly_added);
 
         // Return newly created block
-        return linked_list_head_index(&allocator);
+        return newly_added;
+    }
+
+    // Same as get_block, but block is looked up by /block_hash/ that
+    // its contents are known to have, so they aren't fingerprinted again
+    block_id_t get_hashed_block(hash_t block_hash, const char* data, size_t size) {
+        const size_t shard_index = shard_of(block_hash);
+        std::lock_guard<std::mutex> guard(shards[shard_index].lock);
+
+        return get_block(shard_index, block_hash, data, size);
+    }
+
+    // Block of /size/ bytes with /block_hash/, without referencing it,
+    // linked_list_end_index if there's none. Contents aren't compared
+    block_id_t find_hashed_block(hash_t block_hash, size_t size) {
+        block_shard* shard = &shards[shard_of(block_hash)];
+        std::lock_guard<std::mutex> guard(shard->lock);
+
+        element_index_t* first = flat_hash_table_lookup(&shard->block_map, block_hash);
+
+        block_id_t candidate = first ? *first : linked_list_end_index;
+        while (candidate != linked_list_end_index && get_block(candidate)->size != size)
+            candidate = get_block(candidate)->next_same_hash;
+
+        return candidate;
+    }
+
+    // Whether another block has the same hash and size, so find_hashed_block could pick it instead
+    bool has_twin(block_id_t block_id) {
+        std::lock_guard<std::mutex> guard(shards[shard_of(block_id)].lock);
+        const block* target_block = get_block(block_id);
+
+        element_index_t* first = flat_hash_table_lookup(&shards[shard_of(block_id)].block_map, target_block->hash);
+        for (block_id_t candidate = *first; candidate != linked_list_end_index;
+                        candidate = get_block(candidate)->next_same_hash)
+            if (candidate != block_id && get_block(candidate)->size == target_block->size)
+                return true;
+
+        return false;
+    }
+
+    hash_t block_hash(block_id_t block_id) {
+        std::lock_guard<std::mutex> guard(shards[shard_of(block_id)].lock);
+        return get_block(block_id)->hash;
+    }
+
+    void acquire_block(block_id_t block_id, size_t references = 1) {
+        std::lock_guard<std::mutex> guard(shards[shard_of(block_id)].lock);
+        get_block(block_id)->references += references;
     }
 
+    // Drop references, block is freed when nobody uses it anymore
+    void release_block(block_id_t block_id, size_t references = 1) {
+        block_shard* shard = &shards[shard_of(block_id)];
+        std::lock_guard<std::mutex> guard(shard->lock);
+
+        block* target_block = get_block(block_id);
+
+        assert(target_block->references >= references);
+        if ((target_block->references -= references) != 0)
+            return;
+
+        unregister_block(shard, block_id);
+        slab_arena_discard(&shard->payloads, slot_of(block_id));
+
+        block_tier* tier = tier_of(shard, slot_of(block_id));
+        switch (tier->location) {
+        case BLOCK_IN_MEMORY:
+            __atomic_sub_fetch(&shard->resident_bytes, target_block->size, __ATOMIC_RELAXED);
+            break;
+
+        case BLOCK_COMPRESSED:
+            __atomic_sub_fetch(&shard->resident_bytes, tier->compressed_size, __ATOMIC_RELAXED);
+
+            -- shard->compressed_blocks;
+            shard->compressed_bytes -= tier->compressed_size;
+
+            free(tier->compressed), tier->compressed = NULL;
+            break;
+
+        case BLOCK_SPILLED:
+        case BLOCK_SPILLED_COMPRESSED:
+            -- shard->spilled_blocks;
+            slab_arena_discard(&shard->spill, slot_of(block_id));
+            break;
+        }
+
+        // Nobody could be reading it, so no moved_block can refer to it anymore
+        __atomic_store_n(&tier->location, BLOCK_IN_MEMORY, __ATOMIC_RELEASE);
+
+        TRY linked_list_delete(&shard->allocator, (element_index_t) slot_of(block_id))
+            THROW("Failed to free block %d!", block_id);
+    }
+
+    // Id of the block with the same contents, without referencing it, so
+    // it's only meaningful while nobody can release blocks concurrently
     block_id_t find_block(const char* data, size_t size) {
         hash_t block_hash;
-        murmur3_x64_128(data, size, HASH_SEED, &block_hash);
+        fingerprint_compute(&hasher, data, size, &block_hash);
+
+        block_shard* shard = &shards[shard_of(block_hash)];
+        std::lock_guard<std::mutex> guard(shard->lock);
+
+        return find_block(shard, block_hash, data, size);
+    }
 
+    // Shard should be locked
+    block_id_t find_block(block_shard* shard, hash_t block_hash, const char* data, size_t size) {
         element_index_t *found_block_index =
-            hash_table_lookup<hash_t, element_index_t>(&block_map, block_hash);
+            flat_hash_table_lookup(&shard->block_map, block_hash);
 
         if (!found_block_index)
             return linked_list_end_index;
 
-        return *found_block_index;
+        if (!verify)
+            return *found_block_index;
+
+        // Collisions are rare, so there's usually one candidate at most
+        for (block_id_t candidate = *found_block_index; candidate != linked_list_end_index;
+                        candidate = get_block(candidate)->next_same_hash) {
+
+            if (get_block(candidate)->size != size)
+                continue;
+
+            inflate_block(shard, candidate);
+            if (simd_memequal(block_data(candidate), data, size))
+                return candidate;
+        }
+
+        return linked_list_end_index;
+    }
+
+    // Remove block from block_map or from the chain of its hash, shard should be locked
+    void unregister_block(block_shard* shard, block_id_t block_id) {
+        block* target_block = get_block(block_id);
+
+        element_index_t* first =
+            flat_hash_table_lookup(&shard->block_map, target_block->hash);
+
+        if (*first == block_id) {
+            if (target_block->next_same_hash == linked_list_end_index)
+                flat_hash_table_delete(&shard->block_map, target_block->hash);
+            else
+                *first = target_block->next_same_hash;
+
+            return;
+        }
+
+        block_id_t previous = *first;
+        while (get_block(previous)->next_same_hash != block_id)
+            previous = get_block(previous)->next_same_hash;
+
+        get_block(previous)->next_same_hash = target_block->next_same_hash;
     }
 
+    // Block's shard should be locked, allocator can move its blocks otherwise
     block* get_block(block_id_t block_id) {
-        return &linked_list_get_pointer(&allocator, block_id)->element;
-        // TODO: unsafe
+        block_shard* shard = &shards[shard_of(block_id)];
+        return linked_list_get_pointer(&shard->allocator, (element_index_t) slot_of(block_id));
     }
-};
 
+    // Doesn't need a lock, as long as caller holds a reference to the block
+    // and made sure its payload is in place with load_block
+    char* block_data(block_id_t block_id) {
+        return slab_arena_get(payload_arena(block_id), slot_of(block_id));
+    }
 
-const size_t MAX_FILE_NAME = 128;
+    // Where payload of the block can be read from with a file descriptor,
+    // false if payloads aren't backed by a file. Same rules as block_data
+    bool block_location(block_id_t block_id, int* fd, off_t* offset) {
+        slab_arena* payloads = payload_arena(block_id);
+        if (payloads->fd == -1)
+            return false;
 
-struct file {
-    char name[MAX_FILE_NAME];
-    linked_list<block_id_t> block_chain;
+        *fd = payloads->fd;
+        *offset = slab_arena_offset(payloads, slot_of(block_id));
+        return true;
+    }
 
-    size_t size;
-};
+    // Arena that has the payload of a block that's in place
+    slab_arena* payload_arena(block_id_t block_id) {
+        block_shard* shard = &shards[shard_of(block_id)];
+        block_tier* tier = tier_of(shard, slot_of(block_id));
 
-void file_create(file* target_file) {
-    linked_list_create(&target_file->block_chain);
-}
+        // Slot in memory stays there for a while after payload was spilled
+        bool spilled = __atomic_load_n(&tier->location, __ATOMIC_ACQUIRE) == BLOCK_SPILLED;
+        return spilled ? &shard->spill : &shard->payloads;
+    }
 
+    static block_tier* tier_of(block_shard* shard, size_t slot) {
+        return (block_tier*) slab_arena_get(&shard->tiers, slot);
+    }
 
-struct file_storage {
-    block_storage blocks;
-    linked_list<file> files;
-};
+    // Tier stays in place while block is referenced
+    block_tier* tier_of(block_id_t block_id) {
+        return tier_of(&shards[shard_of(block_id)], slot_of(block_id));
+    }
 
-void file_storage_create(file_storage* storage) {
-    linked_list_create(&storage->files);
-}
+    // Should be called before payload of the block is read, marks block as
+    // recently read and decompresses its payload back to memory. Payload
+    // then stays in place until the file it's read from is unlocked
+    void load_block(block_id_t block_id) {
+        block_shard* shard = &shards[shard_of(block_id)];
+        block_tier* tier = tier_of(shard, slot_of(block_id));
+
+        // Hot blocks are read all the time, their line isn't dirtied by each read
+        const uint32_t epoch = __atomic_load_n(&tier_epoch, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&tier->last_read, __ATOMIC_RELAXED) != epoch)
+            __atomic_store_n(&tier->last_read, epoch, __ATOMIC_RELAXED);
+
+        payload_location location = __atomic_load_n(&tier->location, __ATOMIC_ACQUIRE);
+        if (location == BLOCK_IN_MEMORY || location == BLOCK_SPILLED)
+            return; // Can be read right where it is
+
+        std::lock_guard<std::mutex> guard(shard->lock);
+        inflate_block(shard, block_id);
+    }
+
+    // Decompresses payload back to its slot in memory, if it's compressed.
+    // Shard should be locked
+    void inflate_block(block_shard* shard, block_id_t block_id) {
+        const size_t slot = slot_of(block_id);
+        block_tier* tier = tier_of(shard, slot);
+
+        const payload_location location = tier->location;
+        if (location == BLOCK_IN_MEMORY || location == BLOCK_SPILLED)
+            return;
+
+        static thread_local std::vector<char> payload;
+        payload.resize(block_size);
 
-void dump_files(file_storage* storage) {
-    printf("================> FILE DUMP:\n");
+        const char* compressed = location == BLOCK_COMPRESSED
+            ? tier->compressed : slab_arena_get(&shard->spill, slot);
+
+        const size_t size = get_block(block_id)->size;
+        if (!lz_decompress(compressed, tier->compressed_size, payload.data(), size)) {
+            fprintf(stderr, "dedfs: compressed payload of block %d is corrupted!\n", block_id);
+            abort(); // Data is lost
+        }
+
+        if (!slab_arena_write(&shard->payloads, slot, payload.data(), size)) {
+            fprintf(stderr, "dedfs: out of memory for payload of block %d!\n", block_id);
+            abort();
+        }
 
-    LINKED_LIST_TRAVERSE(&storage->files, file, current) {
-        file *current_file = &current->element;
+        __atomic_add_fetch(&shard->resident_bytes, size, __ATOMIC_RELAXED);
 
-        printf("file: \"%s\" (%zu bytes) => ", current_file->name, current_file->size);
+        // Nobody reads compressed payloads without the lock, they can go right away
+        if (location == BLOCK_COMPRESSED) {
+            __atomic_sub_fetch(&shard->resident_bytes, tier->compressed_size, __ATOMIC_RELAXED);
 
-        LINKED_LIST_TRAVERSE(&current_file->block_chain, block_id_t, current) {
-            block* current_block = storage->blocks.get_block(current->element);
+            -- shard->compressed_blocks;
+            shard->compressed_bytes -= tier->compressed_size;
 
-            printf("{ %p %zu } ", current_block, current_block->size);
+            free(tier->compressed), tier->compressed = NULL;
+        } else {
+            -- shard->spilled_blocks;
+            slab_arena_discard(&shard->spill, slot);
         }
 
-        printf("\n");
+        __atomic_store_n(&tier->location, BLOCK_IN_MEMORY, __ATOMIC_RELEASE);
     }
 
-    printf("============================\n");
-}
+    // Starts a new compression or spill pass, blocks that were last read
+    // before the previous one are cold from now on, see is_cold
+    uint32_t start_tier_pass() {
+        return __atomic_fetch_add(&tier_epoch, 1, __ATOMIC_RELAXED);
+    }
+
+    // /previous/ is what start_tier_pass returned. Blocks that are added
+    // later get a newer epoch, so a block that has its slot by the time
+    // it's cold has been there all along
+    static bool is_cold(block_tier* tier, uint32_t previous) {
+        uint32_t last_read = __atomic_load_n(&tier->last_read, __ATOMIC_RELAXED);
+        return last_read != previous && last_read != previous + 1;
+    }
+
+    // Compresses payloads of blocks that weren't read since the previous pass
+    // (or were read only while it was going on). Their slots can't be given
+    // back yet: readers that saw them uncompressed can still be reading.
+    // Once all of them are done, /moved/ should be passed to discard_moved
+    void compress_cold_blocks(std::vector<moved_block>* moved) {
+        const uint32_t previous = start_tier_pass();
+
+        auto can_compress = [&](block_tier* tier) {
+            return tier->location == BLOCK_IN_MEMORY && is_cold(tier, previous);
+        };
+
+        std::vector<char> buffer(block_size);
+
+        for (size_t shard_index = 0; shard_index < BLOCK_STORAGE_SHARDS; ++ shard_index) {
+            block_shard* shard = &shards[shard_index];
 
+            std::vector<element_index_t> candidates;
+            {
+                std::lock_guard<std::mutex> guard(shard->lock);
 
-file* file_storage_find_file(file_storage* storage, const char* name) {
-    printf("  find file: %s\n", name);
+                LINKED_LIST_TRAVERSE(&shard->allocator, block, current_block) {
+                    element_index_t slot = linked_list_get_index(&shard->allocator, current_block);
+                    if (can_compress(tier_of(shard, slot)))
+                        candidates.push_back(slot);
+                }
+            }
 
-    LINKED_LIST_TRAVERSE(&storage->files, file, current) {
-        file* file_ptr = &current->element;
+            // Blocks are compressed one by one without the lock, so writers
+            // only ever wait for one block to be published
+            for (element_index_t slot: candidates) {
+                const block_id_t block_id = make_block_id(shard_index, slot);
 
-        if (strcmp(file_ptr->name, name) == 0)
-            return file_ptr;
+                size_t size;
+                {
+                    std::lock_guard<std::mutex> guard(shard->lock);
+                    if (is_free_element(&shard->allocator, slot) || !can_compress(tier_of(shard, slot)))
+                        continue; // Released (and maybe reused) in the meantime
+
+                    size = get_block(block_id)->size;
+                }
+
+                // Payload can be released while it's compressed, then result is dropped below
+                size_t compressed_size = lz_compress(slab_arena_get(&shard->payloads, slot), size, buffer.data(),
+                                                     size - size / BLOCK_COMPRESSION_MIN_SAVING);
+                if (compressed_size == 0)
+                    continue; // Not worth it
+
+                std::lock_guard<std::mutex> guard(shard->lock);
+
+                block_tier* tier = tier_of(shard, slot);
+                if (is_free_element(&shard->allocator, slot) || !can_compress(tier))
+                    continue;
+
+                tier->compressed_size = (uint32_t) compressed_size;
+
+                tier->compressed = (char*) malloc(compressed_size);
+                memcpy(tier->compressed, buffer.data(), compressed_size);
+
+                __atomic_store_n(&tier->location, BLOCK_COMPRESSED, __ATOMIC_RELEASE);
+
+                __atomic_add_fetch(&shard->resident_bytes, compressed_size, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&shard->resident_bytes, size, __ATOMIC_RELAXED);
+
+                ++ shard->compressed_blocks;
+                shard->compressed_bytes += compressed_size;
+
+                moved->push_back({ block_id, BLOCK_COMPRESSED });
+            }
+        }
     }
 
-    return nullptr;
-}
+    // Bytes of payloads that are kept in memory now
+    size_t resident_bytes() {
+        size_t bytes = 0;
+        for (block_shard& shard: shards)
+            bytes += __atomic_load_n(&shard.resident_bytes, __ATOMIC_RELAXED);
 
-file* file_storage_add_file(file_storage* storage, const char* name) {
-    file new_file {}; // TODO: improve, slow!
+        return bytes;
+    }
 
-    strncpy(new_file.name, name, MAX_FILE_NAME);
-    file_create(&new_file);
+    // Moves payloads out of memory to spill files, until they take at most
+    // /target/ bytes there. Cold blocks that are referenced once go first,
+    // then other cold blocks, then any. As with compress_cold_blocks, slots
+    // in memory are only given back by discard_moved. Returns number of spilled blocks
+    size_t spill_blocks(size_t target, std::vector<moved_block>* moved) {
+        const uint32_t previous = start_tier_pass();
+        size_t spilled = 0;
 
-    linked_list_push_front(&storage->files, new_file);
-    return &linked_list_head(&storage->files)->element;
-}
+        enum { COLD_UNIQUE, COLD, ANY, ROUNDS };
 
-void file_write(file_storage* storage, const char* data, size_t size, file* file) {
-    assert(file && storage);
+        auto can_spill = [&](block_tier* tier, block* target_block, int round) {
+            if (tier->location != BLOCK_IN_MEMORY && tier->location != BLOCK_COMPRESSED)
+                return false;
+
+            return round == ANY ||
+                (is_cold(tier, previous) && (round == COLD || target_block->references == 1));
+        };
+
+        for (int round = COLD_UNIQUE; round < ROUNDS; ++ round)
+            for (size_t shard_index = 0; shard_index < BLOCK_STORAGE_SHARDS; ++ shard_index) {
+                size_t resident = resident_bytes();
+                if (resident <= target)
+                    return spilled;
+
+                size_t excess = resident - target;
+                block_shard* shard = &shards[shard_index];
+
+                std::vector<element_index_t> candidates;
+                {
+                    std::lock_guard<std::mutex> guard(shard->lock);
+
+                    LINKED_LIST_TRAVERSE(&shard->allocator, block, current_block) {
+                        element_index_t slot = linked_list_get_index(&shard->allocator, current_block);
+                        if (can_spill(tier_of(shard, slot), current_block, round))
+                            candidates.push_back(slot);
+                    }
+                }
+
+                // Lock is taken for each block, so writers aren't stalled by
+                // whole shard. Slot may be reused meanwhile, but payload that's
+                // there is spilled all the same, so it's fine
+                for (element_index_t slot: candidates) {
+                    std::lock_guard<std::mutex> guard(shard->lock);
+
+                    block_tier* tier = tier_of(shard, slot);
+                    if (is_free_element(&shard->allocator, slot) ||
+                        (tier->location != BLOCK_IN_MEMORY && tier->location != BLOCK_COMPRESSED))
+                        continue;
+
+                    size_t freed = spill_block(shard, make_block_id(shard_index, slot), moved);
+                    if (freed == 0)
+                        return spilled; // Out of room for spill
+
+                    ++ spilled;
+                    if (freed >= excess)
+                        break;
+
+                    excess -= freed;
+                }
+            }
+
+        return spilled;
+    }
+
+    // Writes payload to its slot in spill file, returns bytes of memory it
+    // took, zero if spill file is out of space. Shard should be locked
+    size_t spill_block(block_shard* shard, block_id_t block_id, std::vector<moved_block>* moved) {
+        const size_t slot = slot_of(block_id);
+        block_tier* tier = tier_of(shard, slot);
+
+        TRY slab_arena_reserve(&shard->spill, slot)
+            THROW("Can't map spill file for block %d!", block_id);
+
+        const bool compressed = tier->location == BLOCK_COMPRESSED;
+
+        const size_t size = compressed ? tier->compressed_size : get_block(block_id)->size;
+        const char* payload = compressed
+            ? tier->compressed : slab_arena_get(&shard->payloads, slot);
+
+        if (!slab_arena_write(&shard->spill, slot, payload, size)) {
+            LOG_WARNING("spill file is out of space, payloads stay in memory");
+            return 0;
+        }
+
+        if (compressed) {
+            -- shard->compressed_blocks;
+            shard->compressed_bytes -= tier->compressed_size;
+
+            free(tier->compressed), tier->compressed = NULL;
+        }
 
-    file->size += size;
+        __atomic_store_n(&tier->location, compressed ? BLOCK_SPILLED_COMPRESSED : BLOCK_SPILLED,
+                         __ATOMIC_RELEASE);
 
-    size_t number_of_whole_blocks = size / BLOCK_SIZE;
-    for (int i = 0; i < number_of_whole_blocks; ++ i) {
-        block_id_t new_block = storage->blocks.get_block(data, BLOCK_SIZE);
-        linked_list_push_back(&file->block_chain, new_block);
+        __atomic_sub_fetch(&shard->resident_bytes, size, __ATOMIC_RELAXED);
+        ++ shard->spilled_blocks;
 
-        data += BLOCK_SIZE;
+        // Readers can only be using the slot in memory of an uncompressed block
+        if (!compressed)
+            moved->push_back({ block_id, BLOCK_SPILLED });
+
+        return size;
     }
 
-    size %= BLOCK_SIZE;
-    if (size != 0) { // TODO: write incomplete block
-        block_id_t new_block = storage->blocks.get_block(data, size);
-        linked_list_push_back(&file->block_chain, new_block);
+    // Gives slots in memory of moved blocks back to the system, unless
+    // those were read (and decompressed) or released since they moved
+    void discard_moved(const std::vector<moved_block>& moved) {
+        for (const moved_block& target: moved) {
+            block_shard* shard = &shards[shard_of(target.id)];
+            std::lock_guard<std::mutex> guard(shard->lock);
+
+            if (tier_of(shard, slot_of(target.id))->location == target.location)
+                slab_arena_discard(&shard->payloads, slot_of(target.id));
+        }
     }
-}
 
-static file_storage storage;
+    // Number of blocks that are compressed now and bytes they take, and number of spilled blocks
+    void tier_stats(size_t* compressed_blocks, size_t* compressed_bytes, size_t* spilled_blocks) {
+        *compressed_blocks = *compressed_bytes = *spilled_blocks = 0;
+
+        for (block_shard& shard: shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            *compressed_blocks += shard.compressed_blocks;
+            *compressed_bytes  += shard.compressed_bytes;
+            *spilled_blocks    += shard.spilled_blocks;
+        }
+    }
+};
 
-// static void read_and_shift(char** dest, const char* src, size_t offset, size_t size) {
-//     memcpy(*dest, src + offset, size);
-// }
 
+// Unallocated part of a sparse file, it reads as zeroes
+const block_id_t HOLE_BLOCK_ID = linked_list_end_index;
 
-static int do_read(const char *path, char *buffer, size_t size, off_t offset, fuse_file_info*) {
-    printf("do_read: %s, size: %zu\n", path, size);
+// Piece of file that's stored in a block, or isn't stored at all
+struct block_ref {
+    block_id_t id; // HOLE_BLOCK_ID for holes
+    size_t size;   // Same as block's size, holes can be of any size
+};
 
-    file* target_file = file_storage_find_file(&storage, path + 1);
-    // TODO:                                                  ^~~ generalize
-    if (!target_file)
-        return -1; // Not found!
+// Run of /count/ consecutive references to the same block, or a hole
+struct extent {
+    size_t offset; // Offset in file where extent starts
+    size_t size;   // Size of a single referenced block, or of the whole hole
 
-    // Calculate number of bytes we're going to read:
-    size_t gonna_read = std::min(size, target_file->size - offset);
+    block_id_t id; // HOLE_BLOCK_ID for holes
+    uint32_t count; // Always 1 for holes
+};
 
-    size = gonna_read;
-    printf("gonna read: %zu\n", size);
+inline size_t extent_end(const extent* target) {
+    return target->offset + target->size * target->count;
+}
 
-    linked_list<block_id_t> *blocks = &target_file->block_chain;
-    linked_list_linearize(blocks); // Prepare for continuous access
+// Extents of a file sorted by offset, they cover the file without gaps,
+// so block containing any offset is found with a binary search
+struct extent_map {
+    extent* extents;
+    size_t used, capacity;
+};
 
-    // ======> Get first block to read:
-    element_index_t first_block_to_read = offset / BLOCK_SIZE;
+void extent_map_create(extent_map* map) {
+    *map = { .extents = NULL, .used = 0, .capacity = 0 };
+}
 
-    element_index_t first_block_index;
-    TRY linked_list_get_logical_index(blocks, first_block_to_read, &first_block_index)
-        ASSERT_SUCCESS();
+void extent_map_destroy(extent_map* map) {
+    free(map->extents);
+    *map = {}; // Zero map out
+}
 
-    element<block_id_t>* current = linked_list_get_pointer(blocks, first_block_index);
-    printf("reading block: %d\n", current->element);
+// Index of extent that contains /offset/, /used/ if it's past the end
+size_t extent_map_find(extent_map* map, size_t offset) {
+    size_t low = 0, high = map->used;
 
-    // Keep track of read bytes:
-    size_t read_bytes = 0;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
 
-    // ======> Read first block's leftovers:
-    size_t offset_in_1st_block = offset % BLOCK_SIZE;
-    size_t bytes_read_1st_block = std::min(BLOCK_SIZE - offset_in_1st_block, size);
+        if (extent_end(&map->extents[middle]) <= offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
 
-    memcpy(buffer, storage.blocks.get_block(current->element)->data + offset_in_1st_block, bytes_read_1st_block);
-    buffer += bytes_read_1st_block; // TODO: extract
-    size   -= bytes_read_1st_block;
+    return low;
+}
 
-    printf("left after first block: %zu\n", size);
+// Replace extents [first, last) with /count/ extents from /replacement/
+stack_trace* extent_map_splice(extent_map* map, size_t first, size_t last,
+                               const extent* replacement, size_t count) {
 
-    // ======> Read completed blocks:
+    size_t new_used = map->used - (last - first) + count;
 
-    // Write full blocks:
-    size_t full_blocks_remaining = size / BLOCK_SIZE;
+    if (new_used > map->capacity) {
+        const double GROW = 2.0;
 
-    for (int i = 0; i < full_blocks_remaining; ++ i) {
-        current = linked_list_next(blocks, current);
+        size_t new_capacity = std::max(new_used, (size_t) ((double) map->capacity * GROW));
+        extent* new_extents = (extent*) realloc(map->extents, new_capacity * sizeof(*new_extents));
 
-        memcpy(buffer, storage.blocks.get_block(current->element)->data, BLOCK_SIZE);
-        buffer += BLOCK_SIZE;
+        if (new_extents == NULL)
+            return FAILURE(RUNTIME_ERROR, strerror(errno));
 
-        printf("%d block: %zu\n", i, size);
+        map->extents  = new_extents;
+        map->capacity = new_capacity;
     }
 
-    size %= BLOCK_SIZE; // Leftovers
+    memmove(map->extents + first + count, map->extents + last,
+            (map->used - last) * sizeof(*map->extents));
 
-    printf("last block: %zu\n", size);
+    if (count != 0)
+        memcpy(map->extents + first, replacement, count * sizeof(*replacement));
 
-    if (size != 0) {
-        // TODO: extract
-        current = linked_list_next(blocks, current);
-        memcpy(buffer, storage.blocks.get_block(current->element)->data, size);
+    map->used = new_used;
+    return SUCCESS();
+}
+
+// Try to append /next/ to the run in /target/, holes always merge
+bool extent_merge(extent* target, const extent* next) {
+    if (target->id != next->id)
+        return false;
+
+    if (target->id == HOLE_BLOCK_ID) {
+        target->size += next->size;
+        return true;
     }
 
-    return gonna_read;
+    if (target->size != next->size || target->count > UINT32_MAX - next->count)
+        return false;
+
+    target->count += next->count;
+    return true;
 }
 
-static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    printf("do_readdir: %s\n", path);
-    
-	filler(buffer,  ".", NULL, 0); // Current Directory
-	filler(buffer, "..", NULL, 0); // Parent Directory
-	
-    // If the user is trying to show the files/directories of the root directory show the following
-	if (strcmp(path, "/") == 0) {
-        LINKED_LIST_TRAVERSE(&storage.files, file, current_file) {
-            filler(buffer, current_file->element.name, NULL, 0);
-        }
-	}
-	
-    return 0;
+// Merges extent on /index/ into the previous one if they form a run
+void extent_map_merge_at(extent_map* map, size_t index) {
+    if (index == 0 || index >= map->used)
+        return;
+
+    if (extent_merge(&map->extents[index - 1], &map->extents[index]))
+        extent_map_splice(map, index, index + 1, NULL, 0);
 }
 
-static int do_getattr(const char *path, struct stat *st) {
-    printf("do_getattr: %s ", path);
+// Position of a single block reference inside of extent map
+struct extent_cursor {
+    size_t index;        // Extent's index, /used/ at the end of file
+    uint32_t repetition; // Which one of the extent's repeated blocks
+};
 
-	st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
-	st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted the filesystem
-	st->st_atime = time(NULL); // The last "a"ccess of the file/directory is right now
-	st->st_mtime = time(NULL); // The last "m"odification of the file/directory is right now
-	
-	if ( strcmp( path, "/" ) == 0 && path[1] == '\0' ) {
-		st->st_mode = S_IFDIR | 0755;
-		st->st_nlink = 2; // Why "two" hardlinks instead of "one"? The answer is here: http://unix.stackexchange.com/a/101536
-	} else if (file* my_file = file_storage_find_file(&storage, path + 1)) {
-		st->st_mode = S_IFREG | 0644;
-		st->st_nlink = 1;
-		st->st_size = my_file->size;
-	} else {
-        printf("(%d)\n", -ENOENT);
-        return -ENOENT;
+extent_cursor extent_map_find_block(extent_map* map, size_t offset, size_t* block_start) {
+    size_t index = extent_map_find(map, offset);
+    if (index == map->used) {
+        *block_start = map->used ? extent_end(&map->extents[map->used - 1]) : 0;
+        return { index, 0 };
     }
-	
-    printf("(0)\n");
-    return 0;
-}
 
-static int do_mknod(const char* path, mode_t mode, dev_t dev) {
-    printf("do_mknode: %s\n", path);
+    extent* found = &map->extents[index];
+    uint32_t repetition = (uint32_t) ((offset - found->offset) / found->size);
 
-    // TODO: path optimization
-    file_storage_add_file(&storage, path + 1);
-    return 0;
+    *block_start = found->offset + repetition * found->size;
+    return { index, repetition };
 }
 
-static int do_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("do_write: %s\n", path);
+block_ref extent_map_get(extent_map* map, extent_cursor cursor) {
+    extent* current = &map->extents[cursor.index];
+    return { current->id, current->size };
+}
 
-    file* target_file = file_storage_find_file(&storage, path + 1);
-    if (!target_file)
-        return -1;
+extent_cursor extent_map_next(extent_map* map, extent_cursor cursor) {
+    if (++ cursor.repetition == map->extents[cursor.index].count)
+        return { cursor.index + 1, 0 };
 
-    file_write(&storage, buffer, size, target_file);
+    return cursor;
+}
 
-    dump_files(&storage);
-    return size;
+
+typedef const char* path_t;
+
+static uint32_t path_hash(path_t path) {
+    uint32_t hash;
+    murmur3_x86_32(path, (int) strlen(path), HASH_SEED, &hash);
+    return hash;
 }
 
-static int do_mkdir( const char *path, mode_t mode ) {
-    printf("do_mkdir: %s\n", path);
-	return 0;
+static bool path_equal(path_t* first, path_t* second) {
+    return strcmp(*first, *second) == 0;
 }
 
 
-static const fuse_operations dedfs_operations = {
-    .getattr	= do_getattr,
-    .mknod		= do_mknod,
-    .mkdir		= do_mkdir,
-    .read		= do_read,
-    .write		= do_write,
-    .readdir	= do_readdir,
+// Children of a directory, indexed by name and listed in the order they were added
+struct directory {
+    // Keys point to children's own names, so they live exactly as long
+    flat_hash_table<path_t, element_index_t, path_hash, path_equal> index;
+
+    // Removed children leave linked_list_end_index behind, so positions of
+    // the others stay put and listing can be resumed from any of them
+    std::vector<element_index_t> entries;
+    size_t removed;
+
+    // Directory handles that are open now, holes aren't squeezed
+    // out of /entries/ while any listing could be using positions
+    size_t listings; // Changed atomically
+
+    size_t subdirectories; // Every one of them links back with ".."
 };
 
+// Listing offset of child at position 0 in directory::entries, "." and ".." come before
+const uint64_t DIRECTORY_FIRST_COOKIE = 3;
 
-void block_tests() {
-    char block[BLOCK_SIZE];
+struct file {
+    char* name; // Owned by file, shared with parent's directory::index
 
-    block_storage blocks;
-    printf("%d\n", blocks.get_block(block, BLOCK_SIZE));
-    printf("%d\n", blocks.get_block(block, BLOCK_SIZE));
-    block[10] = 1;
-    printf("%d\n", blocks.get_block(block, BLOCK_SIZE));
-    printf("%d\n", blocks.get_block(block, BLOCK_SIZE));
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+
+    // Last access, change of contents and change of contents or attributes
+    timespec atime, mtime, ctime;
+
+    element_index_t parent; // Root is its own parent
+    size_t position; // In parent's directory::entries
+
+    directory* children; // NULL unless file is a directory
+
+    extent_map extents;
+
+    size_t size;
+
+    // Lookups of file's inode that kernel didn't forget yet, unlinked
+    // file is only deleted once there are none. Changed atomically
+    uint64_t lookups;
+    bool unlinked; // Has no name anymore, /name/ is NULL
+};
 
-    char other[BLOCK_SIZE];
-    printf("%d\n", blocks.get_block(other, BLOCK_SIZE));
-    printf("%d\n", blocks.get_block(other, BLOCK_SIZE));
+// Which of file's times should file_touch() set
+enum file_time {
+    FILE_ATIME = 1 << 0,
+    FILE_MTIME = 1 << 1,
+    FILE_CTIME = 1 << 2
+};
+
+// Sets /times/ (combination of file_time) of file to current time
+void file_touch(file* target_file, int times) {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    printf("%d\n", blocks.get_block(block, BLOCK_SIZE));
+    if (times & FILE_ATIME) target_file->atime = now;
+    if (times & FILE_MTIME) target_file->mtime = now;
+    if (times & FILE_CTIME) target_file->ctime = now;
 }
 
-int main(int argc, char* argv[]) {
-    file_storage_create(&storage);
+void file_create(file* target_file, const char* name, mode_t mode, uid_t uid, gid_t gid) {
+    target_file->name = strdup(name);
+
+    target_file->mode = mode;
+    target_file->uid = uid;
+    target_file->gid = gid;
+
+    file_touch(target_file, FILE_ATIME | FILE_MTIME | FILE_CTIME);
+
+    target_file->parent = linked_list_end_index;
+    target_file->position = 0;
+
+    target_file->children = NULL;
+    if (S_ISDIR(mode)) {
+        target_file->children = new directory {};
+        flat_hash_table_create(&target_file->children->index);
+    }
+
+    extent_map_create(&target_file->extents);
+    target_file->size = 0;
+
+    target_file->lookups = 0;
+    target_file->unlinked = false;
+}
+
+void file_destroy(file* target_file) {
+    extent_map_destroy(&target_file->extents);
+
+    if (target_file->children) {
+        flat_hash_table_destroy(&target_file->children->index);
+        delete target_file->children, target_file->children = NULL;
+    }
+
+    free(target_file->name), target_file->name = NULL;
+}
+
+
+enum chunking_mode {
+    CHUNKING_FIXED, // Every block except the last one is exactly block_size
+    CHUNKING_CDC    // Blocks are cut on content defined boundaries
+};
+
+// Index of the root directory in file_storage::files, it's added first
+const element_index_t ROOT_FILE_INDEX = 1;
+
+struct file_storage {
+    block_storage blocks;
+    linked_list<file> files; // Both regular files and directories
+
+    // Lock of each file, in the slot with the same index as file. Shared by
+    // readers, exclusive for writers. Kept apart from /files/, which moves
+    // when it grows, because a lock can't be moved (even an unlocked one)
+    slab_arena file_locks;
+
+    // Files are looked up and used under shared lock, exclusive one is only
+    // taken to add or delete a file, so no file is used while that happens
+    pthread_rwlock_t files_lock;
+
+    // Compression and spill passes are run one at a time
+    pthread_mutex_t tier_lock;
+
+    chunking_mode chunking;
+    cdc_chunker chunker; // Only used with CHUNKING_CDC
+
+    // Every change of files is recorded here before it's acknowledged,
+    // NULL if changes only survive in images (see -o wal)
+    wal* log;
+};
+
+// Index of a file fits in element_index_t
+const size_t MAX_FILES = INT32_MAX;
+
+pthread_rwlock_t* file_storage_file_lock(file_storage* storage, element_index_t index) {
+    return (pthread_rwlock_t*) slab_arena_get(&storage->file_locks, (size_t) index);
+}
+
+// Adds /new_file/ to /files/ (not to any directory) along with its lock
+static stack_trace* file_storage_push_file(file_storage* storage, const file& new_file,
+                                           element_index_t* index) {
+    TRY linked_list_push_front(&storage->files, new_file, index)
+        FAIL("Can't allocate file!");
+
+    TRY slab_arena_reserve(&storage->file_locks, (size_t) *index)
+        FAIL("Can't allocate lock of file %d!", *index);
+
+    pthread_rwlock_init(file_storage_file_lock(storage, *index), NULL);
+    return SUCCESS();
+}
+
+// Uses content defined chunking if /chunker/ is given, blocks are then
+// as big as the biggest chunk and /block_size/ is ignored
+void file_storage_create(file_storage* storage, size_t block_size = DEFAULT_BLOCK_SIZE,
+                         const cdc_chunker* chunker = NULL) {
+    storage->chunking = chunker ? CHUNKING_CDC : CHUNKING_FIXED;
+    storage->log = NULL;
+    if (chunker) {
+        storage->chunker = *chunker;
+        block_size = chunker->max_size;
+    }
+
+    TRY storage->blocks.set_block_size(block_size)
+        THROW("Can't use blocks of size %zu!", block_size);
+
+    linked_list_create(&storage->files);
+
+    TRY slab_arena_create(&storage->file_locks, sizeof(pthread_rwlock_t), MAX_FILES + 1)
+        THROW("Can't create arena for file locks!");
+
+    file root {};
+    file_create(&root, "", S_IFDIR | 0755, getuid(), getgid()); // Owned by whoever mounted it
+
+    element_index_t root_index;
+    TRY file_storage_push_file(storage, root, &root_index)
+        THROW("Failed to allocate root directory!");
+
+    assert(root_index == ROOT_FILE_INDEX);
+    linked_list_get_pointer(&storage->files, root_index)->parent = root_index;
+
+    // Otherwise steady stream of reads would never let a file be created
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    pthread_rwlock_init(&storage->files_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    pthread_mutex_init(&storage->tier_lock, NULL);
+}
+
+// Length of the next block that should be cut from the start of /data/
+size_t file_storage_next_chunk(file_storage* storage, const char* data, size_t size) {
+    if (storage->chunking == CHUNKING_CDC)
+        return cdc_next_chunk(&storage->chunker, data, size);
+
+    return std::min(size, storage->blocks.block_size);
+}
+
+// Kinds of records in file_storage::log, every record starts with its kind.
+// Files are referred to by their index in file_storage::files at the time
+enum log_record_kind : uint8_t {
+    LOG_ADD_FILE,    // log_add_file, then the name
+    LOG_UNLINK_FILE, // log_file
+    LOG_TRUNCATE,    // log_truncate
+    LOG_WRITE        // log_write, then a log_extent for every extent, see log_block
+};
+
+struct log_file {
+    log_record_kind kind;
+    element_index_t index;
+};
+
+struct log_add_file {
+    log_record_kind kind;
+    element_index_t index, parent;
+    uint32_t mode, uid, gid;
+};
+
+struct log_truncate {
+    log_record_kind kind;
+    element_index_t index;
+    uint64_t size;
+};
+
+// Write of [offset, end) replaced blocks of [replaced_start, replaced_end) with new extents
+struct log_write {
+    log_record_kind kind;
+    element_index_t index;
+
+    uint64_t offset, end;
+    uint64_t replaced_start, replaced_end;
+
+    uint32_t extent_count;
+};
+
+// What follows log_extent in a record
+enum log_block : uint8_t {
+    LOG_HOLE,        // Nothing
+    LOG_KNOWN_BLOCK, // Hash of block, its payload is in the image or earlier in the log
+    LOG_NEW_BLOCK    // Hash of block and its payload
+};
+
+struct log_extent {
+    uint64_t offset, size;
+    uint32_t count;
+    log_block block;
+};
+
+template <typename T>
+static char* log_put(char* out, const T& value) {
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+static void file_storage_log_add_file(file_storage* storage, element_index_t index, element_index_t parent,
+                                      const char* name, mode_t mode, uid_t uid, gid_t gid) {
+    const size_t name_size = strlen(name);
+    char* record = wal_reserve(storage->log, sizeof(log_add_file) + name_size);
+
+    char* out = log_put(record, log_add_file { LOG_ADD_FILE, index, parent, mode, uid, gid });
+    memcpy(out, name, name_size);
+
+    wal_commit(storage->log, sizeof(log_add_file) + name_size);
+}
+
+static void file_storage_log_unlink_file(file_storage* storage, element_index_t index) {
+    char* record = wal_reserve(storage->log, sizeof(log_file));
+    log_put(record, log_file { LOG_UNLINK_FILE, index });
+
+    wal_commit(storage->log, sizeof(log_file));
+}
+
+static void file_storage_log_truncate(file_storage* storage, element_index_t index, size_t size) {
+    char* record = wal_reserve(storage->log, sizeof(log_truncate));
+    log_put(record, log_truncate { LOG_TRUNCATE, index, size });
+
+    wal_commit(storage->log, sizeof(log_truncate));
+}
+
+// Payload of a block goes to the log with the first record that refers to
+// it, later ones only have its hash. Which record is first is decided with
+// the log locked, so it's always appended before the others. Everything else
+// is gathered before, log is only locked while the record is filled in
+static void file_storage_log_write(file_storage* storage, element_index_t index, size_t offset, size_t end,
+                                   size_t replaced_start, size_t replaced_end, const std::vector<extent>& added) {
+    std::vector<hash_t> hashes(added.size());
+    std::vector<const char*> payloads(added.size(), NULL);
+
+    size_t max_size = sizeof(log_write) + added.size() * (sizeof(log_extent) + sizeof(hash_t));
+
+    for (size_t i = 0; i < added.size(); ++ i) {
+        const extent& current = added[i];
+        if (current.id == HOLE_BLOCK_ID)
+            continue;
+
+        hashes[i] = storage->blocks.block_hash(current.id);
+
+        // Block stays logged while file refers to it, so payloads of logged ones
+        // aren't needed. In verify mode it depends on the blocks there are by then
+        block_tier* tier = storage->blocks.tier_of(current.id);
+        if (storage->blocks.verify || !__atomic_load_n(&tier->logged, __ATOMIC_ACQUIRE)) {
+            storage->blocks.load_block(current.id);
+            payloads[i] = storage->blocks.block_data(current.id);
+            max_size += current.size;
+        }
+    }
+
+    char* record = wal_reserve(storage->log, max_size);
+    char* out = log_put(record, log_write { LOG_WRITE, index, offset, end, replaced_start, replaced_end,
+                                            (uint32_t) added.size() });
+
+    for (size_t i = 0; i < added.size(); ++ i) {
+        const extent& current = added[i];
+        if (current.id == HOLE_BLOCK_ID) {
+            out = log_put(out, log_extent { current.offset, current.size, current.count, LOG_HOLE });
+            continue;
+        }
+
+        // With verify mode blocks of the same hash and size can differ, then
+        // hash alone could pick a wrong one and contents are sent again
+        block_tier* tier = storage->blocks.tier_of(current.id);
+        const bool is_new = !tier->logged || (storage->blocks.verify && storage->blocks.has_twin(current.id));
+        __atomic_store_n(&tier->logged, true, __ATOMIC_RELEASE);
+
+        out = log_put(out, log_extent { current.offset, current.size, current.count,
+                                        is_new ? LOG_NEW_BLOCK : LOG_KNOWN_BLOCK });
+        out = log_put(out, hashes[i]);
+
+        if (is_new) {
+            assert(payloads[i] != NULL);
+            memcpy(out, payloads[i], current.size);
+            out += current.size;
+        }
+    }
+
+    wal_commit(storage->log, (size_t) (out - record));
+}
+
+
+// Index of the file named /name/ in /parent/ directory,
+// linked_list_end_index if there's no such file
+element_index_t file_storage_find_file(file_storage* storage, element_index_t parent, const char* name) {
+    directory* children = linked_list_get_pointer(&storage->files, parent)->children;
+
+    element_index_t* file_index =
+        flat_hash_table_lookup(&children->index, name);
+
+    return file_index ? *file_index : linked_list_end_index;
+}
+
+// Index in /files/ of a file that's there
+element_index_t file_storage_index_of(file_storage* storage, file* target_file) {
+    return linked_list_get_index(&storage->files, target_file);
+}
+
+// File at /index/ in /files/, NULL if it's not a valid index of a file
+file* file_storage_get_file(file_storage* storage, element_index_t index) {
+    if (index <= linked_list_end_index || (size_t) index > storage->files.capacity + 1 ||
+        is_free_element(&storage->files, index))
+        return nullptr;
+
+    return linked_list_get_pointer(&storage->files, index);
+}
+
+// Locks file table for sharing and the file itself for sharing or exclusively,
+// returns NULL (and leaves nothing locked) if there's no such file
+file* file_storage_lock_file(file_storage* storage, element_index_t index, bool exclusive) {
+    pthread_rwlock_rdlock(&storage->files_lock);
+
+    file* target_file = file_storage_get_file(storage, index);
+    if (!target_file) {
+        pthread_rwlock_unlock(&storage->files_lock);
+        return nullptr;
+    }
+
+    if (exclusive)
+        pthread_rwlock_wrlock(file_storage_file_lock(storage, index));
+    else
+        pthread_rwlock_rdlock(file_storage_file_lock(storage, index));
+
+    return target_file;
+}
+
+void file_storage_unlock_file(file_storage* storage, file* target_file) {
+    pthread_rwlock_unlock(file_storage_file_lock(storage, file_storage_index_of(storage, target_file)));
+    pthread_rwlock_unlock(&storage->files_lock);
+}
+
+// Adds a regular file or a directory (depending on /mode/) to /parent/
+// directory, there shouldn't be a file with the same name there yet
+element_index_t file_storage_add_file(file_storage* storage, element_index_t parent,
+                                      const char* name, mode_t mode, uid_t uid, gid_t gid) {
+    file new_file {};
+    file_create(&new_file, name, mode, uid, gid);
+
+    element_index_t file_index;
+    TRY file_storage_push_file(storage, new_file, &file_index)
+        THROW("Failed to allocate file \"%s\"!", name);
+
+    // List could have moved
+    file* added_file = linked_list_get_pointer(&storage->files, file_index);
+    file* parent_file = linked_list_get_pointer(&storage->files, parent);
+    directory* children = parent_file->children;
+
+    added_file->parent = parent;
+    added_file->position = children->entries.size();
+    children->entries.push_back(file_index);
+
+    if (added_file->children)
+        ++ children->subdirectories;
+
+    flat_hash_table_insert(&children->index, added_file->name, file_index);
+
+    file_touch(parent_file, FILE_MTIME | FILE_CTIME);
+
+    if (storage->log)
+        file_storage_log_add_file(storage, file_index, parent, name, mode, uid, gid);
+
+    return file_index;
+}
+
+void file_storage_release_extents(file_storage* storage, const extent* extents, size_t count) {
+    for (size_t i = 0; i < count; ++ i)
+        if (extents[i].id != HOLE_BLOCK_ID)
+            storage->blocks.release_block(extents[i].id, extents[i].count);
+}
+
+void file_storage_release_blocks(file_storage* storage, file* target_file) {
+    file_storage_release_extents(storage, target_file->extents.extents,
+                                 target_file->extents.used);
+}
+
+static void file_storage_delete_file(file_storage* storage, element_index_t file_index) {
+    file* target_file = linked_list_get_pointer(&storage->files, file_index);
+
+    file_storage_release_blocks(storage, target_file);
+    file_destroy(target_file);
+
+    pthread_rwlock_destroy(file_storage_file_lock(storage, file_index));
+
+    TRY linked_list_delete(&storage->files, file_index)
+        THROW("Failed to free file %d!", file_index);
+}
+
+// Takes file's name away, file itself is deleted right away unless kernel
+// still knows its inode. Directory should be empty by then. Should be
+// called under exclusive /files_lock/
+void file_storage_unlink_file(file_storage* storage, element_index_t file_index) {
+    file* target_file = file_storage_get_file(storage, file_index);
+
+    if (storage->log)
+        file_storage_log_unlink_file(storage, file_index);
+
+    file* parent_file = file_storage_get_file(storage, target_file->parent);
+    directory* siblings = parent_file->children;
+
+    // Unregister first, key is owned by file and dies with it
+    flat_hash_table_delete(&siblings->index, target_file->name);
+
+    siblings->entries[target_file->position] = linked_list_end_index;
+    ++ siblings->removed;
+
+    // Squeezing holes out moves the others, so it can only
+    // be done when there's no listing that could notice
+    if (siblings->removed > siblings->entries.size() / 2 &&
+        __atomic_load_n(&siblings->listings, __ATOMIC_ACQUIRE) == 0) {
+
+        size_t used = 0;
+        for (element_index_t child: siblings->entries)
+            if (child != linked_list_end_index) {
+                file_storage_get_file(storage, child)->position = used;
+                siblings->entries[used ++] = child;
+            }
+
+        siblings->entries.resize(used);
+        siblings->removed = 0;
+    }
+
+    if (target_file->children)
+        -- siblings->subdirectories;
+
+    file_touch(parent_file, FILE_MTIME | FILE_CTIME);
+
+    free(target_file->name), target_file->name = NULL;
+    target_file->unlinked = true;
+    file_touch(target_file, FILE_CTIME); // Link count changed
+
+    if (__atomic_load_n(&target_file->lookups, __ATOMIC_ACQUIRE) == 0)
+        file_storage_delete_file(storage, file_index);
+}
+
+void file_storage_remember_file(file* target_file) {
+    __atomic_add_fetch(&target_file->lookups, 1, __ATOMIC_RELAXED);
+}
+
+// Drops /lookups/ that kernel had on the file, deletes it if it was
+// unlinked and these were the last ones. Takes /files_lock/ itself
+void file_storage_forget_file(file_storage* storage, element_index_t file_index, uint64_t lookups) {
+    pthread_rwlock_rdlock(&storage->files_lock);
+
+    file* target_file = file_storage_get_file(storage, file_index);
+
+    // Unlink needs exclusive lock, so it can't happen between these two
+    bool is_last = target_file &&
+        __atomic_sub_fetch(&target_file->lookups, lookups, __ATOMIC_ACQ_REL) == 0 &&
+        target_file->unlinked;
+
+    pthread_rwlock_unlock(&storage->files_lock);
+
+    // Nobody else can reach unlinked file that's not looked up
+    if (is_last) {
+        pthread_rwlock_wrlock(&storage->files_lock);
+        file_storage_delete_file(storage, file_index);
+        pthread_rwlock_unlock(&storage->files_lock);
+    }
+}
+
+// Gives slots that payloads of /moved/ blocks left back to the system
+static void file_storage_discard_moved(file_storage* storage, const std::vector<moved_block>& moved) {
+    // Every read of payloads happens under /files_lock/, so once it can be
+    // taken exclusively nobody is reading slots they left anymore
+    pthread_rwlock_wrlock(&storage->files_lock);
+    pthread_rwlock_unlock(&storage->files_lock);
+
+    storage->blocks.discard_moved(moved);
+}
+
+static void file_storage_log_tiers(file_storage* storage) {
+    size_t compressed_blocks, compressed_bytes, spilled_blocks;
+    storage->blocks.tier_stats(&compressed_blocks, &compressed_bytes, &spilled_blocks);
+
+    LOG_DEBUG("payloads take %zu bytes of memory, %zu blocks take %zu bytes compressed, "
+              "%zu blocks are spilled", storage->blocks.resident_bytes(),
+              compressed_blocks, compressed_bytes, spilled_blocks);
+}
+
+// Compresses payloads that weren't read for a while, see block_storage::compress_cold_blocks.
+// Shouldn't be called with /files_lock/ held
+void file_storage_compress_cold_blocks(file_storage* storage) {
+    pthread_mutex_lock(&storage->tier_lock);
+
+    std::vector<moved_block> moved;
+    storage->blocks.compress_cold_blocks(&moved);
+    file_storage_discard_moved(storage, moved);
+
+    pthread_mutex_unlock(&storage->tier_lock);
+
+    LOG_DEBUG("compressed %zu cold blocks", moved.size());
+    file_storage_log_tiers(storage);
+}
+
+// Spill passes bring payloads this much below block_storage::max_mem, so
+// that a steady stream of writes doesn't start one for each new block
+const size_t BLOCK_SPILL_SLACK = 8; // As a part of max_mem
+
+// Spills payloads if they take more memory than block_storage::max_mem.
+// Writer that gets over the budget waits for the spill, so no writer can
+// outrun it. Shouldn't be called with /files_lock/ held
+void file_storage_enforce_budget(file_storage* storage) {
+    const size_t max_mem = storage->blocks.max_mem;
+    if (max_mem == 0 || storage->blocks.resident_bytes() <= max_mem)
+        return;
+
+    pthread_mutex_lock(&storage->tier_lock);
+
+    // Another writer could have spilled enough while this one waited
+    size_t spilled = 0;
+    if (storage->blocks.resident_bytes() > max_mem) {
+        std::vector<moved_block> moved;
+        spilled = storage->blocks.spill_blocks(max_mem - max_mem / BLOCK_SPILL_SLACK, &moved);
+        file_storage_discard_moved(storage, moved);
+    }
+
+    pthread_mutex_unlock(&storage->tier_lock);
+
+    if (spilled != 0) {
+        LOG_DEBUG("spilled %zu blocks to stay within %zu bytes", spilled, max_mem);
+        file_storage_log_tiers(storage);
+    }
+}
+
+// Image of file_storage that it's restored from after a restart. Tables of
+// blocks (arrays of allocator and block_map of every shard) are stored exactly
+// as they are laid out in memory, so they are copied back as they are and nothing is
+// fingerprinted or inserted again. Sections start on page boundaries, payload
+// in slot /s/ of a shard is at image_shard::payloads_offset + s * block_size,
+// slots of free blocks are left as holes
+const char IMAGE_MAGIC[8] = { 'D', 'E', 'D', 'F', 'S', 'I', 'M', 'G' };
+const uint32_t IMAGE_VERSION = 3;
+
+const size_t IMAGE_ALIGNMENT = 4096;
+
+struct image_shard {
+    // Arrays of allocator, up to its first element that was never used
+    uint64_t links_offset, free_bits_offset, blocks_offset;
+    uint64_t allocator_capacity, allocator_used;
+    int32_t allocator_free, allocator_unused;
+    uint64_t allocator_linearized;
+
+    uint64_t map_offset; // Control bytes of block_map, then its pairs
+    uint64_t map_capacity, map_used, map_tombstones;
+
+    uint64_t payloads_offset;
+};
+
+// Parent of a file that was unlinked while it was still open, blocks it
+// referenced are released as soon as image is restored
+const uint64_t IMAGE_NO_PARENT = UINT64_MAX;
+
+struct image_file {
+    uint64_t parent; // Number of parent's record, it comes earlier. Root is the first one
+    uint64_t index;  // In file_storage::files when image was saved, write-ahead log refers to it
+
+    uint32_t mode, uid, gid;
+    timespec atime, mtime, ctime;
+
+    uint64_t size;
+
+    uint64_t name_offset; // In names section, NUL terminated
+    uint64_t first_extent, extent_count;
+};
+
+struct image_header {
+    char magic[sizeof(IMAGE_MAGIC)];
+    uint32_t version;
+
+    // Records are copied as they are, so only builds that lay
+    // them out the same way can read the image back
+    uint32_t block_record_size, link_record_size, map_pair_size, extent_size, file_record_size;
+
+    uint64_t block_size;
+    uint32_t chunking, fingerprint;
+    uint64_t cdc_min, cdc_avg, cdc_max;
+
+    uint64_t files_offset, file_count;
+    uint64_t names_offset, names_size;
+    uint64_t extents_offset, extent_count;
+
+    uint64_t log_sequence; // Last record of write-ahead log that image has
+
+    image_shard shards[BLOCK_STORAGE_SHARDS];
+};
+
+// What write-ahead log needs to be replayed on top of a restored image
+struct image_restore {
+    // Index that file had when image was saved => index it has now
+    std::unordered_map<element_index_t, element_index_t> files;
+    uint64_t log_sequence;
+};
+
+typedef hash_table_pair<hash_t, element_index_t> image_map_pair;
+
+static uint64_t image_align(uint64_t offset) {
+    return (offset + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+}
+
+static stack_trace* image_write(int fd, const void* data, size_t size, uint64_t offset) {
+    for (size_t written = 0; written < size; ) {
+        ssize_t result = pwrite(fd, (const char*) data + written, size - written,
+                                (off_t) (offset + written));
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result < 0)
+            return FAILURE(RUNTIME_ERROR, "Can't write image: %s", strerror(errno));
+
+        written += (size_t) result;
+    }
+
+    return SUCCESS();
+}
+
+// Writes tables and payloads of /shard/ from /*end/ on, and moves /*end/ past them.
+// Nothing in shard should change meanwhile
+static stack_trace* image_save_shard(block_storage* blocks, block_shard* shard, int fd,
+                                     image_shard* record, uint64_t* end) {
+    linked_list<block>* allocator = &shard->allocator;
+    auto* map = &shard->block_map;
+
+    // Pairs that are still in the previous table would be lost
+    __flat_hash_table_migrate(map, SIZE_MAX);
+
+    const size_t entries = allocator->unused;
+    const size_t free_bits_size = linked_list_bitmap_words(entries) * sizeof(*allocator->free_bits);
+    const size_t control_size = map->capacity * sizeof(*map->control);
+
+    *record = {
+        .links_offset = image_align(*end), .free_bits_offset = 0, .blocks_offset = 0,
+        .allocator_capacity = allocator->capacity, .allocator_used = allocator->used,
+        .allocator_free = allocator->free, .allocator_unused = allocator->unused,
+        .allocator_linearized = allocator->is_linearized,
+
+        .map_offset = 0,
+        .map_capacity = map->capacity, .map_used = map->used, .map_tombstones = map->tombstones,
+
+        .payloads_offset = 0
+    };
+
+    record->free_bits_offset = image_align(record->links_offset + entries * sizeof(*allocator->links));
+    record->blocks_offset = image_align(record->free_bits_offset + free_bits_size);
+    record->map_offset = image_align(record->blocks_offset + entries * sizeof(*allocator->elements));
+    record->payloads_offset = image_align(record->map_offset + control_size +
+                                          map->capacity * sizeof(*map->slots));
+
+    TRY image_write(fd, allocator->links, entries * sizeof(*allocator->links), record->links_offset)
+        FAIL("Can't write links of blocks!");
+
+    TRY image_write(fd, allocator->free_bits, free_bits_size, record->free_bits_offset)
+        FAIL("Can't write free flags of blocks!");
+
+    TRY image_write(fd, allocator->elements, entries * sizeof(*allocator->elements), record->blocks_offset)
+        FAIL("Can't write blocks!");
+
+    TRY image_write(fd, map->control, control_size, record->map_offset)
+        FAIL("Can't write block map!");
+
+    TRY image_write(fd, map->slots, map->capacity * sizeof(*map->slots), record->map_offset + control_size)
+        FAIL("Can't write block map!");
+
+    const size_t block_size = blocks->block_size;
+    std::vector<char> buffer(block_size);
+
+    // Payloads that are read in place are written in runs, slots
+    // that follow each other in a slab are next to each other
+    const char* run = NULL;
+    size_t run_slot = 0, run_size = 0;
+
+    for (size_t slot = 1; slot < (size_t) allocator->unused; ++ slot) {
+        if (is_free_element(allocator, (element_index_t) slot))
+            continue;
+
+        block_tier* tier = block_storage::tier_of(shard, slot);
+        const size_t size = linked_list_get_pointer(allocator, (element_index_t) slot)->size;
+
+        const char* payload = NULL;
+        switch (tier->location) {
+        case BLOCK_IN_MEMORY: payload = slab_arena_get(&shard->payloads, slot); break;
+        case BLOCK_SPILLED:   payload = slab_arena_get(&shard->spill,    slot); break;
+
+        case BLOCK_COMPRESSED:
+        case BLOCK_SPILLED_COMPRESSED: {
+            const char* compressed = tier->location == BLOCK_COMPRESSED
+                ? tier->compressed : slab_arena_get(&shard->spill, slot);
+
+            if (!lz_decompress(compressed, tier->compressed_size, buffer.data(), size))
+                return FAILURE(RUNTIME_ERROR, "Compressed payload in slot %zu is corrupted!", slot);
+        } break;
+        }
+
+        if (run && payload == run + run_size && slot == run_slot + run_size / block_size) {
+            run_size += block_size;
+            continue;
+        }
+
+        if (run)
+            TRY image_write(fd, run, run_size, record->payloads_offset + run_slot * block_size)
+                FAIL("Can't write payloads!");
+
+        run = payload;
+        run_slot = slot, run_size = block_size;
+
+        if (!payload)
+            TRY image_write(fd, buffer.data(), size, record->payloads_offset + slot * block_size)
+                FAIL("Can't write payload!");
+    }
+
+    if (run)
+        TRY image_write(fd, run, run_size, record->payloads_offset + run_slot * block_size)
+            FAIL("Can't write payloads!");
+
+    *end = record->payloads_offset + (allocator->capacity + 2) * block_size;
+    return SUCCESS();
+}
+
+// Writes every file with a name, parents before their children, then the
+// ones that were unlinked but are still open. Files shouldn't change meanwhile
+static stack_trace* image_save_files(file_storage* storage, int fd, image_header* header, uint64_t* end) {
+    std::vector<element_index_t> order { ROOT_FILE_INDEX };
+    std::vector<uint64_t> parents { 0 };
+
+    for (size_t i = 0; i < order.size(); ++ i)
+        if (directory* children = file_storage_get_file(storage, order[i])->children)
+            for (element_index_t child: children->entries)
+                if (child != linked_list_end_index) {
+                    order.push_back(child);
+                    parents.push_back(i);
+                }
+
+    LINKED_LIST_TRAVERSE(&storage->files, file, current)
+        if (current->unlinked) {
+            order.push_back(linked_list_get_index(&storage->files, current));
+            parents.push_back(IMAGE_NO_PARENT);
+        }
+
+    std::vector<image_file> records;
+    std::vector<char> names;
+    std::vector<extent> extents;
+
+    for (size_t i = 0; i < order.size(); ++ i) {
+        file* target_file = file_storage_get_file(storage, order[i]);
+        const char* name = target_file->name ? target_file->name : "";
+
+        records.push_back({
+            .parent = parents[i], .index = (uint64_t) order[i],
+            .mode = target_file->mode, .uid = target_file->uid, .gid = target_file->gid,
+            .atime = target_file->atime, .mtime = target_file->mtime, .ctime = target_file->ctime,
+            .size = target_file->size,
+            .name_offset = names.size(),
+            .first_extent = extents.size(), .extent_count = target_file->extents.used
+        });
+
+        names.insert(names.end(), name, name + strlen(name) + 1);
+        extents.insert(extents.end(), target_file->extents.extents,
+                       target_file->extents.extents + target_file->extents.used);
+    }
+
+    header->files_offset = image_align(*end);
+    header->file_count = records.size();
+
+    header->names_offset = header->files_offset + records.size() * sizeof(image_file);
+    header->names_size = names.size();
+
+    header->extents_offset = image_align(header->names_offset + names.size());
+    header->extent_count = extents.size();
+
+    TRY image_write(fd, records.data(), records.size() * sizeof(image_file), header->files_offset)
+        FAIL("Can't write files!");
+
+    TRY image_write(fd, names.data(), names.size(), header->names_offset)
+        FAIL("Can't write names of files!");
+
+    TRY image_write(fd, extents.data(), extents.size() * sizeof(extent), header->extents_offset)
+        FAIL("Can't write extents of files!");
+
+    *end = header->extents_offset + extents.size() * sizeof(extent);
+    return SUCCESS();
+}
+
+static stack_trace* image_save(file_storage* storage, int fd) {
+    image_header header {};
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+
+    header.block_record_size = sizeof(block);
+    header.link_record_size = sizeof(linked_list_link);
+    header.map_pair_size = sizeof(image_map_pair);
+    header.extent_size = sizeof(extent);
+    header.file_record_size = sizeof(image_file);
+
+    header.block_size = storage->blocks.block_size;
+    header.chunking = storage->chunking;
+    header.fingerprint = storage->blocks.hasher.backend;
+
+    header.log_sequence = storage->log ? wal_sequence(storage->log) : 0;
+
+    if (storage->chunking == CHUNKING_CDC) {
+        header.cdc_min = storage->chunker.min_size;
+        header.cdc_avg = storage->chunker.avg_size;
+        header.cdc_max = storage->chunker.max_size;
+    }
+
+    uint64_t end = sizeof(header);
+    for (size_t i = 0; i < BLOCK_STORAGE_SHARDS; ++ i)
+        TRY image_save_shard(&storage->blocks, &storage->blocks.shards[i], fd, &header.shards[i], &end)
+            FAIL("Can't write shard %zu!", i);
+
+    TRY image_save_files(storage, fd, &header, &end)
+        FAIL("Can't write files!");
+
+    // Header goes last, so image that was cut short isn't taken for a valid one
+    if (ftruncate(fd, (off_t) end) == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't extend image: %s", strerror(errno));
+
+    TRY image_write(fd, &header, sizeof(header), 0)
+        FAIL("Can't write image header!");
+
+    return SUCCESS();
+}
+
+// Makes image at /temporary/ durable under /path/
+static stack_trace* image_publish(int fd, const std::string& temporary, const char* path) {
+    if (fsync(fd) == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't flush \"%s\": %s", temporary.c_str(), strerror(errno));
+
+    if (rename(temporary.c_str(), path) == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't replace \"%s\": %s", path, strerror(errno));
+
+    // Rename itself only survives a crash once directory is synced
+    const std::string directory = strrchr(path, '/') ? std::string(path, strrchr(path, '/') - path + 1) : ".";
+
+    int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd != -1) {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+
+    return SUCCESS();
+}
+
+// Writes image of the whole storage to /path/, image that was there is
+// replaced atomically, and write-ahead log is emptied. Files and tiers of
+// blocks are frozen until image is durable, so nothing can be done with
+// the file system meanwhile
+stack_trace* file_storage_save(file_storage* storage, const char* path) {
+    const std::string temporary = std::string(path) + ".tmp";
+
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't create \"%s\": %s", temporary.c_str(), strerror(errno));
+
+    const auto start = std::chrono::steady_clock::now();
+
+    pthread_mutex_lock(&storage->tier_lock);
+    pthread_rwlock_wrlock(&storage->files_lock);
+
+    stack_trace* trace = image_save(storage, fd);
+    if (trace_is_success(trace))
+        trace = image_publish(fd, temporary, path);
+
+    // Every record is in the image now, and no new ones could be added
+    if (trace_is_success(trace) && storage->log)
+        trace = wal_reset(storage->log);
+
+    const size_t files = storage->files.used, blocks = storage->blocks.block_count();
+
+    pthread_rwlock_unlock(&storage->files_lock);
+    pthread_mutex_unlock(&storage->tier_lock);
+
+    close(fd);
+
+    if (!trace_is_success(trace)) {
+        unlink(temporary.c_str());
+        return trace;
+    }
+
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    LOG_INFO("saved %zu files and %zu blocks to \"%s\" in %.2fs", files, blocks, path, took.count());
+
+    return SUCCESS();
+}
+
+// Whether /size/ bytes from /offset/ are inside an image of /image_size/ bytes
+static bool image_contains(size_t image_size, uint64_t offset, uint64_t size) {
+    return offset <= image_size && size <= image_size - offset;
+}
+
+// Sections are only ever written at aligned offsets, and records in them are read in place
+static bool image_aligned(uint64_t offset) {
+    return offset % IMAGE_ALIGNMENT == 0;
+}
+
+// Whether /id/ is a block of shard /shard_index/ that's used in image, /used/ marks used slots
+static bool image_is_used_block(block_id_t id, size_t shard_index, const std::vector<bool>& used) {
+    return id > linked_list_end_index && block_storage::shard_of(id) == shard_index &&
+           block_storage::slot_of(id) < used.size() && used[block_storage::slot_of(id)];
+}
+
+// Walks allocator and block map of shard /shard_index/ as they are in image.
+// Lists of used and free elements should hold every element below /unused/
+// exactly once, and every used block should be found by block map under its
+// hash, in a chain of blocks that collided. Slots of used blocks are marked in /used/
+static stack_trace* image_check_shard(const char* image, const image_header* header, size_t shard_index,
+                                      std::vector<bool>* used) {
+    const image_shard* shard = &header->shards[shard_index];
+
+    const auto* links = (const linked_list_link*) (image + shard->links_offset);
+    const auto* free_bits = (const uint64_t*) (image + shard->free_bits_offset);
+    const auto* blocks = (const block*) (image + shard->blocks_offset);
+
+    const element_index_t unused = shard->allocator_unused;
+    used->assign((size_t) unused, false);
+
+    auto is_element = [unused](element_index_t index) {
+        return index > linked_list_end_index && index < unused;
+    };
+
+    // Used blocks, in list's order from its terminal node and back to it
+    size_t used_count = 0;
+    element_index_t previous = linked_list_end_index;
+
+    for (element_index_t current = links[linked_list_end_index].next_index;
+         current != linked_list_end_index; previous = current, current = links[current].next_index) {
+
+        if (!is_element(current) || (*used)[current] || linked_list_free_bit(free_bits, current) ||
+            links[current].prev_index != previous)
+            return FAILURE(RUNTIME_ERROR, "List of blocks is broken at element %d!", current);
+
+        const block* current_block = &blocks[current];
+        if (current_block->size == 0 || current_block->size > header->block_size ||
+            current_block->references == 0 || block_storage::shard_of(current_block->hash) != shard_index)
+            return FAILURE(RUNTIME_ERROR, "Block in slot %d is damaged!", current);
+
+        (*used)[current] = true;
+        ++ used_count;
+    }
+
+    if (links[linked_list_end_index].prev_index != previous || used_count != shard->allocator_used)
+        return FAILURE(RUNTIME_ERROR, "List of blocks doesn't hold all of them!");
+
+    // Freed elements are looped on their own, each of them is marked free
+    size_t free_count = 0;
+    if (shard->allocator_free != linked_list_no_free_index) {
+        std::vector<bool> looped((size_t) unused, false);
+
+        element_index_t current = shard->allocator_free;
+        do {
+            if (!is_element(current) || looped[current] || !linked_list_free_bit(free_bits, current) ||
+                !is_element(links[current].next_index) ||
+                links[links[current].next_index].prev_index != current)
+                return FAILURE(RUNTIME_ERROR, "List of free blocks is broken at element %d!", current);
+
+            looped[current] = true;
+            ++ free_count;
+
+            current = links[current].next_index;
+        } while (current != shard->allocator_free);
+    }
+
+    if (used_count + free_count != (size_t) unused - 1)
+        return FAILURE(RUNTIME_ERROR, "Free flags of blocks disagree with their lists!");
+
+    // Block map is looked up in place, it's only read
+    flat_hash_table<hash_t, element_index_t, hash_hash, hash_equal> map = {
+        .control = (flat_hash_table_control*) (image + shard->map_offset),
+        .slots = (image_map_pair*) (image + shard->map_offset + shard->map_capacity * sizeof(flat_hash_table_control)),
+        .capacity = shard->map_capacity, .used = shard->map_used, .tombstones = shard->map_tombstones,
+        .previous = NULL, .migrated = 0
+    };
+
+    size_t full = 0, deleted = 0, chained = 0;
+    std::vector<bool> in_chain((size_t) unused, false);
+
+    for (size_t slot = 0; slot < map.capacity; ++ slot) {
+        const flat_hash_table_control control = map.control[slot];
+
+        if (control == FLAT_HASH_TABLE_EMPTY)
+            continue;
+
+        if (control == FLAT_HASH_TABLE_DELETED) {
+            ++ deleted;
+            continue;
+        }
+
+        image_map_pair* pair = &map.slots[slot];
+
+        // Pair is found where it is (so there's no other one with the same key)
+        if (control < 0 || __flat_hash_table_h2(hash_hash(pair->key)) != control ||
+            flat_hash_table_lookup(&map, pair->key) != &pair->value)
+            return FAILURE(RUNTIME_ERROR, "Block map is damaged in slot %zu!", slot);
+
+        ++ full;
+
+        for (block_id_t id = pair->value; id != linked_list_end_index; ) {
+            const size_t block_slot = block_storage::slot_of(id);
+            if (!image_is_used_block(id, shard_index, *used) || in_chain[block_slot])
+                return FAILURE(RUNTIME_ERROR, "Chain of blocks with the same hash is broken at block %d!", id);
+
+            hash_t block_hash = blocks[block_slot].hash;
+            if (!hash_equal(&block_hash, &pair->key))
+                return FAILURE(RUNTIME_ERROR, "Block %d is chained under another hash!", id);
+
+            in_chain[block_slot] = true;
+            ++ chained;
+
+            id = blocks[block_slot].next_same_hash;
+        }
+    }
+
+    // Insert always leaves some slots free, otherwise probing would never end
+    const size_t MAX_LOAD_NUMERATOR = 7, MAX_LOAD_DENOMINATOR = 8;
+
+    if (full != map.used || deleted != map.tombstones ||
+        (full + deleted) * MAX_LOAD_DENOMINATOR > map.capacity * MAX_LOAD_NUMERATOR)
+        return FAILURE(RUNTIME_ERROR, "Block map has wrong counts of pairs!");
+
+    if (chained != used_count)
+        return FAILURE(RUNTIME_ERROR, "Block map misses %zu blocks!", used_count - chained);
+
+    return SUCCESS();
+}
+
+// Checks extents of file record /file_index/: they cover file from start to end
+// without gaps, and refer to blocks of their size. References are counted in
+// /references/, by shard and slot
+static stack_trace* image_check_extents(const image_file* record, size_t file_index, const extent* extents,
+                                        const block* const* shard_blocks, std::vector<uint64_t>* references) {
+    uint64_t end = 0;
+
+    for (uint64_t i = 0; i < record->extent_count; ++ i) {
+        const extent* current = &extents[record->first_extent + i];
+
+        if (current->offset != end || current->size == 0 || current->count == 0 ||
+            (current->id == HOLE_BLOCK_ID && current->count != 1) ||
+            current->size * current->count / current->count != current->size ||
+            current->size * current->count > UINT64_MAX - end)
+            return FAILURE(RUNTIME_ERROR, "Extent %zu of file %zu is damaged!", (size_t) i, file_index);
+
+        end += current->size * current->count;
+
+        if (current->id == HOLE_BLOCK_ID)
+            continue;
+
+        if (current->id < 0)
+            return FAILURE(RUNTIME_ERROR, "File %zu refers to invalid block %d!", file_index, current->id);
+
+        const size_t shard = block_storage::shard_of(current->id), slot = block_storage::slot_of(current->id);
+        if (slot == 0 || slot >= references[shard].size() ||
+            references[shard][slot] == UINT64_MAX) // Marks slots that aren't used
+            return FAILURE(RUNTIME_ERROR, "File %zu refers to missing block %d!", file_index, current->id);
+
+        // Blocks are no bigger than block size, so neither is extent
+        if (current->size != shard_blocks[shard][slot].size)
+            return FAILURE(RUNTIME_ERROR, "File %zu refers to block %d with a wrong size!", file_index, current->id);
+
+        references[shard][slot] += current->count;
+    }
+
+    if (end != record->size)
+        return FAILURE(RUNTIME_ERROR, "Extents of file %zu don't end where it does!", file_index);
+
+    return SUCCESS();
+}
+
+// Checks everything image refers to is inside of it, and that tables and
+// files in it are consistent, before anything is restored
+static stack_trace* image_check(const char* image, size_t image_size) {
+    const image_header* header = (const image_header*) image;
+
+    if (image_size < sizeof(*header) || memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+        return FAILURE(RUNTIME_ERROR, "Not an image of dedfs!");
+
+    if (header->version != IMAGE_VERSION ||
+        header->block_record_size != sizeof(block) || header->link_record_size != sizeof(linked_list_link) ||
+        header->map_pair_size != sizeof(image_map_pair) ||
+        header->extent_size != sizeof(extent) || header->file_record_size != sizeof(image_file))
+        return FAILURE(RUNTIME_ERROR, "Image was written by an incompatible version!");
+
+    if (header->block_size < MIN_BLOCK_SIZE || header->block_size > MAX_BLOCK_SIZE)
+        return FAILURE(RUNTIME_ERROR, "Image has invalid block size %zu!", (size_t) header->block_size);
+
+    if (header->chunking != CHUNKING_FIXED && header->chunking != CHUNKING_CDC)
+        return FAILURE(RUNTIME_ERROR, "Image has unknown chunking %u!", header->chunking);
+
+    if (header->chunking == CHUNKING_CDC &&
+        (!is_valid_cdc_max_size(header->cdc_max) || header->block_size != header->cdc_max))
+        return FAILURE(RUNTIME_ERROR, "Image has invalid chunk bounds (max %zu, block size %zu)!",
+                       (size_t) header->cdc_max, (size_t) header->block_size);
+
+    // Used slots of every shard, references to them are counted as files are checked
+    const block* shard_blocks[BLOCK_STORAGE_SHARDS];
+    std::vector<uint64_t> references[BLOCK_STORAGE_SHARDS];
+
+    for (size_t i = 0; i < BLOCK_STORAGE_SHARDS; ++ i) {
+        const image_shard* shard = &header->shards[i];
+
+        const uint64_t capacity = shard->allocator_capacity, map_capacity = shard->map_capacity;
+        const int64_t unused = shard->allocator_unused, free_index = shard->allocator_free;
+
+        bool valid = capacity < block_storage::MAX_BLOCKS_PER_SHARD &&
+            unused > linked_list_end_index && (uint64_t) unused <= capacity + 2 &&
+            shard->allocator_used < (uint64_t) unused &&
+            (free_index == linked_list_no_free_index || (free_index > linked_list_end_index && free_index < unused)) &&
+            map_capacity >= FLAT_HASH_TABLE_GROUP_SIZE && (map_capacity & (map_capacity - 1)) == 0 &&
+            map_capacity <= image_size && shard->map_used + shard->map_tombstones <= map_capacity;
+
+        valid = valid &&
+            image_aligned(shard->links_offset) && image_aligned(shard->free_bits_offset) &&
+            image_aligned(shard->blocks_offset) && image_aligned(shard->map_offset) &&
+            image_aligned(shard->payloads_offset);
+
+        valid = valid &&
+            image_contains(image_size, shard->links_offset, unused * sizeof(linked_list_link)) &&
+            image_contains(image_size, shard->free_bits_offset, linked_list_bitmap_words(unused) * sizeof(uint64_t)) &&
+            image_contains(image_size, shard->blocks_offset, unused * sizeof(block)) &&
+            image_contains(image_size, shard->map_offset,
+                           map_capacity * (sizeof(flat_hash_table_control) + sizeof(image_map_pair))) &&
+            image_contains(image_size, shard->payloads_offset, unused * header->block_size);
+
+        if (!valid)
+            return FAILURE(RUNTIME_ERROR, "Tables of shard %zu are damaged!", i);
+
+        std::vector<bool> used;
+        TRY image_check_shard(image, header, i, &used)
+            FAIL("Tables of shard %zu are damaged!", i);
+
+        shard_blocks[i] = (const block*) (image + shard->blocks_offset);
+
+        references[i].assign(used.size(), UINT64_MAX);
+        for (size_t slot = 0; slot < used.size(); ++ slot)
+            if (used[slot])
+                references[i][slot] = 0;
+    }
+
+    const uint64_t files = header->file_count, extents = header->extent_count;
+
+    if (files == 0 || files > image_size / sizeof(image_file) ||
+        !image_aligned(header->files_offset) || !image_aligned(header->extents_offset) ||
+        !image_contains(image_size, header->files_offset, files * sizeof(image_file)) ||
+        !image_contains(image_size, header->names_offset, header->names_size) ||
+        extents > image_size / sizeof(extent) ||
+        !image_contains(image_size, header->extents_offset, extents * sizeof(extent)))
+        return FAILURE(RUNTIME_ERROR, "File table is damaged!");
+
+    const image_file* records = (const image_file*) (image + header->files_offset);
+    const char* names = image + header->names_offset;
+    const extent* all_extents = (const extent*) (image + header->extents_offset);
+
+    // Files are restored under these, they should be unique
+    std::unordered_set<uint64_t> indices;
+    std::unordered_set<std::string> paths; // Parent's record and name
+
+    for (uint64_t i = 0; i < files; ++ i) {
+        const image_file* record = &records[i];
+
+        const bool has_parent = i == 0 ? record->parent == 0
+            : record->parent == IMAGE_NO_PARENT ||
+              (record->parent < i && S_ISDIR(records[record->parent].mode) &&
+               records[record->parent].parent != IMAGE_NO_PARENT);
+
+        if (!has_parent || (i == 0 && !S_ISDIR(record->mode)) ||
+            (!S_ISDIR(record->mode) && !S_ISREG(record->mode)) ||
+            record->index <= (uint64_t) linked_list_end_index || record->index > MAX_FILES ||
+            !indices.insert(record->index).second ||
+            record->name_offset >= header->names_size ||
+            !memchr(names + record->name_offset, '\0', header->names_size - record->name_offset) ||
+            record->first_extent > extents || record->extent_count > extents - record->first_extent ||
+            (S_ISDIR(record->mode) && record->extent_count != 0))
+            return FAILURE(RUNTIME_ERROR, "Record of file %zu is damaged!", (size_t) i);
+
+        // Named files should be told apart by their names in parent directory
+        const char* name = names + record->name_offset;
+        if (i != 0 && record->parent != IMAGE_NO_PARENT &&
+            (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+             !paths.insert(std::to_string(record->parent) + "/" + name).second))
+            return FAILURE(RUNTIME_ERROR, "File %zu has invalid name!", (size_t) i);
+
+        TRY image_check_extents(record, (size_t) i, all_extents, shard_blocks, references)
+            FAIL("Extents of file %zu are damaged!", (size_t) i);
+    }
+
+    // Otherwise block would be freed while files still use it, or never at all
+    for (size_t i = 0; i < BLOCK_STORAGE_SHARDS; ++ i)
+        for (size_t slot = 0; slot < references[i].size(); ++ slot)
+            if (references[i][slot] != UINT64_MAX && references[i][slot] != shard_blocks[i][slot].references)
+                return FAILURE(RUNTIME_ERROR, "Block %d is referenced %zu times, but counts %zu!",
+                               block_storage::make_block_id(i, (element_index_t) slot),
+                               (size_t) references[i][slot], (size_t) shard_blocks[i][slot].references);
+
+    return SUCCESS();
+}
+
+// Copies tables of /shard/ from image as they are, and its payloads back to memory
+static stack_trace* image_load_shard(block_storage* blocks, block_shard* shard,
+                                     const char* image, const image_shard* record) {
+    // Space after elements that were used is only allocated, as linked_list_create does
+    const size_t entries = record->allocator_capacity + 2, used_entries = record->allocator_unused;
+    const size_t free_bits_size = linked_list_bitmap_words(used_entries) * sizeof(uint64_t);
+
+    auto* links = (linked_list_link*) malloc(entries * sizeof(linked_list_link));
+    auto* free_bits = (uint64_t*) malloc(linked_list_bitmap_words(entries) * sizeof(uint64_t));
+    auto* elements = (block*) malloc(entries * sizeof(block));
+
+    auto* control = (flat_hash_table_control*)
+        aligned_alloc(FLAT_HASH_TABLE_GROUP_SIZE, record->map_capacity * sizeof(flat_hash_table_control));
+    auto* pairs = (image_map_pair*) malloc(record->map_capacity * sizeof(image_map_pair));
+
+    if (!links || !free_bits || !elements || !control || !pairs) {
+        free(links), free(free_bits), free(elements), free(control), free(pairs);
+        return FAILURE(RUNTIME_ERROR, "Can't allocate tables of %zu blocks!", (size_t) record->allocator_used);
+    }
+
+    memcpy(links, image + record->links_offset, used_entries * sizeof(*links));
+    memcpy(free_bits, image + record->free_bits_offset, free_bits_size);
+    memcpy(elements, image + record->blocks_offset, used_entries * sizeof(*elements));
+
+    memcpy(control, image + record->map_offset, record->map_capacity * sizeof(*control));
+    memcpy(pairs, image + record->map_offset + record->map_capacity * sizeof(*control),
+           record->map_capacity * sizeof(*pairs));
+
+    linked_list_destroy(&shard->allocator);
+    shard->allocator = {
+        .links = links, .free_bits = free_bits, .elements = elements,
+        .capacity = record->allocator_capacity, .used = record->allocator_used,
+        .free = record->allocator_free, .unused = record->allocator_unused,
+        .is_linearized = record->allocator_linearized != 0
+    };
+
+    flat_hash_table_destroy(&shard->block_map);
+    shard->block_map = {
+        .control = control, .slots = pairs,
+        .capacity = record->map_capacity, .used = record->map_used, .tombstones = record->map_tombstones,
+        .previous = NULL, .migrated = 0
+    };
+
+    // Payloads go to memory file in runs of slots that follow each other in a slab
+    const size_t block_size = blocks->block_size;
+    size_t run_slot = 0, run_count = 0;
+
+    auto write_run = [&]() {
+        return run_count == 0 || slab_arena_write(&shard->payloads, run_slot,
+            image + record->payloads_offset + run_slot * block_size, run_count * block_size);
+    };
+
+    for (size_t slot = 1; slot < used_entries; ++ slot) {
+        if (is_free_element(&shard->allocator, (element_index_t) slot))
+            continue;
+
+        TRY slab_arena_reserve(&shard->payloads, slot)
+            FAIL("Can't allocate payload for slot %zu!", slot);
+
+        TRY slab_arena_reserve(&shard->tiers, slot)
+            FAIL("Can't allocate tier for slot %zu!", slot);
+
+        *block_storage::tier_of(shard, slot) =
+            { .location = BLOCK_IN_MEMORY, .logged = true, .compressed_size = 0, .compressed = NULL,
+              .last_read = 0 };
+
+        shard->resident_bytes += elements[slot].size;
+
+        if (run_count != 0 && slot == run_slot + run_count && slot % shard->payloads.slots_per_slab != 0) {
+            ++ run_count;
+            continue;
+        }
+
+        if (!write_run())
+            return FAILURE(RUNTIME_ERROR, "Out of memory for payloads!");
+
+        run_slot = slot, run_count = 1;
+    }
+
+    if (!write_run())
+        return FAILURE(RUNTIME_ERROR, "Out of memory for payloads!");
+
+    return SUCCESS();
+}
+
+// Image should be checked with image_check, storage should be just created.
+// Unlinked files are only kept (unlinked and looked up once) if there's /restore/
+static stack_trace* image_load(file_storage* storage, const char* image, image_restore* restore) {
+    const image_header* header = (const image_header*) image;
+
+    // Blocks in image are cut and fingerprinted this way
+    if (header->chunking == CHUNKING_CDC) {
+        TRY cdc_chunker_create(&storage->chunker, header->cdc_min, header->cdc_avg, header->cdc_max)
+            FAIL("Image has invalid chunking parameters!");
+
+        storage->chunking = CHUNKING_CDC;
+    } else
+        storage->chunking = CHUNKING_FIXED;
+
+    TRY storage->blocks.set_block_size(header->block_size)
+        FAIL("Can't use block size of image!");
+
+    TRY storage->blocks.set_fingerprint_backend((fingerprint_backend) header->fingerprint)
+        FAIL("Can't use fingerprint backend of image!");
+
+    for (size_t i = 0; i < BLOCK_STORAGE_SHARDS; ++ i)
+        TRY image_load_shard(&storage->blocks, &storage->blocks.shards[i], image, &header->shards[i])
+            FAIL("Can't restore shard %zu!", i);
+
+    const image_file* records = (const image_file*) (image + header->files_offset);
+    const char* names = image + header->names_offset;
+    const extent* extents = (const extent*) (image + header->extents_offset);
+
+    std::vector<element_index_t> indices(header->file_count, linked_list_end_index);
+
+    for (size_t i = 0; i < header->file_count; ++ i) {
+        const image_file* record = &records[i];
+        const extent* file_extents = extents + record->first_extent;
+
+        if (record->parent == IMAGE_NO_PARENT && !restore) {
+            file_storage_release_extents(storage, file_extents, record->extent_count);
+            continue; // Nobody can open it anymore
+        }
+
+        if (record->parent == IMAGE_NO_PARENT) {
+            file orphan {};
+            file_create(&orphan, "", record->mode, record->uid, record->gid);
+
+            free(orphan.name), orphan.name = NULL;
+            orphan.parent = ROOT_FILE_INDEX;
+            orphan.unlinked = true;
+            orphan.lookups = 1; // Log can still change it, it's forgotten after replay
+
+            TRY file_storage_push_file(storage, orphan, &indices[i])
+                FAIL("Can't restore unlinked file!");
+        } else
+            indices[i] = i == 0 ? ROOT_FILE_INDEX
+                : file_storage_add_file(storage, indices[record->parent], names + record->name_offset,
+                                        record->mode, record->uid, record->gid);
+
+        if (restore)
+            restore->files[(element_index_t) record->index] = indices[i];
+
+        file* target_file = file_storage_get_file(storage, indices[i]);
+        target_file->mode = record->mode;
+        target_file->uid = record->uid, target_file->gid = record->gid;
+
+        if (record->extent_count != 0)
+            TRY extent_map_splice(&target_file->extents, 0, 0, file_extents, record->extent_count)
+                FAIL("Can't restore extents of \"%s\"!", target_file->name);
+
+        target_file->size = record->size;
+    }
+
+    // Adding children touched their parents
+    for (size_t i = 0; i < header->file_count; ++ i)
+        if (indices[i] != linked_list_end_index) {
+            file* target_file = file_storage_get_file(storage, indices[i]);
+
+            target_file->atime = records[i].atime;
+            target_file->mtime = records[i].mtime;
+            target_file->ctime = records[i].ctime;
+        }
+
+    if (restore)
+        restore->log_sequence = header->log_sequence;
+
+    return SUCCESS();
+}
+
+// Restores storage from image at /path/, which is mapped and copied into
+// place. Storage should be just created, block size, chunking and
+// fingerprint backend it was created with are replaced with image's.
+// Write-ahead log can then be replayed with what's left in /restore/
+stack_trace* file_storage_load(file_storage* storage, const char* path, image_restore* restore = NULL) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return FAILURE(RUNTIME_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return FAILURE(RUNTIME_ERROR, "\"%s\" is empty or can't be read!", path);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t image_size = (size_t) st.st_size;
+    void* mapping = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return FAILURE(RUNTIME_ERROR, "Can't map \"%s\": %s", path, strerror(errno));
+
+    // Everything is read front to back once
+    madvise(mapping, image_size, MADV_SEQUENTIAL);
+
+    const char* image = (const char*) mapping;
+
+    stack_trace* trace = image_check(image, image_size);
+    if (trace_is_success(trace))
+        trace = image_load(storage, image, restore);
+
+    munmap(mapping, image_size);
+
+    if (!trace_is_success(trace))
+        return PASS_FAILURE(trace, RUNTIME_ERROR, "Can't restore from \"%s\"!", path);
+
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    LOG_INFO("restored %zu files and %zu blocks from \"%s\" in %.2fs",
+             storage->files.used, storage->blocks.block_count(), path, took.count());
+
+    return SUCCESS();
+}
+
+// Copy /size/ bytes of referenced block starting from /offset/ in it
+void file_storage_read_block(file_storage* storage, block_ref ref,
+                             size_t offset, size_t size, char* destination) {
+    if (ref.id == HOLE_BLOCK_ID)
+        memset(destination, 0, size);
+    else {
+        storage->blocks.load_block(ref.id);
+        memcpy(destination, storage->blocks.block_data(ref.id) + offset, size);
+    }
+}
+
+size_t file_read(file_storage* storage, file* target_file,
+                 char* buffer, size_t size, size_t offset) {
+
+    if (offset >= target_file->size)
+        return 0; // Nothing to read past the end of file
+
+    size = std::min(size, target_file->size - offset);
+
+    extent_map* map = &target_file->extents;
+
+    size_t block_start;
+    extent_cursor current = extent_map_find_block(map, offset, &block_start);
+
+    size_t offset_in_block = offset - block_start;
+    for (size_t left = size; left != 0; ) {
+        block_ref ref = extent_map_get(map, current);
+
+        size_t bytes_to_read = std::min(ref.size - offset_in_block, left);
+        file_storage_read_block(storage, ref, offset_in_block, bytes_to_read, buffer);
+
+        buffer += bytes_to_read;
+        left   -= bytes_to_read;
+
+        offset_in_block = 0;
+        current = extent_map_next(map, current);
+    }
+
+    return size;
+}
+
+// Source of zeroes for holes in file_read_buf
+static const char hole_zeroes[64 * 1024] = {};
+
+// Same as file_read, but result refers to payloads of the blocks instead of
+// being copied, so it can be spliced. It's only valid while file stays locked,
+// and is freed with free(). NULL if out of memory
+fuse_bufvec* file_read_buf(file_storage* storage, file* target_file, size_t size, size_t offset) {
+    size = offset < target_file->size ? std::min(size, target_file->size - offset) : 0;
+
+    extent_map* map = &target_file->extents;
+
+    size_t block_start;
+    extent_cursor current = extent_map_find_block(map, offset, &block_start);
+
+    std::vector<fuse_buf> pieces;
+
+    size_t offset_in_block = offset - block_start;
+    for (size_t left = size; left != 0; ) {
+        block_ref ref = extent_map_get(map, current);
+
+        fuse_buf piece = { .size = std::min(ref.size - offset_in_block, left),
+                           .flags = (fuse_buf_flags) 0, .mem = NULL, .fd = -1, .pos = 0 };
+
+        int fd;
+        off_t position;
+        if (ref.id != HOLE_BLOCK_ID)
+            storage->blocks.load_block(ref.id);
+
+        if (ref.id == HOLE_BLOCK_ID) {
+            piece.size = std::min(piece.size, sizeof(hole_zeroes));
+            piece.mem  = (void*) hole_zeroes;
+        } else if (storage->blocks.block_location(ref.id, &fd, &position)) {
+            piece.flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            piece.fd  = fd;
+            piece.pos = position + (off_t) offset_in_block;
+        } else
+            piece.mem = storage->blocks.block_data(ref.id) + offset_in_block;
+
+        pieces.push_back(piece);
+        left -= piece.size;
+
+        // Big holes take several pieces
+        offset_in_block += piece.size;
+        if (offset_in_block == ref.size) {
+            offset_in_block = 0;
+            current = extent_map_next(map, current);
+        }
+    }
+
+    // Bufvec has room for one buffer, and even empty reply has one
+    const size_t count = std::max(pieces.size(), (size_t) 1);
+
+    fuse_bufvec* result = (fuse_bufvec*)
+        calloc(1, sizeof(fuse_bufvec) + (count - 1) * sizeof(fuse_buf));
+
+    if (result) {
+        result->count = count;
+        std::copy(pieces.begin(), pieces.end(), result->buf);
+    }
+
+    return result;
+}
+
+void file_truncate(file_storage* storage, file* target_file, size_t new_size) {
+    extent_map* map = &target_file->extents;
+
+    if (new_size > target_file->size) {
+        // File grows with a hole, it takes no blocks at all
+        extent hole = { target_file->size, new_size - target_file->size, HOLE_BLOCK_ID, 1 };
+
+        TRY extent_map_splice(map, map->used, map->used, &hole, 1)
+            THROW("Failed to add a hole of size %zu!", hole.size);
+
+        extent_map_merge_at(map, map->used - 1);
+
+        target_file->size = new_size;
+        return;
+    }
+
+    size_t index = extent_map_find(map, new_size);
+    if (index == map->used)
+        return; // Size didn't change
+
+    // Extents are cut at new end of file, what follows is dropped
+    extent kept[2] = {};
+    size_t kept_count = 0;
+
+    extent* cut = &map->extents[index];
+    if (cut->id == HOLE_BLOCK_ID) {
+        if (new_size > cut->offset)
+            kept[kept_count ++] = { cut->offset, new_size - cut->offset, HOLE_BLOCK_ID, 1 };
+    } else {
+        uint32_t whole_blocks = (uint32_t) ((new_size - cut->offset) / cut->size);
+        size_t partial_size = new_size - cut->offset - whole_blocks * cut->size;
+
+        if (whole_blocks != 0)
+            kept[kept_count ++] = { cut->offset, cut->size, cut->id, whole_blocks };
+
+        if (partial_size != 0) {
+            storage->blocks.load_block(cut->id);
+
+            block_id_t partial =
+                storage->blocks.get_block(storage->blocks.block_data(cut->id), partial_size);
+
+            kept[kept_count ++] = { new_size - partial_size, partial_size, partial, 1 };
+        }
+
+        // Blocks that are gone from this extent
+        extent dropped = *cut;
+        dropped.count -= whole_blocks;
+
+        file_storage_release_extents(storage, &dropped, 1);
+    }
+
+    file_storage_release_extents(storage, map->extents + index + 1, map->used - index - 1);
+
+    TRY extent_map_splice(map, index, map->used, kept, kept_count)
+        THROW("Failed to cut file's extents!");
+
+    target_file->size = new_size;
+}
+
+// Replaces run of blocks in file's extents, new blocks are cut from old bytes
+// before written range, written data and old bytes after it, until new block
+// boundaries line up with old ones again. Only blocks that overlap written
+// range (plus whatever it takes for chunking to catch up) are touched.
+struct file_rewrite {
+    file_storage* storage;
+    extent_map* map;
+
+    extent_cursor first;          // First old block that's replaced
+    size_t position;              // Offset in file where next new block starts
+
+    const char* data;
+    size_t data_left, write_end;
+
+    // Old blocks that are replaced, they are only released after new blocks
+    // are made, so blocks with same content are reused instead of recreated
+    std::vector<block_ref> removed;
+    size_t removed_start, removed_end;
+
+    extent_cursor next_old;       // First old block that isn't replaced yet
+    size_t reader_position;       // Next old byte that goes after data
+
+    std::vector<extent> added;    // New extents, in order
+
+    char* window; // Bytes that don't belong to any new block yet
+    size_t window_size;
+
+    void remove_next_old() {
+        block_ref old = extent_map_get(map, next_old);
+
+        removed.push_back(old);
+        removed_end += old.size;
+
+        next_old = extent_map_next(map, next_old);
+    }
+
+    bool has_old_bytes() {
+        return reader_position < removed_end || next_old.index != map->used;
+    }
+
+    // Copy old bytes starting from /offset/ in file, stops at block's end
+    size_t read_old(size_t offset, char* destination, size_t size) {
+        size_t block_start = removed_start;
+        for (block_ref ref: removed) {
+            if (offset < block_start + ref.size) {
+                size = std::min(size, block_start + ref.size - offset);
+                file_storage_read_block(storage, ref, offset - block_start, size, destination);
+                return size;
+            }
+
+            block_start += ref.size;
+        }
+
+        assert(false && "Offset is outside of removed blocks!");
+        return 0;
+    }
+
+    void emit(block_id_t id, size_t size) {
+        extent new_extent = { position, size, id, 1 };
+        if (added.empty() || !extent_merge(&added.back(), &new_extent))
+            added.push_back(new_extent);
+
+        position += size;
+    }
+
+    void emit_block(const char* block_data, size_t size) {
+        emit(storage->blocks.get_block(block_data, size), size);
+    }
+
+    // Cuts as many blocks from written data as chunker can decide on
+    // without old bytes, up to a batch, and emits them all at once
+    void emit_data_blocks() {
+        const char* blocks[BLOCK_STORAGE_BATCH];
+        size_t sizes[BLOCK_STORAGE_BATCH];
+
+        size_t count = 0;
+        while (count < BLOCK_STORAGE_BATCH && data_left != 0 &&
+               (data_left >= storage->blocks.block_size || !has_old_bytes())) {
+
+            size_t chunk = file_storage_next_chunk(storage, data, data_left);
+            blocks[count] = data, sizes[count] = chunk, ++ count;
+
+            data += chunk, data_left -= chunk;
+        }
+
+        block_id_t ids[BLOCK_STORAGE_BATCH];
+        storage->blocks.get_blocks(blocks, sizes, count, ids);
+
+        for (size_t i = 0; i < count; ++ i)
+            emit(ids[i], sizes[i]);
+    }
+
+    void fill_window() {
+        const size_t block_size = storage->blocks.block_size;
+
+        while (window_size < block_size) {
+            size_t filled = 0;
+
+            if (data_left != 0) {
+                filled = std::min(data_left, block_size - window_size);
+                memcpy(window + window_size, data, filled);
+
+                data += filled, data_left -= filled;
+            } else if (has_old_bytes()) {
+                if (reader_position == removed_end)
+                    remove_next_old();
+
+                filled = read_old(reader_position, window + window_size,
+                                  block_size - window_size);
+                reader_position += filled;
+            } else
+                break; // Reached end of file
+
+            window_size += filled;
+        }
+    }
+
+    // Tells if remaining blocks can stay as they are
+    bool is_finished() {
+        if (data_left != 0 || position < write_end)
+            return false;
+
+        // New blocks line up with the old ones
+        if (window_size == 0 && reader_position >= removed_end)
+            return true;
+
+        if (removed.empty())
+            return false;
+
+        // Rest of old bytes is a hole, so it can stay a hole
+        block_ref last = removed.back();
+        size_t last_start = removed_end - last.size;
+
+        if (last.id == HOLE_BLOCK_ID && position >= last_start && position < removed_end) {
+            emit(HOLE_BLOCK_ID, removed_end - position);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Put new extents in place of replaced blocks, parts of runs
+    // that were only partially replaced stay on both sides
+    void commit() {
+        std::vector<extent> replacement;
+        auto append = [&replacement](extent next) {
+            if (replacement.empty() || !extent_merge(&replacement.back(), &next))
+                replacement.push_back(next);
+        };
+
+        if (first.index != map->used && first.repetition != 0) {
+            extent* first_extent = &map->extents[first.index];
+            append({ first_extent->offset, first_extent->size, first_extent->id, first.repetition });
+        }
+
+        for (extent new_extent: added)
+            append(new_extent);
+
+        size_t last_index = next_old.index;
+        if (next_old.index != map->used && next_old.repetition != 0) {
+            extent* last_extent = &map->extents[next_old.index];
+
+            append({ last_extent->offset + next_old.repetition * last_extent->size,
+                     last_extent->size, last_extent->id, last_extent->count - next_old.repetition });
+            ++ last_index;
+        }
+
+        TRY extent_map_splice(map, first.index, last_index,
+                              replacement.data(), replacement.size())
+            THROW("Failed to replace file's extents!");
+
+        // New blocks can continue runs of their neighbours
+        extent_map_merge_at(map, first.index + replacement.size());
+        extent_map_merge_at(map, first.index);
+    }
+
+    void run() {
+        const size_t block_size = storage->blocks.block_size;
+
+        do {
+            if (window_size == 0 && data_left != 0 &&
+                (data_left >= block_size || !has_old_bytes())) {
+
+                // Chunker sees enough data to make a decision, no need to copy
+                emit_data_blocks();
+                continue;
+            }
+
+            fill_window();
+            if (window_size == 0)
+                break; // Everything is written
+
+            size_t chunk = file_storage_next_chunk(storage, window, window_size);
+            emit_block(window, chunk);
+
+            memmove(window, window + chunk, window_size - chunk);
+            window_size -= chunk;
+        } while (!is_finished());
+
+        commit();
+
+        for (block_ref ref: removed)
+            if (ref.id != HOLE_BLOCK_ID)
+                storage->blocks.release_block(ref.id);
+    }
+};
+
+void file_write(file_storage* storage, const char* data, size_t size, size_t offset, file* file) {
+    assert(file && storage);
+
+    if (size == 0)
+        return;
+
+    // Writing past the end of file leaves a hole before written data
+    if (offset > file->size)
+        file_truncate(storage, file, offset);
+
+    const size_t block_size = storage->blocks.block_size;
+    extent_map* map = &file->extents;
+
+    size_t start;
+    extent_cursor first = extent_map_find_block(map, offset, &start);
+
+    // Last block was cut by the end of previous write rather than by
+    // its content, so it's reopened and chunked along with new data
+    if (first.index == map->used && map->used != 0) {
+        extent* tail = &map->extents[map->used - 1];
+
+        if (tail->id == HOLE_BLOCK_ID || tail->size < block_size) {
+            first = { map->used - 1, tail->count - 1 };
+            start = file->size - tail->size;
+        }
+    }
+
+    // Only part of a hole next to written data gets filled with zeroes,
+    // with fixed blocks it's the part from last block boundary
+    size_t kept_hole = 0;
+    if (first.index != map->used && map->extents[first.index].id == HOLE_BLOCK_ID) {
+        size_t hole_end = extent_end(&map->extents[first.index]);
+
+        size_t split = storage->chunking == CHUNKING_FIXED ? offset - offset % block_size : offset;
+        split = std::max(split, start);
+
+        if (split == hole_end) {
+            first = { first.index + 1, 0 };
+            start = hole_end;
+        } else
+            kept_hole = split - start;
+    }
+
+    file_rewrite rewrite = {
+        .storage = storage, .map = map,
+
+        .first = first, .position = start,
+
+        .data = data, .data_left = size, .write_end = offset + size,
+
+        .removed = {}, .removed_start = start, .removed_end = start,
+
+        .next_old = first, .reader_position = offset + size,
+
+        .added = {},
+
+        .window = (char*) calloc(block_size, sizeof(char)), .window_size = 0
+    };
+
+    if (kept_hole != 0)
+        rewrite.emit(HOLE_BLOCK_ID, kept_hole);
+
+    // Blocks under written range are gone, bytes before it start the window
+    while (rewrite.removed_end < rewrite.write_end && rewrite.next_old.index != map->used)
+        rewrite.remove_next_old();
+
+    while (rewrite.position + rewrite.window_size < offset) {
+        size_t window_end = rewrite.position + rewrite.window_size;
+
+        rewrite.window_size += rewrite.read_old(window_end, rewrite.window + rewrite.window_size,
+                                                offset - window_end);
+    }
+
+    rewrite.run();
+
+    free(rewrite.window);
+
+    file->size = std::max(file->size, offset + size);
+
+    if (storage->log)
+        file_storage_log_write(storage, file_storage_index_of(storage, file), offset, offset + size,
+                               rewrite.removed_start, rewrite.removed_end, rewrite.added);
+}
+
+// Replaces blocks of [start, end) in a file, which start and end at its
+// block boundaries, with /extents/ that start at /start/. Their blocks
+// should be referenced already, blocks that are replaced are released
+void file_replace_blocks(file_storage* storage, file* target_file, size_t start, size_t end,
+                         const std::vector<extent>& extents) {
+    extent_map* map = &target_file->extents;
+
+    size_t block_start;
+    extent_cursor first = extent_map_find_block(map, start, &block_start);
+
+    file_rewrite rewrite = {
+        .storage = storage, .map = map,
+
+        .first = first, .position = start,
+
+        .data = NULL, .data_left = 0, .write_end = end,
+
+        .removed = {}, .removed_start = start, .removed_end = start,
+
+        .next_old = first, .reader_position = end,
+
+        .added = extents,
+
+        .window = NULL, .window_size = 0
+    };
+
+    while (rewrite.removed_end < end && rewrite.next_old.index != map->used)
+        rewrite.remove_next_old();
+
+    rewrite.commit();
+
+    for (block_ref ref: rewrite.removed)
+        if (ref.id != HOLE_BLOCK_ID)
+            storage->blocks.release_block(ref.id);
+}
+
+
+// Write-ahead log that's replayed on top of a restored image
+struct log_replay {
+    file_storage* storage;
+    image_restore* restore;
+
+    size_t records; // That were applied
+};
+
+template <typename T>
+static bool log_get(const char** in, const char* end, T* value) {
+    if ((size_t) (end - *in) < sizeof(*value))
+        return false;
+
+    memcpy(value, *in, sizeof(*value));
+    *in += sizeof(*value);
+    return true;
+}
+
+static stack_trace* log_replay_write(file_storage* storage, file* target_file, const char* record, size_t size) {
+    const char* in = record;
+    const char* const end = record + size;
+
+    log_write header;
+    if (!log_get(&in, end, &header))
+        return FAILURE(RUNTIME_ERROR, "Record of write is cut short!");
+
+    std::vector<extent> extents;
+    for (uint32_t i = 0; i < header.extent_count; ++ i) {
+        log_extent current;
+        if (!log_get(&in, end, &current) || current.count == 0 ||
+            current.size == 0 || (current.block != LOG_HOLE && current.size > storage->blocks.block_size))
+            return FAILURE(RUNTIME_ERROR, "Extent %u of write is damaged!", i);
+
+        block_id_t id = HOLE_BLOCK_ID;
+        size_t references = 0;
+
+        if (current.block != LOG_HOLE) {
+            hash_t hash;
+            if (!log_get(&in, end, &hash))
+                return FAILURE(RUNTIME_ERROR, "Extent %u of write is cut short!", i);
+
+            if (current.block == LOG_NEW_BLOCK) {
+                if ((size_t) (end - in) < current.size)
+                    return FAILURE(RUNTIME_ERROR, "Payload of extent %u is cut short!", i);
+
+                id = storage->blocks.get_hashed_block(hash, in, current.size);
+                in += current.size;
+
+                references = current.count - 1;
+            } else {
+                id = storage->blocks.find_hashed_block(hash, current.size);
+                if (id == linked_list_end_index)
+                    return FAILURE(RUNTIME_ERROR, "Block of extent %u is missing!", i);
+
+                references = current.count;
+            }
+        }
+
+        if (references != 0)
+            storage->blocks.acquire_block(id, references);
+
+        extents.push_back({ current.offset, current.size, id, current.count });
+    }
+
+    // Same as file_write does it
+    if (header.offset > target_file->size)
+        file_truncate(storage, target_file, header.offset);
+
+    file_replace_blocks(storage, target_file, header.replaced_start, header.replaced_end, extents);
+    target_file->size = std::max(target_file->size, (size_t) header.end);
+
+    return SUCCESS();
+}
+
+static stack_trace* log_replay_record(void* context, uint64_t sequence, const char* record, size_t size) {
+    log_replay* replay = (log_replay*) context;
+    file_storage* storage = replay->storage;
+
+    if (sequence <= replay->restore->log_sequence)
+        return SUCCESS(); // Image has it already
+
+    const char* in = record;
+    const char* const end = record + size;
+
+    log_file header;
+    if (!log_get(&in, end, &header))
+        return FAILURE(RUNTIME_ERROR, "Record is cut short!");
+
+    // Files are known by indices they had when records were made
+    auto& files = replay->restore->files;
+
+    auto renamed = files.find(header.index);
+    const element_index_t file_index = renamed != files.end() ? renamed->second : linked_list_end_index;
+
+    file* target_file = file_storage_get_file(storage, file_index);
+
+    switch (header.kind) {
+    case LOG_ADD_FILE: {
+        log_add_file added;
+        in = record;
+        if (!log_get(&in, end, &added))
+            return FAILURE(RUNTIME_ERROR, "Record of new file is cut short!");
+
+        auto parent = files.find(added.parent);
+        file* parent_file = parent != files.end() ? file_storage_get_file(storage, parent->second) : NULL;
+
+        const std::string name(in, end);
+        if (!parent_file || !parent_file->children || parent_file->unlinked || name.empty() ||
+            file_storage_find_file(storage, parent->second, name.c_str()) != linked_list_end_index)
+            return FAILURE(RUNTIME_ERROR, "File \"%s\" can't be added!", name.c_str());
+
+        files[added.index] = file_storage_add_file(storage, parent->second, name.c_str(),
+                                                   added.mode, added.uid, added.gid);
+    } break;
+
+    case LOG_UNLINK_FILE:
+        if (!target_file || target_file->unlinked || file_index == ROOT_FILE_INDEX)
+            return FAILURE(RUNTIME_ERROR, "Unlinked file %d is missing!", header.index);
+
+        // It could still be open, and then changed by later records
+        file_storage_remember_file(target_file);
+        file_storage_unlink_file(storage, file_index);
+        break;
+
+    case LOG_TRUNCATE: {
+        log_truncate truncated;
+        in = record;
+        if (!log_get(&in, end, &truncated) || !target_file || target_file->children)
+            return FAILURE(RUNTIME_ERROR, "Truncated file %d is missing!", header.index);
+
+        file_truncate(storage, target_file, truncated.size);
+    } break;
+
+    case LOG_WRITE:
+        if (!target_file || target_file->children)
+            return FAILURE(RUNTIME_ERROR, "Written file %d is missing!", header.index);
+
+        TRY log_replay_write(storage, target_file, record, size)
+            FAIL("Can't replay write to file %d!", header.index);
+        break;
+
+    default:
+        return FAILURE(RUNTIME_ERROR, "Unknown record kind %d!", header.kind);
+    }
+
+    ++ replay->records;
+    return SUCCESS();
+}
+
+// Applies changes from write-ahead log at /path/ (if it's there) on top of
+// image restored with /restore/, or on top of an empty storage. Unlinked
+// files are then deleted, nobody can have them open anymore. /last/ is
+// the number of the last record that storage has
+stack_trace* file_storage_replay(file_storage* storage, const char* path, image_restore* restore,
+                                 uint64_t* last) {
+    const auto start = std::chrono::steady_clock::now();
+
+    log_replay replay = { .storage = storage, .restore = restore, .records = 0 };
+
+    *last = restore->log_sequence;
+    if (access(path, F_OK) == 0)
+        TRY wal_replay(path, log_replay_record, &replay, last)
+            FAIL("Can't replay \"%s\"!", path);
+
+    // Log could only have records that image has
+    *last = std::max(*last, restore->log_sequence);
+
+    std::vector<element_index_t> unlinked;
+    LINKED_LIST_TRAVERSE(&storage->files, file, current)
+        if (current->unlinked)
+            unlinked.push_back(linked_list_get_index(&storage->files, current));
+
+    for (element_index_t file_index: unlinked)
+        file_storage_forget_file(storage, file_index, file_storage_get_file(storage, file_index)->lookups);
+
+    const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    LOG_INFO("replayed %zu records from \"%s\" in %.2fs", replay.records, path, took.count());
+
+    return SUCCESS();
+}
+
+static file_storage storage;
+static wal write_log; // It's storage.log with -o wal
+
+// static void read_and_shift(char** dest, const char* src, size_t offset, size_t size) {
+//     memcpy(*dest, src + offset, size);
+// }
+
+
+// How long kernel can trust attributes, names and missing names it got
+// from us, in seconds. Every change reaches dedfs through the kernel, which
+// drops whatever it cached about the files that change, so these can be long
+struct cache_timeouts {
+    double attr, entry, negative;
+};
+
+static cache_timeouts timeouts = { .attr = 60.0, .entry = 60.0, .negative = 60.0 };
+
+// Inode of a file is its index in file_storage::files, root comes first there
+static_assert(ROOT_FILE_INDEX == FUSE_ROOT_ID);
+
+static fuse_ino_t file_inode(element_index_t file_index) {
+    return (fuse_ino_t) file_index;
+}
+
+static element_index_t inode_file(fuse_ino_t inode) {
+    // Inodes that can't be files map to the invalid index
+    return inode <= (fuse_ino_t) INT32_MAX ? (element_index_t) inode : linked_list_end_index;
+}
+
+// Should be called with file locked
+static void file_attributes(element_index_t file_index, file* target_file, struct stat* st) {
+    *st = {};
+
+    st->st_ino = file_inode(file_index);
+
+    st->st_mode = target_file->mode;
+    st->st_uid = target_file->uid;
+    st->st_gid = target_file->gid;
+
+    st->st_atim = target_file->atime;
+    st->st_mtim = target_file->mtime;
+    st->st_ctim = target_file->ctime;
+
+    st->st_size = target_file->size;
+
+    if (target_file->unlinked)
+        st->st_nlink = 0;
+    else if (target_file->children)
+        st->st_nlink = 2 + target_file->children->subdirectories; // Why "two" hardlinks instead of "one"? The answer is here: http://unix.stackexchange.com/a/101536
+    else
+        st->st_nlink = 1;
+}
+
+// Replies with the entry of a file, that counts as kernel's lookup of it.
+// Should be called with /files_lock/ held
+static void reply_file_entry(fuse_req_t request, element_index_t file_index) {
+    file* target_file = file_storage_get_file(&storage, file_index);
+
+    fuse_entry_param entry = {
+        .ino = file_inode(file_index), .generation = 0, .attr = {},
+        .attr_timeout = timeouts.attr, .entry_timeout = timeouts.entry
+    };
+
+    pthread_rwlock_rdlock(file_storage_file_lock(&storage, file_index));
+    file_attributes(file_index, target_file, &entry.attr);
+    pthread_rwlock_unlock(file_storage_file_lock(&storage, file_index));
+
+    file_storage_remember_file(target_file);
+    fuse_reply_entry(request, &entry);
+}
+
+// Directory with inode /parent/, should be called with /files_lock/ held.
+// NULL (and error is stored in /error/) if it isn't there or isn't a directory
+static file* find_directory(fuse_ino_t parent, int* error) {
+    file* directory_file = file_storage_get_file(&storage, inode_file(parent));
+
+    if (!directory_file || directory_file->unlinked)
+        *error = ENOENT;
+    else if (!directory_file->children)
+        *error = ENOTDIR;
+    else
+        return directory_file;
+
+    return nullptr;
+}
+
+static void do_lookup(fuse_req_t request, fuse_ino_t parent, const char* name) {
+    LOG_TRACE("do_lookup: %lu/%s", parent, name);
+
+    pthread_rwlock_rdlock(&storage.files_lock);
+
+    int error = ENOENT;
+    element_index_t file_index = linked_list_end_index;
+
+    if (find_directory(parent, &error))
+        file_index = file_storage_find_file(&storage, inode_file(parent), name);
+
+    if (file_index != linked_list_end_index)
+        reply_file_entry(request, file_index);
+    else if (error == ENOENT) {
+        // Entry with no inode lets kernel remember that the name isn't there
+        fuse_entry_param entry = {
+            .ino = 0, .generation = 0, .attr = {},
+            .attr_timeout = 0, .entry_timeout = timeouts.negative
+        };
+
+        fuse_reply_entry(request, &entry);
+    } else
+        fuse_reply_err(request, error);
+
+    pthread_rwlock_unlock(&storage.files_lock);
+}
+
+static void do_forget(fuse_req_t request, fuse_ino_t inode, unsigned long lookups) {
+    LOG_TRACE("do_forget: %lu, lookups: %lu", inode, lookups);
+
+    if (inode != FUSE_ROOT_ID)
+        file_storage_forget_file(&storage, inode_file(inode), lookups);
+
+    fuse_reply_none(request);
+}
+
+static void do_getattr(fuse_req_t request, fuse_ino_t inode, fuse_file_info*) {
+    LOG_TRACE("do_getattr: %lu", inode);
+
+    file* target_file = file_storage_lock_file(&storage, inode_file(inode), false);
+    if (!target_file) {
+        fuse_reply_err(request, ENOENT);
+        return;
+    }
+
+    struct stat st;
+    file_attributes(inode_file(inode), target_file, &st);
+
+    file_storage_unlock_file(&storage, target_file);
+    fuse_reply_attr(request, &st, timeouts.attr);
+}
+
+static void do_setattr(fuse_req_t request, fuse_ino_t inode, struct stat* attributes,
+                       int to_set, fuse_file_info*) {
+    LOG_TRACE("do_setattr: %lu, fields: %#x", inode, to_set);
+
+    file* target_file = file_storage_lock_file(&storage, inode_file(inode), true);
+    if (!target_file) {
+        fuse_reply_err(request, ENOENT);
+        return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+        target_file->mode = (target_file->mode & S_IFMT) | (attributes->st_mode & 07777);
+
+    if (to_set & FUSE_SET_ATTR_UID) target_file->uid = attributes->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID) target_file->gid = attributes->st_gid;
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        file_truncate(&storage, target_file, (size_t) attributes->st_size);
+        file_touch(target_file, FILE_MTIME);
+
+        if (storage.log)
+            file_storage_log_truncate(&storage, inode_file(inode), (size_t) attributes->st_size);
+    }
+
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        file_touch(target_file, FILE_ATIME);
+    else if (to_set & FUSE_SET_ATTR_ATIME)
+        target_file->atime = attributes->st_atim;
+
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        file_touch(target_file, FILE_MTIME);
+    else if (to_set & FUSE_SET_ATTR_MTIME)
+        target_file->mtime = attributes->st_mtim;
+
+    file_touch(target_file, FILE_CTIME);
+
+    struct stat st;
+    file_attributes(inode_file(inode), target_file, &st);
+
+    file_storage_unlock_file(&storage, target_file);
+
+    // Cutting a file can add a block for the part of the last one that's left
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        file_storage_enforce_budget(&storage);
+
+    fuse_reply_attr(request, &st, timeouts.attr);
+}
+
+static void do_read(fuse_req_t request, fuse_ino_t inode, size_t size, off_t offset, fuse_file_info*) {
+    LOG_TRACE("do_read: %lu, size: %zu, offset: %jd", inode, size, (intmax_t) offset);
+
+    file* target_file = file_storage_lock_file(&storage, inode_file(inode), false);
+    if (!target_file) {
+        fuse_reply_err(request, ENOENT);
+        return;
+    }
+
+    // Reply refers to block payloads, so file stays locked until it's sent
+    fuse_bufvec* reply = file_read_buf(&storage, target_file, size, offset);
+    if (reply)
+        fuse_reply_data(request, reply, FUSE_BUF_SPLICE_MOVE);
+    else
+        fuse_reply_err(request, ENOMEM);
+
+    file_storage_unlock_file(&storage, target_file);
+    free(reply);
+}
+
+// Data of writes that arrive spliced into a pipe is read here, buffer is
+// reused by all writes of the thread instead of being allocated for each
+static thread_local std::vector<char> write_scratch;
+
+static void do_write_buf(fuse_req_t request, fuse_ino_t inode, fuse_bufvec* buffers,
+                         off_t offset, fuse_file_info*) {
+    size_t size = fuse_buf_size(buffers);
+    LOG_TRACE("do_write_buf: %lu, size: %zu, offset: %jd", inode, size, (intmax_t) offset);
+
+    // Data that's already in memory is fingerprinted right where it is,
+    // only payloads of new blocks are ever copied out of it
+    const char* data = (const char*) buffers->buf[0].mem;
+
+    if (buffers->count != 1 || (buffers->buf[0].flags & FUSE_BUF_IS_FD)) {
+        if (write_scratch.size() < size)
+            write_scratch.resize(size);
+
+        fuse_bufvec scratch = FUSE_BUFVEC_INIT(size);
+        scratch.buf[0].mem = write_scratch.data();
+
+        ssize_t copied = fuse_buf_copy(&scratch, buffers, (fuse_buf_copy_flags) 0);
+        if (copied < 0) {
+            fuse_reply_err(request, (int) -copied);
+            return;
+        }
+
+        data = write_scratch.data();
+        size = (size_t) copied;
+    }
+
+    file* target_file = file_storage_lock_file(&storage, inode_file(inode), true);
+    if (!target_file) {
+        fuse_reply_err(request, ENOENT);
+        return;
+    }
+
+    file_write(&storage, data, size, offset, target_file);
+    file_touch(target_file, FILE_MTIME | FILE_CTIME);
+
+    file_storage_unlock_file(&storage, target_file);
+
+    // Write isn't acknowledged before memory it took is back within the budget
+    file_storage_enforce_budget(&storage);
+    fuse_reply_write(request, size);
+}
+
+// Changes are durable once records of them in write-ahead log are, without
+// the log they're only saved with the image, so there's nothing to wait for
+static void do_fsync(fuse_req_t request, fuse_ino_t inode, int, fuse_file_info*) {
+    LOG_TRACE("do_fsync: %lu", inode);
+
+    bool is_durable = !storage.log || wal_wait(storage.log, wal_sequence(storage.log));
+    fuse_reply_err(request, is_durable ? 0 : EIO);
+}
+
+static void do_opendir(fuse_req_t request, fuse_ino_t inode, fuse_file_info* info) {
+    LOG_TRACE("do_opendir: %lu", inode);
+
+    pthread_rwlock_rdlock(&storage.files_lock);
+
+    file* directory_file = file_storage_get_file(&storage, inode_file(inode));
+    if (directory_file && directory_file->children)
+        __atomic_add_fetch(&directory_file->children->listings, 1, __ATOMIC_ACQ_REL);
+
+    pthread_rwlock_unlock(&storage.files_lock);
+
+    if (!directory_file || !directory_file->children)
+        fuse_reply_err(request, directory_file ? ENOTDIR : ENOENT);
+    else
+        fuse_reply_open(request, info);
+}
+
+static void do_releasedir(fuse_req_t request, fuse_ino_t inode, fuse_file_info*) {
+    LOG_TRACE("do_releasedir: %lu", inode);
+
+    pthread_rwlock_rdlock(&storage.files_lock);
+
+    // Kernel keeps directory looked up while it's open, so it's still there
+    file* directory_file = file_storage_get_file(&storage, inode_file(inode));
+    __atomic_sub_fetch(&directory_file->children->listings, 1, __ATOMIC_ACQ_REL);
+
+    pthread_rwlock_unlock(&storage.files_lock);
+    fuse_reply_err(request, 0);
+}
+
+// Appends entry to the reply if there's room for it, /cookie/ is
+// entry's position in the listing, next part starts after it
+static bool add_directory_entry(fuse_req_t request, std::vector<char>* reply, size_t size,
+                                const char* name, fuse_ino_t inode, mode_t mode, uint64_t cookie) {
+    struct stat st = {};
+    st.st_ino  = inode;
+    st.st_mode = mode;
+
+    size_t start = reply->size();
+    size_t entry_size = fuse_add_direntry(request, NULL, 0, name, NULL, 0);
+    if (start + entry_size > size)
+        return false;
+
+    reply->resize(start + entry_size);
+    fuse_add_direntry(request, reply->data() + start, entry_size, name, &st, (off_t) cookie);
+    return true;
+}
+
+static void do_readdir(fuse_req_t request, fuse_ino_t inode, size_t size, off_t offset, fuse_file_info*) {
+    LOG_TRACE("do_readdir: %lu, offset: %jd", inode, (intmax_t) offset);
+
+    pthread_rwlock_rdlock(&storage.files_lock);
+
+    file* directory_file = file_storage_get_file(&storage, inode_file(inode));
+    if (!directory_file || !directory_file->children) {
+        pthread_rwlock_unlock(&storage.files_lock);
+        fuse_reply_err(request, directory_file ? ENOTDIR : ENOENT);
+        return;
+    }
+
+    // Removed directory doesn't have a parent anymore
+    element_index_t parent = directory_file->unlinked ? inode_file(inode) : directory_file->parent;
+
+    std::vector<char> reply;
+    reply.reserve(size);
+
+    bool has_room = true;
+    if (offset < 1)
+        has_room = add_directory_entry(request, &reply, size,  ".", inode, S_IFDIR, 1);
+    if (offset < 2 && has_room)
+        has_room = add_directory_entry(request, &reply, size, "..", file_inode(parent), S_IFDIR, 2);
+
+    // Listing continues right after the position of the last returned child
+    const std::vector<element_index_t>& entries = directory_file->children->entries;
+
+    size_t position = (uint64_t) offset < DIRECTORY_FIRST_COOKIE ? 0 : offset - DIRECTORY_FIRST_COOKIE + 1;
+    for (; position < entries.size() && has_room; ++ position) {
+        if (entries[position] == linked_list_end_index)
+            continue; // Removed
+
+        file* child_file = file_storage_get_file(&storage, entries[position]);
+        has_room = add_directory_entry(request, &reply, size, child_file->name,
+                                       file_inode(entries[position]), child_file->mode & S_IFMT,
+                                       DIRECTORY_FIRST_COOKIE + position);
+    }
+
+    pthread_rwlock_unlock(&storage.files_lock);
+    fuse_reply_buf(request, reply.data(), reply.size());
+}
+
+// Adds a file or a directory, /mode/ tells which one. It's owned by whoever asked for it
+static void make_file(fuse_req_t request, fuse_ino_t parent, const char* name, mode_t mode) {
+    const fuse_ctx* context = fuse_req_ctx(request);
+
+    pthread_rwlock_wrlock(&storage.files_lock);
+
+    int error;
+    if (!find_directory(parent, &error))
+        fuse_reply_err(request, error);
+    else if (file_storage_find_file(&storage, inode_file(parent), name) != linked_list_end_index)
+        fuse_reply_err(request, EEXIST);
+    else
+        reply_file_entry(request, file_storage_add_file(&storage, inode_file(parent), name, mode,
+                                                        context->uid, context->gid));
+
+    pthread_rwlock_unlock(&storage.files_lock);
+}
+
+static void do_mknod(fuse_req_t request, fuse_ino_t parent, const char* name, mode_t mode, dev_t) {
+    LOG_TRACE("do_mknod: %lu/%s", parent, name);
+
+    // Only regular files can be stored
+    if ((mode & S_IFMT) != 0 && !S_ISREG(mode)) {
+        fuse_reply_err(request, EPERM);
+        return;
+    }
+
+    make_file(request, parent, name, S_IFREG | (mode & 07777));
+}
+
+static void do_mkdir(fuse_req_t request, fuse_ino_t parent, const char* name, mode_t mode) {
+    LOG_TRACE("do_mkdir: %lu/%s", parent, name);
+    make_file(request, parent, name, S_IFDIR | (mode & 07777));
+}
+
+// Removes a file or a directory, depending on /directory/
+static void remove_file(fuse_req_t request, fuse_ino_t parent, const char* name, bool directory) {
+    pthread_rwlock_wrlock(&storage.files_lock);
+
+    int error = 0;
+    element_index_t file_index = linked_list_end_index;
+
+    if (find_directory(parent, &error))
+        file_index = file_storage_find_file(&storage, inode_file(parent), name);
+
+    if (file* target_file = file_storage_get_file(&storage, file_index)) {
+        if (directory && !target_file->children)
+            error = ENOTDIR;
+        else if (!directory && target_file->children)
+            error = EISDIR;
+        else if (directory && target_file->children->entries.size() != target_file->children->removed)
+            error = ENOTEMPTY;
+        else
+            file_storage_unlink_file(&storage, file_index);
+    } else if (error == 0)
+        error = ENOENT;
+
+    pthread_rwlock_unlock(&storage.files_lock);
+    fuse_reply_err(request, error);
+}
+
+static void do_unlink(fuse_req_t request, fuse_ino_t parent, const char* name) {
+    LOG_TRACE("do_unlink: %lu/%s", parent, name);
+    remove_file(request, parent, name, false);
+}
+
+static void do_rmdir(fuse_req_t request, fuse_ino_t parent, const char* name) {
+    LOG_TRACE("do_rmdir: %lu/%s", parent, name);
+    remove_file(request, parent, name, true);
+}
+
+
+// Seconds between passes of a background thread that compresses blocks
+// that weren't read since the previous one, compression is off if it's zero
+static double compress_after = 0;
+
+static std::thread compressor;
+static std::mutex compressor_lock;
+static std::condition_variable compressor_wake_up;
+static bool compressor_stop = false;
+
+static void compressor_loop() {
+    const auto interval = std::chrono::duration<double>(compress_after);
+
+    std::unique_lock<std::mutex> guard(compressor_lock);
+    while (!compressor_wake_up.wait_for(guard, interval, [] { return compressor_stop; })) {
+        guard.unlock();
+        file_storage_compress_cold_blocks(&storage);
+        guard.lock();
+    }
+}
+
+// Storage is restored from this image on mount (if it's there) and saved
+// to it on unmount and whenever SIGUSR1 comes, NULL if there's no image
+static char* image_path = NULL;
+
+static std::thread snapshotter;
+static bool snapshotter_stop = false; // Changed atomically
+
+static void save_image() {
+    TRY file_storage_save(&storage, image_path)
+        CATCH({
+            LOG_ERROR("can't save image to \"%s\"", image_path);
+
+            trace_print_stack_trace(stderr, __trace);
+            trace_destruct(__trace);
+        });
+}
+
+// SIGUSR1 is blocked in every thread, this one picks it up
+static void snapshotter_loop() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    int signal;
+    while (sigwait(&signals, &signal) == 0 && !__atomic_load_n(&snapshotter_stop, __ATOMIC_ACQUIRE))
+        save_image();
+}
+
+static void do_init(void*, fuse_conn_info* connection) {
+    // Writer thread is started here, since session
+    // is daemonized before it gets to handle init
+    log_start(stderr);
+
+    // Replies of read can then be spliced from block payloads
+    connection->want |= connection->capable & FUSE_CAP_SPLICE_WRITE;
+
+    // Same as log writer, it wouldn't survive daemonization
+    if (compress_after > 0)
+        compressor = std::thread(compressor_loop);
+
+    if (image_path)
+        snapshotter = std::thread(snapshotter_loop);
+
+    if (storage.log)
+        wal_start(storage.log);
+
+    LOG_INFO("mounted with %s chunking, block size: %zu, fingerprint: %s, verify: %s, "
+             "compress after: %gs, max mem: %zu, image: %s",
+             storage.chunking == CHUNKING_CDC ? "content defined" : "fixed",
+             storage.blocks.block_size, fingerprint_backend_name(storage.blocks.hasher.backend),
+             storage.blocks.verify ? "on" : "off", compress_after, storage.blocks.max_mem,
+             image_path ? image_path : "none");
+}
+
+static void do_destroy(void*) {
+    if (compressor.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(compressor_lock);
+            compressor_stop = true;
+        }
+
+        compressor_wake_up.notify_one();
+        compressor.join();
+    }
+
+    if (snapshotter.joinable()) {
+        __atomic_store_n(&snapshotter_stop, true, __ATOMIC_RELEASE);
+
+        pthread_kill(snapshotter.native_handle(), SIGUSR1);
+        snapshotter.join();
+    }
+
+    if (image_path)
+        save_image();
+
+    // Log is empty unless image couldn't be saved
+    if (storage.log)
+        wal_close(storage.log);
+
+    LOG_INFO("unmounted");
+    log_stop();
+}
+
+
+static const fuse_lowlevel_ops dedfs_operations = {
+    .init		= do_init,
+    .destroy	= do_destroy,
+    .lookup		= do_lookup,
+    .forget		= do_forget,
+    .getattr	= do_getattr,
+    .setattr	= do_setattr,
+    .mknod		= do_mknod,
+    .mkdir		= do_mkdir,
+    .unlink		= do_unlink,
+    .rmdir		= do_rmdir,
+    .read		= do_read,
+    .fsync		= do_fsync,
+    .opendir	= do_opendir,
+    .readdir	= do_readdir,
+    .releasedir	= do_releasedir,
+    .fsyncdir	= do_fsync,
+    .write_buf	= do_write_buf,
+};
+
+
+// Spill files are created here unless -o spill_dir says otherwise
+static const char* const DEFAULT_SPILL_DIR = "/var/tmp";
+
+struct dedfs_options {
+    size_t block_size;
+    int verify;
+
+    int fingerprint; // One of fingerprint_backend
+
+    int log_level; // One of log_level
+
+    int chunking; // One of chunking_mode
+    size_t cdc_min, cdc_avg, cdc_max;
+
+    double attr_timeout, entry_timeout, negative_timeout;
+
+    double compress_after;
+
+    char* max_mem;   // Size, can end with K, M, G or T
+    char* spill_dir; // Where payloads over max_mem go
+
+    char* image; // Saved on unmount, restored on mount
+    char* wal;   // Changes since the image was saved
+};
+
+#define DEDFS_OPTION(templ, field, value) { templ, offsetof(dedfs_options, field), value }
+
+static const fuse_opt dedfs_option_spec[] = {
+    DEDFS_OPTION("block_size=%zu", block_size, 0),
+    DEDFS_OPTION("verify", verify, true),
+
+    DEDFS_OPTION("fingerprint=murmur3", fingerprint, FINGERPRINT_MURMUR3),
+    DEDFS_OPTION("fingerprint=crc32c",  fingerprint, FINGERPRINT_CRC32C),
+    DEDFS_OPTION("fingerprint=xxh",     fingerprint, FINGERPRINT_XXH),
+
+    DEDFS_OPTION("log_level=trace",   log_level, LOG_LEVEL_TRACE),
+    DEDFS_OPTION("log_level=debug",   log_level, LOG_LEVEL_DEBUG),
+    DEDFS_OPTION("log_level=info",    log_level, LOG_LEVEL_INFO),
+    DEDFS_OPTION("log_level=warning", log_level, LOG_LEVEL_WARNING),
+    DEDFS_OPTION("log_level=error",   log_level, LOG_LEVEL_ERROR),
+    DEDFS_OPTION("log_level=none",    log_level, LOG_LEVEL_NONE),
+
+    DEDFS_OPTION("chunking=fixed", chunking, CHUNKING_FIXED),
+    DEDFS_OPTION("chunking=cdc",   chunking, CHUNKING_CDC),
+
+    DEDFS_OPTION("cdc_min=%zu", cdc_min, 0),
+    DEDFS_OPTION("cdc_avg=%zu", cdc_avg, 0),
+    DEDFS_OPTION("cdc_max=%zu", cdc_max, 0),
+
+    DEDFS_OPTION("attr_timeout=%lf",  attr_timeout,  0),
+    DEDFS_OPTION("entry_timeout=%lf", entry_timeout, 0),
+    DEDFS_OPTION("negative_timeout=%lf", negative_timeout, 0),
+
+    DEDFS_OPTION("compress_after=%lf", compress_after, 0),
+
+    DEDFS_OPTION("max_mem=%s",   max_mem,   0),
+    DEDFS_OPTION("spill_dir=%s", spill_dir, 0),
+
+    DEDFS_OPTION("image=%s", image, 0),
+    DEDFS_OPTION("wal=%s",   wal,   0),
+
+    FUSE_OPT_END
+};
+
+// Parses a number of bytes with an optional binary suffix, like "512M"
+static bool parse_size(const char* text, size_t* size) {
+    char* suffix;
+    errno = 0;
+    unsigned long long value = strtoull(text, &suffix, 10);
+    if (errno != 0 || suffix == text || text[0] == '-')
+        return false;
+
+    const char* units = "KMGT";
+    if (*suffix != '\0') {
+        const char* unit = strchr(units, toupper(*suffix));
+        if (!unit || suffix[1] != '\0')
+            return false;
+
+        for (const char* scale = units; scale <= unit; ++ scale) {
+            if (value > ULLONG_MAX / 1024)
+                return false;
+
+            value *= 1024;
+        }
+    }
+
+    *size = (size_t) value;
+    return true;
+}
+
+static bool is_valid_block_size(size_t block_size) {
+    bool is_power_of_two = (block_size & (block_size - 1)) == 0;
+    return is_power_of_two && MIN_BLOCK_SIZE <= block_size && block_size <= MAX_BLOCK_SIZE;
+}
+
+int main(int argc, char* argv[]) {
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    dedfs_options options = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .verify = false,
+
+        .fingerprint = FINGERPRINT_MURMUR3,
+
+        .log_level = LOG_LEVEL_INFO,
+
+        .chunking = CHUNKING_FIXED,
+        .cdc_min = DEFAULT_CDC_MIN_SIZE, .cdc_avg = DEFAULT_CDC_AVG_SIZE,
+        .cdc_max = DEFAULT_CDC_MAX_SIZE,
+
+        .attr_timeout = timeouts.attr, .entry_timeout = timeouts.entry,
+        .negative_timeout = timeouts.negative,
+
+        .compress_after = compress_after,
+
+        .max_mem = NULL, .spill_dir = NULL,
+
+        .image = NULL, .wal = NULL
+    };
+
+    if (fuse_opt_parse(&args, &options, dedfs_option_spec, NULL) == -1)
+        return EXIT_FAILURE;
+
+    if (!is_valid_block_size(options.block_size)) {
+        fprintf(stderr, "dedfs: block_size should be a power of two between %zu and %zu, got %zu\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, options.block_size);
+        return EXIT_FAILURE;
+    }
+
+    if (options.compress_after < 0) {
+        fprintf(stderr, "dedfs: compress_after can't be negative, got %g\n", options.compress_after);
+        return EXIT_FAILURE;
+    }
+
+    size_t max_mem = 0;
+    if (options.max_mem && (!parse_size(options.max_mem, &max_mem) || max_mem == 0)) {
+        fprintf(stderr, "dedfs: max_mem should be a positive size, like 512M, got \"%s\"\n",
+                options.max_mem);
+        return EXIT_FAILURE;
+    }
+
+    if (options.chunking == CHUNKING_CDC) {
+        if (!is_valid_cdc_max_size(options.cdc_max)) {
+            fprintf(stderr, "dedfs: cdc_max should be between %zu and %zu, got %zu\n",
+                    MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, options.cdc_max);
+            return EXIT_FAILURE;
+        }
+
+        cdc_chunker chunker;
+        TRY cdc_chunker_create(&chunker, options.cdc_min, options.cdc_avg, options.cdc_max)
+            THROW("Invalid content defined chunking parameters!");
+
+        file_storage_create(&storage, options.block_size, &chunker);
+    } else
+        file_storage_create(&storage, options.block_size);
+
+    storage.blocks.verify = options.verify;
+
+    TRY storage.blocks.set_fingerprint_backend((fingerprint_backend) options.fingerprint)
+        THROW("Can't set up block fingerprinting!");
+
+    log_set_level((log_level) options.log_level);
+
+    // Log only has what changed since the image was saved
+    if (options.wal && !options.image) {
+        fprintf(stderr, "dedfs: wal needs an image to be saved to, see -o image\n");
+        return EXIT_FAILURE;
+    }
+
+    // Image's own block size, chunking and fingerprints take over
+    image_path = options.image;
+    image_restore restore = { .files = { { ROOT_FILE_INDEX, ROOT_FILE_INDEX } }, .log_sequence = 0 };
+
+    bool restored = image_path && access(image_path, F_OK) == 0;
+    if (restored)
+        TRY file_storage_load(&storage, image_path, options.wal ? &restore : NULL)
+            THROW("Can't restore storage from \"%s\"!", image_path);
+
+    // CRC is linear, so blocks that collide on it are easy to make, only
+    // verify mode keeps them apart. Image could have brought this backend too
+    if (storage.blocks.hasher.backend == FINGERPRINT_CRC32C && !storage.blocks.verify) {
+        fprintf(stderr, "dedfs: fingerprint=crc32c needs -o verify, blocks that collide would be merged\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.wal) {
+        uint64_t last;
+        TRY file_storage_replay(&storage, options.wal, &restore, &last)
+            THROW("Can't replay changes from \"%s\"!", options.wal);
+
+        struct stat log_stat;
+        const bool has_records = stat(options.wal, &log_stat) == 0 && log_stat.st_size != 0;
+
+        TRY wal_open(&write_log, options.wal, last)
+            THROW("Can't open write-ahead log \"%s\"!", options.wal);
+
+        storage.log = &write_log;
+
+        // Replayed changes go to a new image, so log can start over
+        if (has_records) {
+            TRY file_storage_save(&storage, image_path)
+                THROW("Can't save replayed changes to \"%s\"!", image_path);
+
+            restored = true;
+        }
+
+        free(options.wal);
+    }
+
+    if (max_mem != 0) {
+        const char* spill_dir = options.spill_dir ? options.spill_dir : DEFAULT_SPILL_DIR;
+
+        TRY storage.blocks.enable_spill(spill_dir, max_mem)
+            THROW("Can't spill blocks to \"%s\"!", spill_dir);
+
+        if (restored)
+            file_storage_enforce_budget(&storage);
+    }
+
+    free(options.max_mem);
+    free(options.spill_dir);
+
+    compress_after = options.compress_after;
+
+    timeouts = { .attr = options.attr_timeout, .entry = options.entry_timeout,
+                 .negative = options.negative_timeout };
+
+    char* mountpoint = NULL;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || !mountpoint) {
+        fprintf(stderr, "dedfs: usage: %s mountpoint [options]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    if (fuse_chan* channel = fuse_mount(mountpoint, &args)) {
+        if (fuse_session* session = fuse_lowlevel_new(&args, &dedfs_operations,
+                                                      sizeof(dedfs_operations), NULL)) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                fuse_session_add_chan(session, channel);
+
+                // Saving image on demand is left to a thread that waits for it
+                if (image_path) {
+                    sigset_t signals;
+                    sigemptyset(&signals);
+                    sigaddset(&signals, SIGUSR1);
+                    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+                }
+
+                fuse_daemonize(foreground);
+                status = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+
+                fuse_session_remove_chan(channel);
+                fuse_remove_signal_handlers(session);
+            }
+
+            fuse_session_destroy(session);
+        }
+
+        fuse_unmount(mountpoint, channel);
+    }
 
-    setvbuf(stdout, NULL, _IONBF, 0);
-    return fuse_main(argc, argv, &dedfs_operations, NULL);
+    free(mountpoint);
+    free(image_path);
+    fuse_opt_free_args(&args);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
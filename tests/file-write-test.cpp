@@ -0,0 +1,201 @@
+// Random writes at any offset (past the end too, leaving holes), truncates
+// that grow and shrink files, and reads, for several files at once, checked
+// against plain byte vectors. Runs with fixed blocks and content defined
+// chunking, with and without verify. After every step the touched file's
+// extents should cover it without gaps, and every block should be
+// referenced exactly as many times as extents of all files refer to it.
+
+// main.cpp is one translation unit, it's built into the test with its main() renamed
+#define main dedfs_main
+#include "main.cpp"
+#undef main
+
+#include <map>
+#include <random>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, size_t step) {
+    if (!condition) {
+        fprintf(stderr, "file-write-test: %s (step %zu)\n", what, step);
+        ++ failures;
+    }
+}
+
+// Data that dedups within and across files: zeroes, short
+// repeating patterns, copies of one shared buffer and noise
+static std::vector<char> random_data(std::mt19937& random, const std::vector<char>& shared, size_t size) {
+    std::vector<char> data(size);
+
+    switch (random() % 4) {
+    case 0:
+        break; // Zeroes, same bytes as holes
+
+    case 1: {
+        const size_t period = 1 + random() % 5000;
+        for (size_t i = 0; i < size; ++ i)
+            data[i] = (char) ('a' + i % period % 26);
+        break;
+    }
+
+    case 2: {
+        const size_t start = random() % (shared.size() - size);
+        memcpy(data.data(), shared.data() + start, size);
+        break;
+    }
+
+    default:
+        for (char& byte: data)
+            byte = (char) random();
+    }
+
+    return data;
+}
+
+static void check_extents(file_storage* storage, file* target_file, size_t step) {
+    const extent_map* map = &target_file->extents;
+
+    size_t end = 0;
+    for (size_t i = 0; i < map->used; ++ i) {
+        const extent* current = &map->extents[i];
+
+        check(current->offset == end, "extents have a gap or overlap", step);
+        check(current->size != 0 && current->count != 0, "extent is empty", step);
+        check(current->id != HOLE_BLOCK_ID || current->count == 1, "hole is repeated", step);
+        check(current->id == HOLE_BLOCK_ID || current->size <= storage->blocks.block_size,
+              "extent's block is bigger than block size", step);
+        check(current->id == HOLE_BLOCK_ID || storage->blocks.get_block(current->id)->size == current->size,
+              "extent's size differs from its block", step);
+
+        end = extent_end(current);
+    }
+
+    check(end == target_file->size, "extents don't end where file does", step);
+}
+
+static void check_references(file_storage* storage, const std::vector<element_index_t>& files, size_t step) {
+    std::map<block_id_t, size_t> references;
+
+    for (element_index_t index: files) {
+        const extent_map* map = &file_storage_get_file(storage, index)->extents;
+
+        for (size_t i = 0; i < map->used; ++ i)
+            if (map->extents[i].id != HOLE_BLOCK_ID)
+                references[map->extents[i].id] += map->extents[i].count;
+    }
+
+    check(storage->blocks.block_count() == references.size(), "blocks that nobody refers to are kept", step);
+
+    for (const auto& [id, count]: references)
+        check(storage->blocks.get_block(id)->references == count, "block's reference count is wrong", step);
+}
+
+static void run(bool cdc, bool verify, uint32_t seed, size_t steps) {
+    std::mt19937 random(seed);
+    const int failures_before = failures;
+
+    file_storage* storage = new file_storage;
+    if (cdc) {
+        cdc_chunker chunker;
+        TRY cdc_chunker_create(&chunker, 2048, 4096, 8192)
+            THROW("Can't create chunker!");
+
+        file_storage_create(storage, DEFAULT_BLOCK_SIZE, &chunker);
+    } else
+        file_storage_create(storage, 4096);
+
+    storage->blocks.verify = verify;
+
+    std::vector<char> shared(1 << 20);
+    for (char& byte: shared)
+        byte = (char) random();
+
+    const size_t FILES = 4;
+    std::vector<element_index_t> files;
+    std::vector<std::vector<char>> models(FILES);
+
+    for (size_t i = 0; i < FILES; ++ i) {
+        char name[16];
+        snprintf(name, sizeof(name), "file-%zu", i);
+        files.push_back(file_storage_add_file(storage, ROOT_FILE_INDEX, name, S_IFREG | 0644, 0, 0));
+    }
+
+    for (size_t step = 0; step < steps; ++ step) {
+        const size_t which = random() % FILES;
+
+        file* target_file = file_storage_get_file(storage, files[which]);
+        std::vector<char>& model = models[which];
+
+        const uint32_t operation = random() % 8;
+        if (operation < 5) {
+            // Mostly near the end of file, where appends and holes happen
+            size_t offset = random() % 4 == 0 ? random() % (model.size() + 1)
+                                               : model.size() - std::min(model.size(), (size_t) random() % 10000)
+                                                 + random() % 20000;
+
+            size_t size = 1 + (random() % 2 == 0 ? random() % 100 : random() % 100000);
+            std::vector<char> data = random_data(random, shared, size);
+
+            file_write(storage, data.data(), data.size(), offset, target_file);
+
+            if (model.size() < offset + size)
+                model.resize(offset + size);
+
+            memcpy(model.data() + offset, data.data(), size);
+        } else if (operation < 7) {
+            size_t new_size = random() % (model.size() + 30000);
+
+            file_truncate(storage, target_file, new_size);
+            model.resize(new_size);
+        } else if (!model.empty()) {
+            // Read of a random range, it can go past the end
+            size_t offset = random() % model.size(), size = 1 + random() % 200000;
+
+            std::vector<char> buffer(size);
+            size_t read = file_read(storage, target_file, buffer.data(), size, offset);
+
+            check(read == std::min(size, model.size() - offset), "read returns wrong size", step);
+            check(memcmp(buffer.data(), model.data() + offset, read) == 0, "read returns wrong bytes", step);
+        }
+
+        check(target_file->size == model.size(), "file size differs", step);
+        check_extents(storage, target_file, step);
+
+        if (step % 16 == 0) {
+            std::vector<char> contents(model.size());
+            check(file_read(storage, target_file, contents.data(), contents.size(), 0) == model.size() &&
+                  contents == model, "file contents differ", step);
+
+            check_references(storage, files, step);
+        }
+
+        if (failures != failures_before) {
+            fprintf(stderr, "file-write-test: failed with %s chunking%s, seed %u\n",
+                    cdc ? "content defined" : "fixed", verify ? " and verify" : "", seed);
+            return; // Everything after the first failure is noise
+        }
+    }
+
+    check_references(storage, files, steps);
+
+    // Blocks are all gone along with the files
+    pthread_rwlock_wrlock(&storage->files_lock);
+    for (element_index_t index: files)
+        file_storage_unlink_file(storage, index);
+    pthread_rwlock_unlock(&storage->files_lock);
+
+    check(storage->blocks.block_count() == 0, "blocks outlive files that used them", steps);
+}
+
+int main() {
+    run(false, false, 1, 3000);
+    run(false, true,  2, 1000);
+    run(true,  false, 3, 3000);
+    run(true,  true,  4, 1000);
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("file-write-test: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+// Random inserts, deletes and lookups in "lib/hash-table" flat_hash_table,
+// checked against std::unordered_map. Tables start small, so they resize
+// many times, and operations keep coming while pairs are migrated from the
+// previous table. Hash that maps many keys to few groups makes long probe
+// sequences and tombstones, and some resizes are started by hand before the
+// previous migration is finished.
+
+#include "flat-hash-table.h"
+
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_map>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, size_t step) {
+    if (!condition) {
+        fprintf(stderr, "flat-hash-table-test: %s (step %zu)\n", what, step);
+        ++ failures;
+    }
+}
+
+static uint32_t good_hash(uint32_t key) { return key * 2654435761u; }
+
+// Only 64 different hashes, keys pile up in the same few groups
+static uint32_t bad_hash(uint32_t key) { return (key % 64) * 2654435761u; }
+
+template <uint32_t (*hash)(uint32_t)>
+static void check_contents(flat_hash_table<uint32_t, uint64_t, hash>* table,
+                           const std::unordered_map<uint32_t, uint64_t>& model, size_t step) {
+    check(flat_hash_table_size(table) == model.size(), "size differs", step);
+
+    for (const auto& [key, value]: model) {
+        uint64_t* found = flat_hash_table_lookup(table, key);
+        check(found && *found == value, "pair that was inserted is missing", step);
+    }
+
+    size_t visited = 0;
+    FLAT_HASH_TABLE_TRAVERSE(table, pair) {
+        auto expected = model.find(pair->key);
+        check(expected != model.end() && expected->second == pair->value,
+              "traversal visits pair that isn't there", step);
+        ++ visited;
+    }
+
+    check(visited == model.size(), "traversal misses pairs", step);
+}
+
+template <uint32_t (*hash)(uint32_t)>
+static void run(uint32_t seed, uint32_t key_range, size_t steps) {
+    std::mt19937 random(seed);
+
+    flat_hash_table<uint32_t, uint64_t, hash> table;
+    flat_hash_table_create(&table, 16);
+
+    std::unordered_map<uint32_t, uint64_t> model;
+    size_t migrations_seen = 0;
+
+    for (size_t step = 0; step < steps; ++ step) {
+        const uint32_t key = (uint32_t) (random() % key_range);
+        const bool existed = model.count(key) != 0;
+
+        // Grows to the whole range and shrinks back a few times
+        const bool growing = step / (steps / 8) % 2 == 0;
+
+        const uint32_t operation = (uint32_t) (random() % 8);
+        if (operation < 5 && (growing || random() % 2 == 0)) {
+            check(flat_hash_table_insert(&table, key, (uint64_t) step) == !existed,
+                  "insert doesn't report existing key", step);
+            if (!existed)
+                model[key] = step;
+        } else if (operation < 7) {
+            check(flat_hash_table_delete(&table, key) == existed,
+                  "delete doesn't report missing key", step);
+            model.erase(key);
+        } else {
+            uint64_t* found = flat_hash_table_lookup(&table, key);
+            check((found != NULL) == existed, "lookup disagrees with model", step);
+            check(!found || *found == model[key], "lookup finds wrong value", step);
+        }
+
+        if (table.previous != NULL) {
+            ++ migrations_seen;
+
+            // Second resize while pairs are still being moved by the first one,
+            // same size as the one insert does to get rid of tombstones
+            if (random() % 64 == 0)
+                check(trace_is_success(flat_hash_table_rehash(&table, table.capacity)),
+                      "table can't be resized during migration", step);
+        }
+
+        if (step % 997 == 0 || table.previous != NULL)
+            check(table.used + (table.previous ? table.previous->used : 0) == model.size(),
+                  "pairs are lost while they are migrated", step);
+
+        if (step % 4999 == 0)
+            check_contents(&table, model, step);
+    }
+
+    check_contents(&table, model, steps);
+    check(migrations_seen != 0, "operations never overlapped with migration", steps);
+
+    flat_hash_table_destroy(&table);
+}
+
+int main() {
+    run<good_hash>(1, 1 << 16, 200000);
+    run<good_hash>(2, 300, 200000); // Same few keys over and over, tombstones pile up
+    run<bad_hash>(3, 1024, 100000);
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("flat-hash-table-test: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,371 @@
+// Images of the store: files in nested directories, with holes, shared blocks
+// and an unlinked file that's still open, are saved and loaded back into a
+// fresh store, which should have the same files, extents and blocks. Images
+// with misplaced sections, or with blocks and files that don't agree with
+// each other, should be rejected. Random bits of tables and file records are
+// flipped too, images that are still accepted then should restore a store
+// that can be read, written and emptied without losing blocks.
+
+// main.cpp is one translation unit, it's built into the test with its main() renamed
+#define main dedfs_main
+#include "main.cpp"
+#undef main
+
+#include <random>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "image-test: %s\n", what);
+        ++ failures;
+    }
+}
+
+static file_storage* create_storage(bool cdc) {
+    file_storage* storage = new file_storage;
+
+    if (cdc) {
+        cdc_chunker chunker;
+        TRY cdc_chunker_create(&chunker, 2048, 4096, 8192)
+            THROW("Can't create chunker!");
+
+        file_storage_create(storage, DEFAULT_BLOCK_SIZE, &chunker);
+    } else
+        file_storage_create(storage, 4096);
+
+    return storage;
+}
+
+// Every file with a name, parents before children
+static std::vector<element_index_t> named_files(file_storage* storage) {
+    std::vector<element_index_t> order { ROOT_FILE_INDEX };
+
+    for (size_t i = 0; i < order.size(); ++ i)
+        if (directory* children = file_storage_get_file(storage, order[i])->children)
+            for (element_index_t child: children->entries)
+                if (child != linked_list_end_index)
+                    order.push_back(child);
+
+    return order;
+}
+
+static std::string path_of(file_storage* storage, element_index_t index) {
+    std::string path;
+    for (; index != ROOT_FILE_INDEX; index = file_storage_get_file(storage, index)->parent)
+        path = "/" + std::string(file_storage_get_file(storage, index)->name) + path;
+
+    return path.empty() ? "/" : path;
+}
+
+static std::vector<char> contents(file_storage* storage, file* target_file) {
+    std::vector<char> data(target_file->size);
+    check(file_read(storage, target_file, data.data(), data.size(), 0) == data.size(), "file can't be read");
+
+    return data;
+}
+
+// Files, some of them in directories, sharing blocks with each
+// other, with holes and with tails that are shorter than a block
+static void fill(file_storage* storage, std::mt19937& random) {
+    std::vector<char> shared(300000);
+    for (char& byte: shared)
+        byte = (char) random();
+
+    std::vector<element_index_t> directories { ROOT_FILE_INDEX };
+
+    for (int i = 0; i < 40; ++ i) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s-%d", random() % 4 == 0 ? "directory" : "file", i);
+
+        element_index_t parent = directories[random() % directories.size()];
+
+        if (name[0] == 'd') {
+            directories.push_back(file_storage_add_file(storage, parent, name, S_IFDIR | 0755, 1000, 1000));
+            continue;
+        }
+
+        element_index_t index = file_storage_add_file(storage, parent, name, S_IFREG | 0640, 1000, 100);
+        file* target_file = file_storage_get_file(storage, index);
+
+        for (int writes = 1 + random() % 4; writes > 0; -- writes) {
+            const size_t size = 1 + random() % 50000, start = random() % (shared.size() - size);
+            file_write(storage, shared.data() + start, size, target_file->size + random() % 3 * 5000, target_file);
+        }
+
+        if (random() % 4 == 0)
+            file_truncate(storage, target_file, random() % (target_file->size + 1));
+    }
+
+    // Unlinked while it's still open, it's only kept when restored along with the log
+    element_index_t open = file_storage_add_file(storage, ROOT_FILE_INDEX, "open", S_IFREG | 0600, 0, 0);
+    file_write(storage, shared.data(), 70000, 0, file_storage_get_file(storage, open));
+
+    file_storage_remember_file(file_storage_get_file(storage, open));
+    file_storage_unlink_file(storage, open);
+}
+
+static void check_same_files(file_storage* saved, file_storage* loaded, const image_restore& restore) {
+    std::vector<element_index_t> saved_files = named_files(saved), loaded_files = named_files(loaded);
+    check(saved_files.size() == loaded_files.size(), "restored store has another number of files");
+    check(saved->files.used == loaded->files.used, "unlinked file isn't restored");
+
+    for (element_index_t index: saved_files) {
+        auto restored = restore.files.find(index);
+        if (restored == restore.files.end()) {
+            check(false, "file isn't restored");
+            continue;
+        }
+
+        file* before = file_storage_get_file(saved, index);
+        file* after = file_storage_get_file(loaded, restored->second);
+
+        check(path_of(saved, index) == path_of(loaded, restored->second), "file is restored under another path");
+        check(before->mode == after->mode && before->uid == after->uid && before->gid == after->gid,
+              "file's attributes differ");
+        check(before->mtime.tv_sec == after->mtime.tv_sec && before->mtime.tv_nsec == after->mtime.tv_nsec,
+              "file's times differ");
+
+        check(before->extents.used == after->extents.used &&
+              (before->extents.used == 0 ||
+               memcmp(before->extents.extents, after->extents.extents, before->extents.used * sizeof(extent)) == 0),
+              "file's extents differ");
+
+        check(contents(saved, before) == contents(loaded, after), "file's contents differ");
+    }
+
+    check(saved->blocks.block_count() == loaded->blocks.block_count(), "restored store has another number of blocks");
+
+    for (size_t i = 0; i < BLOCK_STORAGE_SHARDS; ++ i)
+        LINKED_LIST_TRAVERSE(&saved->blocks.shards[i].allocator, block, current) {
+            block_id_t id = block_storage::make_block_id(i, linked_list_get_index(&saved->blocks.shards[i].allocator, current));
+            check(loaded->blocks.get_block(id)->references == current->references, "block's references differ");
+        }
+}
+
+// Uses everything that was restored: reads, rewrites, compresses blocks and then
+// deletes every file. No blocks should be left then, unless tables were broken
+static void exercise(file_storage* storage) {
+    std::vector<element_index_t> files = named_files(storage);
+
+    for (element_index_t index: files) {
+        file* target_file = file_storage_get_file(storage, index);
+        if (target_file->children)
+            continue;
+
+        std::vector<char> data = contents(storage, target_file);
+        std::reverse(data.begin(), data.end());
+        file_write(storage, data.data(), std::min(data.size(), (size_t) 10000), data.size() / 3, target_file);
+    }
+
+    // Blocks that weren't read in two passes are cold
+    file_storage_compress_cold_blocks(storage);
+    file_storage_compress_cold_blocks(storage);
+
+    for (element_index_t index: files)
+        if (!file_storage_get_file(storage, index)->children)
+            contents(storage, file_storage_get_file(storage, index));
+
+    pthread_rwlock_wrlock(&storage->files_lock);
+    for (size_t i = files.size() - 1; i > 0; -- i)
+        file_storage_unlink_file(storage, files[i]);
+
+    // Open file is forgotten, so it goes away too
+    LINKED_LIST_TRAVERSE(&storage->files, file, current)
+        if (current->unlinked) {
+            __atomic_store_n(&current->lookups, 0, __ATOMIC_RELAXED);
+            file_storage_delete_file(storage, linked_list_get_index(&storage->files, current));
+            break;
+        }
+    pthread_rwlock_unlock(&storage->files_lock);
+
+    check(storage->blocks.block_count() == 0, "blocks outlive files that used them");
+}
+
+static void destroy(file_storage* storage) {
+    slab_arena_destroy(&storage->file_locks);
+    delete storage;
+}
+
+// Ranges of image that hold tables and file records, the rest are payloads and padding
+static std::vector<std::pair<uint64_t, uint64_t>> metadata_ranges(const image_header* header) {
+    std::vector<std::pair<uint64_t, uint64_t>> ranges { { 0, sizeof(*header) } };
+
+    for (const image_shard& shard: header->shards) {
+        const uint64_t entries = (uint64_t) shard.allocator_unused;
+
+        ranges.push_back({ shard.links_offset, entries * sizeof(linked_list_link) });
+        ranges.push_back({ shard.free_bits_offset, linked_list_bitmap_words(entries) * sizeof(uint64_t) });
+        ranges.push_back({ shard.blocks_offset, entries * sizeof(block) });
+        ranges.push_back({ shard.map_offset, shard.map_capacity * (sizeof(flat_hash_table_control) + sizeof(image_map_pair)) });
+    }
+
+    ranges.push_back({ header->files_offset, header->file_count * sizeof(image_file) });
+    ranges.push_back({ header->names_offset, header->names_size });
+    ranges.push_back({ header->extents_offset, header->extent_count * sizeof(extent) });
+
+    return ranges;
+}
+
+static std::vector<char> read_image(const char* path) {
+    std::vector<char> image;
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return image;
+
+    fseek(file, 0, SEEK_END);
+    image.resize((size_t) ftell(file));
+    fseek(file, 0, SEEK_SET);
+
+    check(fread(image.data(), 1, image.size(), file) == image.size(), "can't read image");
+    fclose(file);
+
+    return image;
+}
+
+static void write_image(const char* path, const std::vector<char>& image) {
+    FILE* file = fopen(path, "wb");
+    check(file && fwrite(image.data(), 1, image.size(), file) == image.size(), "can't write image");
+    if (file)
+        fclose(file);
+}
+
+// Whether image at /path/ is rejected, it's exercised if it's not
+static bool is_rejected(const char* path) {
+    file_storage* storage = create_storage(false);
+
+    const bool rejected = !trace_is_success(file_storage_load(storage, path));
+    if (!rejected)
+        exercise(storage);
+
+    destroy(storage);
+    return rejected;
+}
+
+static void run(bool cdc, uint32_t seed, const char* path) {
+    std::mt19937 random(seed);
+
+    file_storage* saved = create_storage(cdc);
+    fill(saved, random);
+
+    check(trace_is_success(file_storage_save(saved, path)), "image can't be saved");
+
+    // Chunking and block size come from image, not from the store it's loaded into
+    file_storage* loaded = create_storage(!cdc);
+    image_restore restore = { .files = { { ROOT_FILE_INDEX, ROOT_FILE_INDEX } }, .log_sequence = 0 };
+
+    check(trace_is_success(file_storage_load(loaded, path, &restore)), "image can't be loaded");
+    check(loaded->chunking == saved->chunking && loaded->blocks.block_size == saved->blocks.block_size,
+          "image is loaded with another chunking");
+
+    check_same_files(saved, loaded, restore);
+    exercise(loaded);
+    destroy(loaded);
+
+    const std::vector<char> image = read_image(path);
+    const image_header* header = (const image_header*) image.data();
+
+    // Damage that's always caught: where sections are, and records that don't
+    // agree with each other. Image is changed through /damage/, then restored
+    std::vector<char> damaged;
+    auto check_rejected = [&](const char* what, auto damage) {
+        damaged = image;
+        damage((image_header*) damaged.data());
+
+        write_image(path, damaged);
+        check(is_rejected(path), what);
+    };
+
+    // First used block of a shard that has some
+    size_t shard_index = 0;
+    while (header->shards[shard_index].allocator_used == 0)
+        ++ shard_index;
+
+    const image_shard* shard = &header->shards[shard_index];
+    const element_index_t first_block = ((const linked_list_link*) (image.data() + shard->links_offset))[0].next_index;
+
+    auto blocks_of = [&](image_header* target) {
+        return (block*) (damaged.data() + target->shards[shard_index].blocks_offset);
+    };
+
+    auto records_of = [&](image_header* target) {
+        return (image_file*) (damaged.data() + target->files_offset);
+    };
+
+    check_rejected("misaligned section is accepted", [&](image_header* target) {
+        target->shards[49].links_offset ^= 1;
+    });
+
+    check_rejected("block with wrong references is accepted", [&](image_header* target) {
+        ++ blocks_of(target)[first_block].references;
+    });
+
+    check_rejected("block with wrong size is accepted", [&](image_header* target) {
+        blocks_of(target)[first_block].size ^= 1;
+    });
+
+    check_rejected("block with wrong hash is accepted", [&](image_header* target) {
+        blocks_of(target)[first_block].hash.data[0] ^= 1;
+    });
+
+    check_rejected("block that's both used and free is accepted", [&](image_header* target) {
+        ((uint64_t*) (damaged.data() + target->shards[shard_index].free_bits_offset))[first_block / 64]
+            ^= 1ull << first_block % 64;
+    });
+
+    check_rejected("wrong count of used blocks is accepted", [&](image_header* target) {
+        -- target->shards[shard_index].allocator_used;
+    });
+
+    check_rejected("extents with a gap are accepted", [&](image_header* target) {
+        ((extent*) (damaged.data() + target->extents_offset))[0].offset += 1;
+    });
+
+    check_rejected("files with the same index are accepted", [&](image_header* target) {
+        records_of(target)[2].index = records_of(target)[1].index;
+    });
+
+    check_rejected("file with another size than its extents is accepted", [&](image_header* target) {
+        records_of(target)[target->file_count - 1].size += 1;
+    });
+
+    check_rejected("image that's cut short is accepted", [&](image_header*) {
+        damaged.resize(damaged.size() / 2);
+    });
+
+    // Single bits anywhere in tables and records. Many of them aren't read
+    // (empty slots of maps, padding, times), so damaged image can still be
+    // accepted, but then whatever it restores should be consistent
+    const std::vector<std::pair<uint64_t, uint64_t>> ranges = metadata_ranges(header);
+
+    for (size_t i = 0; i < 300; ++ i) {
+        const auto& [offset, size] = ranges[random() % ranges.size()];
+        if (size == 0)
+            continue;
+
+        damaged = image;
+        damaged[offset + random() % size] ^= (char) (1 << random() % 8);
+
+        write_image(path, damaged);
+        is_rejected(path);
+    }
+
+    unlink(path);
+}
+
+int main() {
+    char path[] = "/tmp/image-test-XXXXXX";
+    int fd = mkstemp(path);
+    check(fd != -1, "can't create temporary file");
+    close(fd);
+
+    run(false, 1, path);
+    run(true, 2, path);
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("image-test: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+// Random pushes, inserts, deletes, swaps and linearizations of "lib/linked-list",
+// checked against a std::vector of the same values. After every step the list
+// should have the same order, count and free flags as the model, and every
+// freed element below the high-water mark should be in the free loop exactly
+// once. List starts tiny, so it grows (and takes never used elements) often.
+
+#include "linked-list.h"
+
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, size_t step) {
+    if (!condition) {
+        fprintf(stderr, "linked-list-test: %s (step %zu)\n", what, step);
+        ++ failures;
+    }
+}
+
+static void check_list(linked_list<int>* list, const std::vector<int>& model, size_t step) {
+    check(list->used == model.size(), "used count differs", step);
+    check(list->unused >= 1 && (size_t) list->unused <= list->capacity + 2,
+          "high-water mark is out of list", step);
+
+    // Order of values, and every live element is marked as such
+    std::vector<int> values;
+    std::vector<bool> live(list->unused, false);
+
+    LINKED_LIST_TRAVERSE(list, int, current) {
+        element_index_t index = linked_list_get_index(list, current);
+        if (index <= linked_list_end_index || index >= list->unused || live[index] || values.size() > model.size()) {
+            check(false, "traversal leaves live elements", step);
+            return;
+        }
+
+        live[index] = true;
+        values.push_back(*current);
+    }
+
+    check(values == model, "traversal order differs", step);
+
+    size_t free_count = 0;
+    for (element_index_t i = 1; i < list->unused; ++ i) {
+        check(is_free_element(list, i) == !live[i], "free flag differs", step);
+        free_count += !live[i];
+    }
+
+    check(is_free_element(list, list->unused), "element past high-water mark isn't free", step);
+
+    // Free loop holds exactly the free elements below high-water mark
+    if (free_count == 0) {
+        check(list->free == linked_list_no_free_index, "free loop isn't empty", step);
+        return;
+    }
+
+    if (list->free == linked_list_no_free_index) {
+        check(false, "free loop lost its elements", step);
+        return;
+    }
+
+    std::vector<bool> looped(list->unused, false);
+    size_t loop_length = 0;
+    element_index_t current = list->free;
+
+    do {
+        if (current <= linked_list_end_index || current >= list->unused || looped[current] ||
+            live[current] || list->links[list->links[current].next_index].prev_index != current) {
+            check(false, "free loop is broken", step);
+            return;
+        }
+
+        looped[current] = true, ++ loop_length;
+        current = list->links[current].next_index;
+    } while (current != list->free);
+
+    check(loop_length == free_count, "free loop misses free elements", step);
+}
+
+// Index of element at /position/ in list's order
+static element_index_t index_at(linked_list<int>* list, size_t position) {
+    element_index_t index = linked_list_head_index(list);
+    while (position -- > 0)
+        index = linked_list_next_index(list, index);
+
+    return index;
+}
+
+static void run(uint32_t seed, size_t steps) {
+    std::mt19937 random(seed);
+
+    linked_list<int> list;
+    linked_list_create(&list, 1);
+
+    std::vector<int> model;
+    int next_value = 1;
+
+    for (size_t step = 0; step < steps; ++ step) {
+        // Grows and shrinks back to nothing a few times, so the free loop empties
+        const bool growing = step / 500 % 2 == 0;
+
+        switch (random() % 6) {
+        case 0:
+            check(trace_is_success(linked_list_push_front(&list, next_value)), "can't push front", step);
+            model.insert(model.begin(), next_value ++);
+            break;
+
+        case 1:
+            check(trace_is_success(linked_list_push_back(&list, next_value)), "can't push back", step);
+            model.push_back(next_value ++);
+            break;
+
+        case 2: {
+            // After a random element, next one in memory is taken when it's free
+            size_t position = model.empty() ? 0 : random() % model.size();
+            element_index_t after = model.empty() ? linked_list_end_index : index_at(&list, position);
+
+            element_index_t index;
+            check(trace_is_success(linked_list_insert_after(&list, next_value, after, &index)),
+                  "can't insert", step);
+            check(*linked_list_get_pointer(&list, index) == next_value, "inserted element isn't there", step);
+
+            model.insert(model.empty() ? model.end() : model.begin() + (ptrdiff_t) position + 1, next_value ++);
+            break;
+        }
+
+        case 3: case 4:
+            if (model.empty() || (growing && random() % 2 == 0))
+                break;
+
+            {
+                size_t position = random() % model.size();
+                check(trace_is_success(linked_list_delete(&list, index_at(&list, position))),
+                      "can't delete", step);
+                model.erase(model.begin() + (ptrdiff_t) position);
+            }
+            break;
+
+        case 5:
+            if (list.unused <= 2)
+                break;
+
+            // Any two elements below high-water mark, live or free
+            if (random() % 16 == 0)
+                check(trace_is_success(linked_list_linearize(&list)), "can't linearize", step);
+            else {
+                element_index_t first  = 1 + (element_index_t) (random() % (size_t) (list.unused - 1));
+                element_index_t second = 1 + (element_index_t) (random() % (size_t) (list.unused - 1));
+
+                check(trace_is_success(linked_list_swap(&list, first, second)), "can't swap", step);
+            }
+            break;
+        }
+
+        check_list(&list, model, step);
+        if (failures != 0)
+            break; // Everything after the first failure is noise
+    }
+
+    linked_list_destroy(&list);
+}
+
+int main() {
+    for (uint32_t seed = 1; seed <= 20; ++ seed)
+        run(seed, 5000);
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("linked-list-test: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+// Round trip of "lib/lz" on inputs that compress well, badly and not at
+// all, and decompression of inputs that are cut short or damaged, which
+// should be rejected (or at least stay inside of destination).
+
+#include "lz.h"
+
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, size_t size) {
+    if (!condition) {
+        fprintf(stderr, "lz-test: %s (input of %zu bytes)\n", what, size);
+        ++ failures;
+    }
+}
+
+static std::vector<char> compress(const std::vector<char>& input) {
+    std::vector<char> compressed(lz_bound(input.size()));
+
+    size_t size = lz_compress(input.data(), input.size(), compressed.data(), compressed.size());
+    compressed.resize(size);
+
+    return compressed;
+}
+
+// Input shouldn't be empty, blocks never are
+static void check_round_trip(const std::vector<char>& input) {
+    std::vector<char> compressed = compress(input);
+    check(!compressed.empty(), "input doesn't fit in lz_bound", input.size());
+
+    // Destination is exactly as big as output, so overruns show up with sanitizers
+    std::vector<char> output(input.size());
+    check(lz_decompress(compressed.data(), compressed.size(), output.data(), output.size()),
+          "compressed input is rejected", input.size());
+    check(output == input, "decompressed input differs", input.size());
+
+    // Size is part of the format, stream that holds less or more is damaged
+    std::vector<char> shorter(input.size() - 1);
+    check(!lz_decompress(compressed.data(), compressed.size(), shorter.data(), shorter.size()),
+          "input is decompressed into less space than it takes", input.size());
+
+    std::vector<char> longer(input.size() + 1);
+    check(!lz_decompress(compressed.data(), compressed.size(), longer.data(), longer.size()),
+          "input is decompressed into more bytes than it has", input.size());
+
+    for (size_t cut = 0; cut < compressed.size(); ++ cut)
+        check(!lz_decompress(compressed.data(), cut, output.data(), output.size()),
+              "compressed input that's cut short is accepted", input.size());
+}
+
+static std::vector<char> repeating(size_t size, size_t period) {
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; ++ i)
+        data[i] = (char) ('a' + i % period % 26);
+
+    return data;
+}
+
+static std::vector<char> random_bytes(std::mt19937& random, size_t size) {
+    std::vector<char> data(size);
+    for (char& byte: data)
+        byte = (char) random();
+
+    return data;
+}
+
+// Words from a small vocabulary, like text or configs, matches of all lengths
+static std::vector<char> words(std::mt19937& random, size_t size) {
+    static const char* VOCABULARY[] = { "block ", "file ", "extent ", "dedup ", "the ", "of ",
+                                        "slab_arena_reserve", "\n", "0123456789", "    " };
+
+    std::vector<char> data;
+    while (data.size() < size) {
+        const char* word = VOCABULARY[random() % (sizeof(VOCABULARY) / sizeof(*VOCABULARY))];
+        data.insert(data.end(), word, word + strlen(word));
+    }
+
+    data.resize(size);
+    return data;
+}
+
+int main() {
+    std::mt19937 random(42);
+
+    const size_t SIZES[] = { 1, 5, 12, 13, 64, 255, 4096, 4097, 8192, 65535, LZ_MAX_INPUT };
+
+    for (size_t size: SIZES) {
+        check_round_trip(std::vector<char>(size, 0));
+        check_round_trip(repeating(size, 1 + size % 7));
+        check_round_trip(repeating(size, 300)); // Matches with lengths past a nibble
+        check_round_trip(random_bytes(random, size));
+        check_round_trip(words(random, size));
+    }
+
+    // Incompressible data doesn't fit below its own size
+    std::vector<char> noise = random_bytes(random, 4096), small(4096 / 2);
+    check(lz_compress(noise.data(), noise.size(), small.data(), small.size()) == 0,
+          "incompressible input fits in half of its size", noise.size());
+
+    // Match that reaches before the start of output, and one with zero offset
+    const char BEFORE_START[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+    const char ZERO_OFFSET[]  = { 0x10, 'a', 0x00, 0x00, 0x00 };
+
+    char output[64];
+    check(!lz_decompress(BEFORE_START, sizeof(BEFORE_START), output, 5),
+          "match before the start of output is accepted", 5);
+    check(!lz_decompress(ZERO_OFFSET, sizeof(ZERO_OFFSET), output, 5),
+          "match with zero offset is accepted", 5);
+
+    // Damaged streams may decode to something, but never past destination
+    std::vector<char> text = words(random, 16384);
+    std::vector<char> compressed = compress(text);
+    std::vector<char> decompressed(text.size());
+
+    for (int round = 0; round < 10000; ++ round) {
+        std::vector<char> damaged = compressed;
+        for (int flips = 1 + random() % 4; flips > 0; -- flips)
+            damaged[random() % damaged.size()] ^= (char) (1 << random() % 8);
+
+        lz_decompress(damaged.data(), damaged.size(), decompressed.data(), decompressed.size());
+    }
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("lz-test: ok\n");
+    return EXIT_SUCCESS;
+}
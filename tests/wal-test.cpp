@@ -0,0 +1,198 @@
+// Round trip of "lib/wal": records appended from several threads are
+// replayed in order with the numbers they got, a log that's torn in a
+// header or in a record, or damaged in the middle, replays up to the last
+// intact record, and records appended after wal_reset are all that's left.
+
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "wal-test: %s\n", what);
+        ++ failures;
+    }
+}
+
+struct replayed_record {
+    uint64_t sequence;
+    std::vector<char> data;
+};
+
+static stack_trace* collect(void* context, uint64_t sequence, const char* record, size_t size) {
+    auto* records = (std::vector<replayed_record>*) context;
+    records->push_back({ sequence, std::vector<char>(record, record + size) });
+
+    return SUCCESS();
+}
+
+static std::vector<replayed_record> replay(const char* path, uint64_t* last) {
+    std::vector<replayed_record> records;
+
+    stack_trace* trace = wal_replay(path, collect, &records, last);
+    check(trace_is_success(trace), "log can't be replayed");
+
+    return records;
+}
+
+// Contents of record /sequence/, different sizes (with empty ones) and bytes for each
+static std::vector<char> record_data(uint64_t sequence) {
+    std::vector<char> data(sequence * 37 % 300);
+    for (size_t i = 0; i < data.size(); ++ i)
+        data[i] = (char) (sequence * 131 + i);
+
+    return data;
+}
+
+static uint64_t append(wal* log, uint64_t sequence) {
+    std::vector<char> data = record_data(sequence);
+
+    // Reserved room can be bigger than the record
+    char* record = wal_reserve(log, data.size() + 16);
+    if (!data.empty())
+        memcpy(record, data.data(), data.size());
+
+    return wal_commit(log, data.size());
+}
+
+// Records from /first/ to /last/ are there, in order and intact
+static void check_records(const std::vector<replayed_record>& records, uint64_t first, uint64_t last,
+                          const char* what) {
+    bool intact = records.size() == last - first + 1;
+    for (size_t i = 0; intact && i < records.size(); ++ i)
+        intact = records[i].sequence == first + i && records[i].data == record_data(first + i);
+
+    check(intact, what);
+}
+
+static off_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static const size_t THREADS = 4, RECORDS_PER_THREAD = 500;
+
+int main() {
+    char directory[] = "/tmp/wal-test-XXXXXX";
+    check(mkdtemp(directory) != NULL, "can't make temporary directory");
+
+    char path[sizeof(directory) + 16];
+    snprintf(path, sizeof(path), "%s/log", directory);
+
+    // Appended from several threads, numbered in the order they got the log
+    static wal log;
+    check(trace_is_success(wal_open(&log, path, 0)), "log can't be opened");
+    wal_start(&log);
+
+    std::vector<std::thread> appenders;
+    for (size_t i = 0; i < THREADS; ++ i)
+        appenders.emplace_back([] {
+            for (size_t j = 0; j < RECORDS_PER_THREAD; ++ j) {
+                // Contents depend on the number, which is only known when record is
+                // reserved, so every record is written as its own number's contents
+                char* record = wal_reserve(&log, 300);
+                std::vector<char> data = record_data(log.sequence + 1);
+
+                if (!data.empty())
+                    memcpy(record, data.data(), data.size());
+
+                wal_commit(&log, data.size());
+            }
+        });
+
+    for (std::thread& appender: appenders)
+        appender.join();
+
+    const uint64_t total = THREADS * RECORDS_PER_THREAD;
+    check(wal_sequence(&log) == total, "records are numbered wrong");
+    check(wal_wait(&log, total), "records aren't durable");
+
+    uint64_t last = 0;
+    check_records(replay(path, &last), 1, total, "replayed records differ from appended ones");
+    check(last == total, "last replayed record is wrong");
+
+    // Reset drops everything, records after it go on with the numbering
+    check(trace_is_success(wal_reset(&log)), "log can't be reset");
+    check(file_size(path) == 0, "reset log isn't empty");
+
+    const uint64_t after_reset = 10;
+    for (uint64_t i = 1; i <= after_reset; ++ i)
+        append(&log, total + i);
+
+    check(wal_wait(&log, total + after_reset), "records after reset aren't durable");
+    wal_close(&log);
+
+    last = 0;
+    std::vector<replayed_record> records = replay(path, &last);
+    check_records(records, total + 1, total + after_reset, "records after reset are replayed wrong");
+
+    // Offsets where each record starts, and the end of the log
+    std::vector<off_t> starts;
+    off_t end = 0;
+    for (const replayed_record& record: records)
+        starts.push_back(end), end += (off_t) (sizeof(wal_record_header) + record.data.size());
+
+    check(end == file_size(path), "log has bytes past its records");
+
+    // Torn in the header of the last record
+    check(truncate(path, starts.back() + (off_t) sizeof(wal_record_header) / 2) == 0, "can't cut log");
+    last = 0;
+    check_records(replay(path, &last), total + 1, total + after_reset - 1, "torn header isn't dropped");
+    check(last == total + after_reset - 1, "last record before torn header is wrong");
+
+    // Torn in the record itself, the one before last has some bytes
+    const uint64_t before_last = total + after_reset - 1;
+    check(!record_data(before_last).empty(), "record before last should have contents");
+
+    check(truncate(path, starts[starts.size() - 1] - 1) == 0, "can't cut log");
+    last = 0;
+    check_records(replay(path, &last), total + 1, before_last - 1, "torn record isn't dropped");
+
+    // Damaged in the middle, nothing after it is trusted
+    const size_t damaged = 3;
+    check(!records[damaged].data.empty(), "damaged record should have contents");
+
+    FILE* file = fopen(path, "r+b");
+    check(file != NULL, "can't open log");
+    if (file) {
+        const off_t position = starts[damaged] + (off_t) sizeof(wal_record_header);
+
+        fseek(file, position, SEEK_SET);
+        const int byte = fgetc(file);
+
+        fseek(file, position, SEEK_SET);
+        fputc(byte ^ 0x20, file);
+        fclose(file);
+    }
+
+    last = 0;
+    check_records(replay(path, &last), total + 1, total + damaged, "damaged record isn't dropped");
+
+    // Log that's reopened keeps its records, new ones go after them
+    check(truncate(path, starts[damaged]) == 0, "can't cut log");
+    check(trace_is_success(wal_open(&log, path, total + damaged)), "log can't be reopened");
+    wal_start(&log);
+
+    append(&log, total + damaged + 1);
+    check(wal_wait(&log, total + damaged + 1), "record after reopening isn't durable");
+    wal_close(&log);
+
+    last = 0;
+    check_records(replay(path, &last), total + 1, total + damaged + 1, "reopened log is replayed wrong");
+
+    unlink(path);
+    rmdir(directory);
+
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    printf("wal-test: ok\n");
+    return EXIT_SUCCESS;
+}